@@ -1,9 +1,16 @@
 #ifndef __AARCH64_COMMON
 #define __AARCH64_COMMON
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define AARCH64_MSR(REG, VAL) asm volatile ("msr " #REG ", %0" : : "r" (VAL))
 #define AARCH64_MRS(REG, VAL) asm volatile ("mrs %0, " #REG : "=r" (VAL))
 
+/* DCZID_EL0 fields, log2 of the dc zva block size in words and the dc zva prohibited bit. */
+#define AARCH64_DCZID_BS_MASK 0xF
+#define AARCH64_DCZID_DZP (1 << 4)
+
 void aarch64_nop();
 void aarch64_svc();
 void aarch64_sev();
@@ -14,5 +21,6 @@ void aarch64_dsb_inner();
 void aarch64_dsb();
 void aarch64_isb();
 void aarch64_cache_flush_invalidate(uint64_t addr);
+void aarch64_zero_range(void * addr, size_t size);
 
 #endif
\ No newline at end of file
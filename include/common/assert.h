@@ -25,5 +25,21 @@
 /* Hacky solution to stop all cores when 1 panics, take the printlock to deadlock everyone else on next printf call. */
 #define DEBUG_PANIC_ALL(MSG) do { DEBUG(MSG); lock_printlock();} while(0)
 
+/* Compile time check levels, selected with -DCHECK_LEVEL (make release / make debug-checks).
+ * CHECK_LEVEL_CHEAP keeps the constant time invariants on the hot paths,
+ * CHECK_LEVEL_FULL adds the list walks and CHECK_LEVEL_OFF compiles every check out. */
+#define CHECK_LEVEL_OFF 0
+#define CHECK_LEVEL_CHEAP 1
+#define CHECK_LEVEL_FULL 2
+
+#ifndef CHECK_LEVEL
+#define CHECK_LEVEL CHECK_LEVEL_CHEAP
+#endif
+
+#define CHECK_ENABLED(LEVEL) (CHECK_LEVEL >= (LEVEL))
+/* Disabled checks are still type checked but the condition is never evaluated. */
+#define CHECK_CHEAP(X, MSG) do { if (CHECK_ENABLED(CHECK_LEVEL_CHEAP)) ASSERT_PANIC(X, MSG); } while(0)
+#define CHECK_FULL(X, MSG) do { if (CHECK_ENABLED(CHECK_LEVEL_FULL)) ASSERT_PANIC(X, MSG); } while(0)
+
 #endif
 
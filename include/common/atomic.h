@@ -20,6 +20,9 @@ int atomic_cmpxchg_try_64(uint64_t * ptr, uint64_t old_val, uint64_t new_val, ui
 extern uint64_t atomic_fetch_add_64(uint64_t *addr, uint64_t val);
 extern uint64_t atomic_fetch_sub_64(uint64_t *addr, uint64_t val);
 extern uint64_t atomic_fetch_or_64(uint64_t *addr, uint64_t val);
+extern uint64_t atomic_fetch_and_64(uint64_t *addr, uint64_t val);
+/* Unlike the fetch ops this returns the value that was replaced. */
+extern uint64_t atomic_xchg_64(uint64_t *addr, uint64_t val);
 extern uint32_t atomic_ld_32(uint32_t * ptr);
 extern uint64_t atomic_ld_64(uint64_t * ptr);
 extern int atomic_str_32(uint32_t * ptr, uint32_t val);
@@ -14,5 +14,10 @@ void bitmap_set(bitmap_t * bitmap, unsigned int index);
 void bitmap_flip(bitmap_t * bitmap, unsigned int index);
 unsigned int bitmap_get(bitmap_t * bitmap, unsigned int index);
 void bitmap_free(bitmap_t * bitmap, unsigned int index);
+/* Range ops work a whole bitmap entry at a time. */
+void bitmap_set_range(bitmap_t * bitmap, unsigned int index, unsigned int num);
+void bitmap_free_range(bitmap_t * bitmap, unsigned int index, unsigned int num);
+unsigned int bitmap_range_is_set(bitmap_t * bitmap, unsigned int index, unsigned int num);
+unsigned int bitmap_range_is_free(bitmap_t * bitmap, unsigned int index, unsigned int num);
 
 #endif
@@ -14,8 +14,12 @@ typedef uint64_t bits_t;
 #define IS_BIT_ALIGNED(X,Y) (BIT_ALIGN(X, Y) ? 0 : 1)
 #define BITS_INVERT(X, Y) ((X) ^ (Y))
 
+/* Index of the highest set bit, 0 for no bits set. */
 unsigned int bits_msb_index_64(uint64_t bits);
 unsigned int bits_msb_index_32(uint32_t bits);
+/* Count of leading/trailing zero bits, bits must not be 0. */
+unsigned int bits_clz_64(uint64_t bits);
+unsigned int bits_ctz_64(uint64_t bits);
 unsigned int bits_count_64(uint64_t bits);
 unsigned int bits_count_32(uint32_t bits);
 void bits_set_64(uint64_t * bits, unsigned int index, unsigned int num_bits);
@@ -6,6 +6,7 @@
 
 unsigned int math_log2_64(uint64_t num);
 unsigned int math_is_power2_64(uint64_t num);
+/* Smallest power of two that is at least num. */
 unsigned int math_align_power2_64(uint64_t num);
 
 #define MATH_LOG2(X, RET) do { RET=0; while (num > 1) { num >>= 1; ret++; }} while(0)
@@ -14,10 +14,65 @@
  * Other bits are then used for other memory subsystem flags e.g. slab, cache. */
 #define KALLOC_FLAG_OFFSET_START 16
 
+/* kalloc flags */
+/* The freed pages are not expected to be touched again soon, keep them at the cold end of the pcp lists. */
+#define KALLOC_COLD_F (1 << (KALLOC_FLAG_OFFSET_START + 0))
+/* The pages are returned zeroed, taken from the pre zeroed pool when possible. */
+#define KALLOC_ZERO_F (1 << (KALLOC_FLAG_OFFSET_START + 1))
+/* Pages default to unmovable, this steers the pages to areas of the reclaimable mm type. */
+#define KALLOC_RECLAIMABLE_F (1 << (KALLOC_FLAG_OFFSET_START + 2))
+
+#define KALLOC_FLAGS_TYPE(FLAGS) (((FLAGS) & KALLOC_RECLAIMABLE_F) ? MM_TYPE_RECLAIMABLE : MM_TYPE_UNMOVABLE)
+
+/* Size classes of the kalloc entry caches, larger allocs are served with whole pages. */
+#define KALLOC_ENTRY_NUM 16
+#define KALLOC_MAX_ENTRY_ALLOC 3072
+/* The size class table is indexed in steps of this many bytes, fine enough to tell 24 from 32. */
+#define KALLOC_ENTRY_SIZE_SHIFT 3
+
+/* Number of named object caches that can exist at once. */
+#define KALLOC_NAMED_CACHE_NUM 8
+/* Named caches get slabs of enough pages to hold at least this many objs. */
+#define KALLOC_NAMED_CACHE_MIN_OBJ_NUM 8
+
+/* Internal fragmentation of a size class, counted over every alloc made from it in profile builds (-DKALLOC_PROFILE). */
+typedef struct kalloc_entry_stats {
+    size_t size;
+    uint64_t alloc_num;
+    /* Bytes asked for and the bytes lost to rounding up to the class size. */
+    uint64_t req_size;
+    uint64_t waste_size;
+} kalloc_entry_stats_t;
+
 int kalloc_init();
 void * kalloc_alloc(size_t size, flags_t flags);
 int kalloc_free(void * object, flags_t flags);
+/* Size class an alloc of size bytes is served from. */
+unsigned int kalloc_entry_num(size_t size);
+void kalloc_entry_stats(unsigned int entry_num, kalloc_entry_stats_t * stats);
+void kalloc_entry_dump();
 void * kalloc_pages(unsigned int page_num, flags_t flags);
+unsigned int kalloc_pages_bulk(unsigned int page_num, unsigned int count, void ** ptrs, flags_t flags);
 int kalloc_free_pages(void * page_ptr, flags_t flags);
+/* Free the pages of every empty slab in the kalloc caches. Returns the number of pages freed. */
+unsigned int kalloc_shrink_caches();
+/* Give back the slabs that have stayed empty for a while, called from the reclaim task every period. */
+unsigned int kalloc_reap_caches();
+/* Move the empty slabs of every kalloc cache onto the pages move_pages hands back for them, see
+ * kalloc_cache_move_slabs. Returns the number of pages moved. */
+unsigned int kalloc_move_slabs(void *(*move_pages)(void *, unsigned int));
+/* Cache of objs of a single type, constructed with ctor once when their slab is populated and destructed with
+ * dtor when the slab is given back. Objs come back from kalloc_obj_alloc constructed and have to be freed in
+ * that state. align has to be a power of two up to KALLOC_SLAB_MAX_ALIGN. Returns NULL if there is no free cache. */
+kalloc_cache_t * kalloc_cache_create(const char * name, size_t size, size_t align, void (*ctor)(void *), void (*dtor)(void *));
+/* Every obj of the cache has to be freed, its slabs are destructed and their pages given back. */
+int kalloc_cache_destroy(kalloc_cache_t * cache);
+void * kalloc_obj_alloc(kalloc_cache_t * cache);
+/* kalloc_free also finds the named cache of an obj, this skips the lookup. */
+int kalloc_obj_free(kalloc_cache_t * cache, void * obj);
+/* Allocs of whole 2MB blocks aligned to MMU_LEVEL1_BLOCKSIZE, e.g. for framebuffers and DMA rings. */
+void * kalloc_huge_pages(unsigned int huge_num, flags_t flags);
+int kalloc_is_huge_page(void * page_ptr);
+int kalloc_free_huge_pages(void * page_ptr, flags_t flags);
 
 #endif
\ No newline at end of file
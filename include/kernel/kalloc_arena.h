@@ -0,0 +1,57 @@
+#ifndef __KALLOC_ARENA_H
+#define __KALLOC_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+
+/* Pages taken per chunk unless an alloc needs more. */
+#define KALLOC_ARENA_CHUNK_PAGE_NUM 4
+/* Allocs are aligned to at least this. */
+#define KALLOC_ARENA_MIN_ALIGN 8
+
+/* Header at the start of the pages of every chunk, the chunks are chained newest first. */
+typedef struct kalloc_arena_chunk {
+    struct kalloc_arena_chunk * prev;
+    unsigned int page_num;
+    /* Bytes of the chunk handed out so far, the header included. */
+    size_t used;
+} kalloc_arena_chunk_t __attribute__ ((aligned (16)));
+
+typedef struct kalloc_arena_stats {
+    uint64_t alloc_num;
+    /* Bytes asked for, and the bytes lost to alignment and to the chunk tails too small for the next alloc. */
+    uint64_t alloc_size;
+    uint64_t waste_size;
+    uint64_t rewind_num;
+    unsigned int chunk_num;
+    unsigned int page_num;
+    unsigned int max_page_num;
+} kalloc_arena_stats_t;
+
+/* Bump allocator for objs that all go away at once. Objs are never freed on their own, the arena is rewound
+ * to a mark or destroyed as a whole. Not locked, an arena belongs to a single user. */
+typedef struct kalloc_arena {
+    kalloc_arena_chunk_t * chunk;
+    unsigned int chunk_page_num;
+    flags_t flags;
+    kalloc_arena_stats_t stats;
+} kalloc_arena_t;
+
+/* Position of an arena to rewind back to. */
+typedef struct kalloc_arena_mark {
+    kalloc_arena_chunk_t * chunk;
+    size_t used;
+} kalloc_arena_mark_t;
+
+/* chunk_page_num of 0 takes KALLOC_ARENA_CHUNK_PAGE_NUM, flags are passed on to kalloc_pages. */
+void kalloc_arena_init(kalloc_arena_t * arena, unsigned int chunk_page_num, flags_t flags);
+/* align has to be a power of two, 0 for KALLOC_ARENA_MIN_ALIGN. Returns NULL if no pages could be had. */
+void * kalloc_arena_alloc(kalloc_arena_t * arena, size_t size, size_t align);
+void kalloc_arena_mark(kalloc_arena_t * arena, kalloc_arena_mark_t * mark);
+/* Give back everything allocated since the mark, the chunks taken after it are freed. */
+void kalloc_arena_rewind(kalloc_arena_t * arena, kalloc_arena_mark_t * mark);
+/* Free every chunk of the arena, it can be used again right away. */
+void kalloc_arena_destroy(kalloc_arena_t * arena);
+
+#endif
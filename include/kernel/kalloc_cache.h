@@ -11,6 +11,19 @@
 #define KALLOC_CACHE_NO_EXPAND_F (1 << 1)
 #define KALLOC_CACHE_NO_SHRINK_F (1 << 2)
 #define KALLOC_CACHE_NO_LINK_F (1 << 3)
+/* Round the objs up to whole cache lines so no two objs share a line. */
+#define KALLOC_CACHE_HWCACHE_ALIGN_F (1 << 4)
+/* Start the objs of every slab at the same offset instead of rotating through the colors. */
+#define KALLOC_CACHE_NO_COLOR_F (1 << 5)
+
+/* L1 data cache line of the Cortex-A53, slabs are colored in steps of a line. */
+#define KALLOC_CACHE_LINE_SIZE 64
+
+/* Caches with a page allocator grow once this percent of their objects are in use, so the alloc that
+ * finds the cache full is rare. */
+#define KALLOC_CACHE_EXPAND_THRESHOLD 90
+/* Number of reap passes a slab has to stay empty before its pages are given back. */
+#define KALLOC_CACHE_REAP_DELAY 5
 
 typedef struct kalloc_cache {
     unsigned int max_num;
@@ -21,10 +34,29 @@ typedef struct kalloc_cache {
     ll_head_t full_list;
     unsigned int slab_init_page_num;
     unsigned int page_num;
+    /* Returns page_num pages for a new slab or NULL, the destructor gets back the pages of an empty slab. */
     void *(*page_allocator)(unsigned int, flags_t);
     int (*page_destructor)(void *, unsigned int, flags_t);
+    /* Percent of max_num in use that makes the cache grow, and the slabs added per grow. */
+    unsigned int expand_threshold;
+    unsigned int expand_slab_num;
+    /* Set when the page allocator fails a grow, growing ahead is skipped until a grow succeeds or an obj is freed. */
+    unsigned int grow_failed;
+    unsigned int reap_delay;
+    unsigned int reap_num;
+    /* Slabs start their objs color_next cache lines in, cycling through the color_num offsets the
+     * space left over in a slab allows, so the first objs of every slab do not land in the same cache sets. */
+    unsigned int color_num;
+    unsigned int color_next;
+    /* Run on every obj when its slab is added and when the slab is taken back out, so objs are handed out
+     * and have to be freed in their constructed state. Objs are passed through the upper mapping. */
+    void (*ctor)(void *);
+    void (*dtor)(void *);
+    const char * name;
     spinlock_t lock;
     flags_t flags;
+    /* Left to the owner of the cache, kalloc stores the size class of its entry caches here. */
+    unsigned int index;
 } kalloc_cache_t;
 
 int kalloc_cache_init(kalloc_cache_t * cache, size_t obj_size, 
@@ -32,9 +64,28 @@ int kalloc_cache_init(kalloc_cache_t * cache, size_t obj_size,
                         void *(*page_allocator)(unsigned int, flags_t), 
                         int (*page_destructor)(void *, unsigned int, flags_t), 
                         flags_t flags);
+/* Has to be set before the cache holds any slab, the objs already in it would not be constructed. */
+void kalloc_cache_set_ctor(kalloc_cache_t * cache, void (*ctor)(void *), void (*dtor)(void *));
 int kalloc_cache_add_slab(kalloc_cache_t * cache, kalloc_slab_t * slab);
 kalloc_slab_t * kalloc_cache_add_slab_pages(kalloc_cache_t * cache, void * page_ptr, unsigned int page_num);
+/* Take an empty slab out of the cache, its pages go back through the page destructor if the cache has one. */
 int kalloc_cache_remove_slab(kalloc_cache_t * cache, kalloc_slab_t * slab);
+/* Add slab_num slabs with pages from the page allocator. Returns the number of slabs added. */
+unsigned int kalloc_cache_grow(kalloc_cache_t * cache, unsigned int slab_num);
+/* Called periodically, gives back the slabs that have been empty for reap_delay passes.
+ * Returns the number of pages freed. */
+unsigned int kalloc_cache_reap(kalloc_cache_t * cache);
+/* Take an empty slab out of the cache, NULL if there is none. The slab memory is left to the caller to free. */
+kalloc_slab_t * kalloc_cache_pop_free_slab(kalloc_cache_t * cache);
+/* Pages held by the empty slabs of the cache. */
+unsigned int kalloc_cache_free_page_num(kalloc_cache_t * cache);
+/* Give the empty slabs added with kalloc_cache_add_slab_pages back through the page destructor until
+ * page_num pages are freed. Returns the number of pages freed. */
+unsigned int kalloc_cache_shrink(kalloc_cache_t * cache, unsigned int page_num);
+/* Rebuild the empty slabs of the cache on the pages move_pages returns for them and give the old pages back through
+ * the page destructor, which has to be able to free the new ones. move_pages gets the pages and page count of each
+ * empty slab and returns NULL for the slabs that should stay. Returns the number of pages moved. */
+unsigned int kalloc_cache_move_slabs(kalloc_cache_t * cache, void *(*move_pages)(void *, unsigned int));
 void * kalloc_cache_alloc(kalloc_cache_t * cache);
 int kalloc_cache_free(kalloc_cache_t * cache, void * obj);
 
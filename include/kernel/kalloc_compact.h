@@ -0,0 +1,36 @@
+#ifndef __KALLOC_COMPACT_H
+#define __KALLOC_COMPACT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/lock.h>
+
+/* Memorder the compaction task tries to keep blocks of around, e.g. for huge pages and large buffers. */
+#define KALLOC_COMPACT_ORDER 8
+/* The task compacts on its own once the frag index of KALLOC_COMPACT_ORDER is at least this. */
+#define KALLOC_COMPACT_FRAG_THRESHOLD 500
+/* How long the task sleeps between checks. */
+#define KALLOC_COMPACT_PERIOD_US (TIME_MS_TO_US(50))
+
+typedef struct kalloc_compact_stats {
+    /* Compaction passes and the passes asked for by failed allocs. */
+    uint64_t run_num;
+    uint64_t request_num;
+    /* Pages of empty slabs moved out of fragmented areas into denser ones. */
+    uint64_t slab_page_num;
+    /* Blocks of the compacted memorder gained over all the passes. */
+    uint64_t block_gain_num;
+} kalloc_compact_stats_t;
+
+void kalloc_compact_init();
+/* Run one compaction pass for memorder. Returns the number of blocks of memorder gained. */
+unsigned int kalloc_compact(unsigned int memorder);
+/* Ask the compaction task for a pass and wake it, safe to call from any context but with the sched lock held. */
+void kalloc_compact_request(unsigned int memorder);
+/* Body of the compaction kernel task. */
+void kalloc_compact_task();
+kalloc_compact_stats_t * kalloc_compact_stats();
+void kalloc_compact_dump();
+
+#endif
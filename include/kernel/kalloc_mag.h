@@ -0,0 +1,80 @@
+#ifndef __KALLOC_MAG_H
+#define __KALLOC_MAG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/lock.h>
+#include <kernel/cpu.h>
+#include <kernel/kalloc_cache.h>
+
+/* Per cpu magazines that sit in front of a kalloc cache. Each cpu holds a loaded and a previous
+ * magazine of objects and only goes to the depot of the cache once both are empty (alloc) or
+ * both are full (free), so the common case never leaves the core. */
+#define KALLOC_MAG_SIZE 15
+/* Magazines kept in the depot on top of the two every cpu holds. */
+#define KALLOC_MAG_DEPOT_NUM (CORE_NUM * 2)
+#define KALLOC_MAG_NUM (CORE_NUM * 2 + KALLOC_MAG_DEPOT_NUM)
+/* Objects the remote free list of a cpu holds, past that the other cpus free into their own magazines again. */
+#define KALLOC_MAG_REMOTE_MAX (KALLOC_MAG_SIZE * 4)
+
+typedef struct kalloc_mag {
+    unsigned int round_num;
+    void * rounds[KALLOC_MAG_SIZE];
+    struct kalloc_mag * next;
+} kalloc_mag_t;
+
+/* Only touched by its own core with irqs disabled, the lock is only there for remote drains. */
+typedef struct kalloc_mag_cpu {
+    kalloc_mag_t * loaded;
+    kalloc_mag_t * previous;
+    spinlock_t lock;
+    uint64_t alloc_num;
+    uint64_t free_num;
+    /* Allocs and frees that had to go down to the slab layer. */
+    uint64_t alloc_miss_num;
+    uint64_t free_miss_num;
+    /* The objs last taken off the remote free list of this cpu, handed out before the magazines. The count is of
+     * the objs handed out since, it comes off the list count once the batch is used up. */
+    uint64_t remote_batch;
+    uint64_t remote_taken_num;
+    /* Frees this cpu pushed on the remote free list of another cpu, and the batches it took off its own. */
+    uint64_t remote_free_num;
+    uint64_t remote_reclaim_num;
+} kalloc_mag_cpu_t __attribute__ ((aligned (8)));
+
+/* Remote free list of a cpu, on a line of its own as every other cpu pushes to it. Holds the objs the cpu took out of
+ * the cache and another cpu freed, linked through their first word. Pushed with the ldaxr/stlxr cmpxchg and only
+ * ever taken as a whole by its cpu with an xchg, so neither side takes a lock. */
+typedef struct kalloc_mag_remote {
+    uint64_t list;
+    /* Objs on the list and in the batch its cpu is handing out. */
+    uint64_t num;
+} __attribute__ ((aligned (KALLOC_CACHE_LINE_SIZE))) kalloc_mag_remote_t;
+
+typedef struct kalloc_mag_cache {
+    kalloc_cache_t * cache;
+    kalloc_mag_cpu_t cpus[CORE_NUM];
+    /* The depot lists are protected by the cache lock. */
+    kalloc_mag_t * full_list;
+    kalloc_mag_t * empty_list;
+    unsigned int full_num;
+    unsigned int empty_num;
+    uint64_t exchange_num;
+    kalloc_mag_remote_t remotes[CORE_NUM];
+    kalloc_mag_t mags[KALLOC_MAG_NUM];
+} kalloc_mag_cache_t;
+
+void kalloc_mag_cache_init(kalloc_mag_cache_t * mag_cache, kalloc_cache_t * cache);
+/* Returns an object of the cache or NULL if the remote free list, the magazines and the depot are empty. */
+void * kalloc_mag_alloc(kalloc_mag_cache_t * mag_cache);
+/* Returns 0 if the object was taken by a magazine, otherwise it has to be freed to the cache. */
+int kalloc_mag_free(kalloc_mag_cache_t * mag_cache, void * obj);
+/* Push an object owned by owner_cpu on its remote free list, the owner takes it back on its next alloc. Returns 0
+ * on success, otherwise we are the owner or its list is full and the object goes to our magazines. */
+int kalloc_mag_remote_free(kalloc_mag_cache_t * mag_cache, void * obj, unsigned int owner_cpu);
+/* Move up to max_num objects out of the remote free lists and magazines of every cpu and the full magazines
+ * of the depot so the caller can free them to the cache. Returns the number of objects written to objs, 0 once drained. */
+unsigned int kalloc_mag_drain(kalloc_mag_cache_t * mag_cache, void ** objs, unsigned int max_num);
+
+#endif
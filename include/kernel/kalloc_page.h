@@ -10,11 +10,26 @@
 void kalloc_init_buddy(mm_area_t * area, kalloc_buddy_t * buddy, unsigned int memorder, unsigned int add_to_list);
 unsigned int kalloc_get_buddy_page_index(kalloc_buddy_t * buddy);
 kalloc_buddy_t * kalloc_get_buddy_from_page_index(unsigned int page_index);
+unsigned int kalloc_get_buddy_memorder(kalloc_buddy_t * buddy);
 void kalloc_set_buddy_memorder(kalloc_buddy_t * buddy, unsigned int memorder);
 kalloc_buddy_t * kalloc_get_buddy_sibling(kalloc_buddy_t * buddy);
 kalloc_buddy_t * kalloc_get_buddy_from_addr(uint64_t addr);
 int kalloc_page_free_pages(uint64_t addr, flags_t flags);
+/* Free count blocks, taking each area lock once and coalescing at the end of the batch. */
+int kalloc_page_free_bulk(uint64_t * addrs, unsigned int count, flags_t flags);
 int kalloc_page_reserve_pages(uint64_t addr, unsigned int memorder, flags_t flags);
+/* Reserve an arbitrary page aligned range, e.g. for DMA or framebuffer memory, as the largest aligned blocks
+ * that fit. Returns non zero with nothing reserved if any page in the range is already taken. */
+int kalloc_page_reserve_range(uint64_t start, size_t size);
+/* Give back a range taken with kalloc_page_reserve_range. */
+int kalloc_page_free_range(uint64_t start, size_t size);
 uint64_t kalloc_page_alloc_pages(unsigned int memorder, flags_t flags);
+/* Take a block of memorder from the given area instead of the one the area search would pick, only out of the free
+ * blocks below max_memorder so no larger block is split for it. Returns 0 if the area has no such block. */
+uint64_t kalloc_page_alloc_area_pages(mm_area_t * area, unsigned int memorder, unsigned int max_memorder, flags_t flags);
+/* Give back every page of the allocated block at addr past the first page_num, which are kept as the blocks
+ * kalloc_page_free_range splits a range into. page_num is recorded in the first page for the free. */
+void kalloc_page_trim_pages(uint64_t addr, unsigned int page_num);
+unsigned int kalloc_page_alloc_bulk(unsigned int memorder, unsigned int count, uint64_t * addrs, flags_t flags);
 
 #endif
\ No newline at end of file
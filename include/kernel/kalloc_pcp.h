@@ -0,0 +1,48 @@
+#ifndef __KALLOC_PCP_H
+#define __KALLOC_PCP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/lock.h>
+#include <kernel/cpu.h>
+
+/* Per cpu page frame caches that sit in front of the buddy allocator. Only the low memorders
+ * are cached, which covers task stacks and slab refills. There is a list per mm type. */
+#define KALLOC_PCP_MAX_ORDER 1
+#define KALLOC_PCP_ORDER_NUM (KALLOC_PCP_MAX_ORDER + 1)
+
+/* Number of pages moved between the buddy lists and a pcp list at a time. */
+#define KALLOC_PCP_BATCH 16
+/* Once the list grows past the high watermark it is drained back down to the low watermark. */
+#define KALLOC_PCP_HIGH 64
+#define KALLOC_PCP_LOW (KALLOC_PCP_HIGH - (KALLOC_PCP_BATCH * 2))
+#define KALLOC_PCP_SIZE (KALLOC_PCP_HIGH + 1)
+
+/* The page ring is a deque, hot pages are pushed and popped from the back (start + count)
+ * and cold pages are pushed to the front (start) which is also where we drain from. */
+typedef struct kalloc_pcp {
+    uint64_t pages[KALLOC_PCP_SIZE];
+    unsigned int start;
+    unsigned int count;
+    unsigned int high;
+    unsigned int low;
+    /* Only contended when another core drains this list on memory pressure. */
+    spinlock_t lock;
+    uint64_t alloc_num;
+    uint64_t free_num;
+    uint64_t refill_num;
+    uint64_t drain_num;
+} kalloc_pcp_t __attribute__ ((aligned (8)));
+
+void kalloc_pcp_init();
+kalloc_pcp_t * kalloc_pcp_get(unsigned int cpu_id, unsigned int memorder, unsigned int type);
+/* Returns the phys addr of a block of memorder pages or 0 if the buddy allocator is out of pages. */
+uint64_t kalloc_pcp_alloc(unsigned int memorder, flags_t flags);
+/* Returns 0 if the block was taken by the pcp list. */
+int kalloc_pcp_free(uint64_t addr, unsigned int memorder, flags_t flags);
+/* Return all the cached pages of a cpu to the buddy allocator. MUST NOT HOLD AN AREA LOCK. */
+unsigned int kalloc_pcp_drain(unsigned int cpu_id);
+unsigned int kalloc_pcp_drain_all();
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef __KALLOC_PROF_H
+#define __KALLOC_PROF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+
+/* Allocation profiler, only built with -DKALLOC_PROFILE (make profile). Every kalloc_alloc is counted against
+ * the return address of its caller and its size class in a table of the allocating cpu, frees are matched
+ * back to the site of their alloc through a table of the live objs. */
+
+/* Sites each cpu table holds. */
+#define KALLOC_PROF_SITE_SHIFT 8
+#define KALLOC_PROF_SITE_NUM (1 << KALLOC_PROF_SITE_SHIFT)
+/* Live objs the frees can be matched back with. */
+#define KALLOC_PROF_OBJ_SHIFT 12
+#define KALLOC_PROF_OBJ_NUM (1 << KALLOC_PROF_OBJ_SHIFT)
+/* Slots looked at before giving up on a full table, allocs that find no slot are dropped from the counts. */
+#define KALLOC_PROF_PROBE_NUM 16
+/* Sites printed when the dump key is received on the uart. */
+#define KALLOC_PROF_DUMP_NUM 16
+#define KALLOC_PROF_DUMP_LIVE_KEY 'p'
+#define KALLOC_PROF_DUMP_ALLOC_KEY 'a'
+#define KALLOC_PROF_RESET_KEY 'r'
+
+typedef enum {
+    /* Largest live bytes first, where the leaks are. */
+    KALLOC_PROF_SORT_LIVE,
+    /* Most allocs first, where the hot spots are. */
+    KALLOC_PROF_SORT_ALLOC
+} kalloc_prof_sort_t;
+
+typedef struct kalloc_prof_site {
+    /* Return address of the kalloc_alloc call. */
+    uint64_t site;
+    /* Bytes of the size class, or the page rounded size of allocs served with whole pages. */
+    size_t size;
+    uint64_t alloc_num;
+    uint64_t free_num;
+    /* Live bytes are the difference, the frees of a site can be counted on a different cpu than its allocs. */
+    uint64_t alloc_size;
+    uint64_t free_size;
+} kalloc_prof_site_t;
+
+#ifdef KALLOC_PROFILE
+
+/* Starts the time the alloc and free rates are taken over. */
+void kalloc_prof_init();
+/* Task that waits on the uart for the dump and reset keys, sched has to be initialized. */
+void kalloc_prof_task_init();
+void kalloc_prof_alloc(void * site, void * obj, size_t size);
+void kalloc_prof_free(void * obj);
+/* Sites merged over every cpu, the first site_num of them in sort order. Returns the number written. */
+unsigned int kalloc_prof_top(kalloc_prof_site_t * sites, unsigned int site_num, kalloc_prof_sort_t sort);
+void kalloc_prof_dump(unsigned int top_num, kalloc_prof_sort_t sort);
+/* Clear every count, objs alloced before the reset are not counted when freed. Counts made on other cpus
+ * while it runs can be lost. */
+void kalloc_prof_reset();
+uint64_t kalloc_prof_dropped_num();
+
+#define KALLOC_PROF_ALLOC(SITE, OBJ, SIZE) kalloc_prof_alloc((SITE), (OBJ), (SIZE))
+#define KALLOC_PROF_FREE(OBJ) kalloc_prof_free((OBJ))
+
+#else
+
+#define KALLOC_PROF_ALLOC(SITE, OBJ, SIZE) do {} while(0)
+#define KALLOC_PROF_FREE(OBJ) do {} while(0)
+
+#endif
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef __KALLOC_RECLAIM_H
+#define __KALLOC_RECLAIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/queue.h>
+
+/* How long the reclaim task sleeps between checks. */
+#define KALLOC_RECLAIM_PERIOD_US (TIME_MS_TO_US(20))
+/* Shrink everything the shrinker has. */
+#define KALLOC_RECLAIM_ALL ((unsigned int)~0)
+
+/* Registered by anything holding memory it can give back under pressure, e.g. caches with free slabs. */
+typedef struct kalloc_shrinker {
+    const char * name;
+    /* Number of pages the owner could give back right now. */
+    unsigned int (*count)(void * data);
+    /* Give back up to page_num pages, returns the number of pages actually freed. */
+    unsigned int (*shrink)(void * data, unsigned int page_num);
+    void * data;
+    /* Pages given back over every reclaim. */
+    uint64_t freed_page_num;
+    queue_chain_t chain;
+} kalloc_shrinker_t;
+
+typedef struct kalloc_reclaim_stats {
+    /* Reclaim runs and the runs asked for by areas going below their low watermark. */
+    uint64_t run_num;
+    uint64_t request_num;
+    uint64_t freed_page_num;
+} kalloc_reclaim_stats_t;
+
+void kalloc_reclaim_init();
+void kalloc_shrinker_register(kalloc_shrinker_t * shrinker);
+void kalloc_shrinker_unregister(kalloc_shrinker_t * shrinker);
+/* Run the shrinkers in order until page_num pages are freed. Returns the number of pages freed. */
+unsigned int kalloc_reclaim(unsigned int page_num);
+/* Reclaim as much as the watermarks call for, nothing if the free pages are over the low watermark. */
+unsigned int kalloc_reclaim_balance();
+/* Ask the reclaim task to check the watermarks, safe to call from any context. */
+void kalloc_reclaim_request();
+/* Body of the reclaim kernel task. */
+void kalloc_reclaim_task();
+kalloc_reclaim_stats_t * kalloc_reclaim_stats();
+void kalloc_reclaim_dump();
+
+#endif
@@ -9,14 +9,22 @@
 /* This slab was externally allocated outside of the page allocator or should not be freed until done explicitly. */
 #define KALLOC_SLAB_EXTERN_ALLOC_F (1 << 1)
 
+/* Free indexs are 16 bit, which caps a slab at KALLOC_SLAB_MAX_OBJ_NUM objects. */
+typedef uint16_t kalloc_slab_index_t;
+/* free_index of a full slab, there is no free obj it could point to. */
+#define KALLOC_SLAB_FREE_END ((kalloc_slab_index_t)~0)
+#define KALLOC_SLAB_MAX_OBJ_NUM (KALLOC_SLAB_FREE_END - 1)
+/* Objs are aligned to the largest power of two dividing their size, up to this. */
+#define KALLOC_SLAB_MAX_ALIGN 64
+
 /* Pointer to the free index list, which should be directly after the struct in memory. */
-#define KALLOC_SLAB_FREE_INDEXS(slab) ((unsigned int *)((kalloc_slab_t*)(slab) + 1))
+#define KALLOC_SLAB_FREE_INDEXS(slab) ((kalloc_slab_index_t *)((kalloc_slab_t*)(slab) + 1))
 /* Macro to extract the current cache list this slab belongs to, or any data we store in the ll node. */
 #define KALLOC_SLAB_CURR_LIST_P(slab) ((ll_head_t *)((slab)->node.data))
 
-#define KALLOC_SLAB_VERIFY(slab) ASSERT_PANIC(slab, "Slab ptr is null"); \
-                        ASSERT_PANIC(slab->obj_size, "Slab obj size nonzer0"); \
-                        ASSERT_PANIC(((uint64_t)slab->mem_ptr & PAGE_MASK) == ((uint64_t)slab  & PAGE_MASK), "Slab memptr is not in slab ptr range");
+#define KALLOC_SLAB_VERIFY(slab) CHECK_CHEAP(slab, "Slab ptr is null"); \
+                        CHECK_CHEAP(slab->obj_size, "Slab obj size nonzer0"); \
+                        CHECK_CHEAP(PTR_IN_RANGE(slab->mem_ptr, slab, slab->mem_page_num * PAGE_SIZE), "Slab memptr is not in slab ptr range");
 
 /* Very similar to the slab alloc linux uses. With the free indexs being the buf_ctl scheme linux also uses for updating
  * and getting free_indexs. */
@@ -29,7 +37,13 @@ typedef struct kalloc_slab {
     flags_t flags;
     unsigned int mem_page_num;
     unsigned int free_index;
-    unsigned int * free_indexs;
+    kalloc_slab_index_t * free_indexs;
+    /* Cache the slab was added to, NULL while it is not in one. */
+    struct kalloc_cache * cache;
+    /* Reap pass of the cache when the slab last became empty. */
+    unsigned int free_reap_num;
+    /* Left to the owner of the cache, kalloc keeps the cpu that last took objs out of the slab here. */
+    unsigned int owner_cpu;
 } kalloc_slab_t __attribute__ ((aligned (8)));
 
 /* Size of the struct for the desired object number. */
@@ -38,10 +52,15 @@ size_t kalloc_slab_struct_size(unsigned int obj_num, size_t obj_size);
 size_t kalloc_slab_total_size(unsigned int obj_num, size_t obj_size);
 /* The amount of objects that fit into a given mem_size, not taking into account inline structs. */
 unsigned int kalloc_slab_obj_num(size_t obj_size, size_t mem_size);
-/* The number of objs in the slab that can fit alongside the inlined slab struct. */
+/* The number of objs in the slab that can fit alongside the inlined slab struct, worked out in closed form. */
 unsigned int kalloc_slab_inline_obj_num_pages(size_t obj_size, unsigned int page_num);
 /* Return either the passed in slab object to be initialized or the slab object initialized in the mem_ptr mem region. */
 kalloc_slab_t * kalloc_slab_init(kalloc_slab_t * slab, void * mem_ptr, unsigned int mem_num_pages, size_t obj_size, flags_t flags);
+/* Same as kalloc_slab_init for an inlined slab struct, with the objs starting color bytes further into the pages.
+ * The color has to fit in the space the objs leave over and keep their alignment. */
+kalloc_slab_t * kalloc_slab_init_color(void * mem_ptr, unsigned int mem_num_pages, size_t obj_size, size_t color, flags_t flags);
+/* Bytes left over after the inlined struct and objs, the room there is for coloring. */
+size_t kalloc_slab_inline_free_size(size_t obj_size, unsigned int page_num);
 void * kalloc_slab_alloc(kalloc_slab_t * slab);
 int kalloc_slab_free(kalloc_slab_t * slab, void * obj);
 
@@ -0,0 +1,36 @@
+#ifndef __KALLOC_ZERO_H
+#define __KALLOC_ZERO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/lock.h>
+
+/* Pool of single pages that idle cores zero ahead of time, so KALLOC_ZERO_F allocations
+ * do not have to pay for the zeroing. */
+#define KALLOC_ZERO_POOL_SIZE 64
+/* Max number of pages an idle core zeroes before it yields again. */
+#define KALLOC_ZERO_IDLE_BATCH 4
+
+typedef struct kalloc_zero_pool {
+    uint64_t pages[KALLOC_ZERO_POOL_SIZE];
+    unsigned int count;
+    spinlock_t lock;
+    /* Allocs served from the pool and allocs that had to zero synchronously. */
+    uint64_t hit_num;
+    uint64_t miss_num;
+    uint64_t fill_num;
+} kalloc_zero_pool_t;
+
+void kalloc_zero_init();
+kalloc_zero_pool_t * kalloc_zero_pool();
+/* Zero the pages of a block in place. */
+void kalloc_zero_pages(uint64_t addr, unsigned int memorder);
+/* Returns the phys addr of a zeroed page or 0 if the pool is empty. */
+uint64_t kalloc_zero_alloc();
+/* Called from the idle loop, zeroes up to max_num pages into the pool. Returns the number added. */
+unsigned int kalloc_zero_fill(unsigned int max_num);
+/* Return all the pooled pages to the page allocator. */
+unsigned int kalloc_zero_drain();
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef __KERN_BENCH
+#define __KERN_BENCH
+
+#include <stdint.h>
+
+/* Benchmarks are compiled in with BENCH_KERNEL (make bench). Core 0 drives the rounds
+ * and the other cores sit in kern_bench_child until kern_bench_done is called. */
+typedef void (*kern_bench_fn_t)(unsigned int core, void * arg);
+
+/* Run fn on cores [0, core_num) at the same time, returns the elapsed time in usecs. */
+uint64_t kern_bench_run_cores(kern_bench_fn_t fn, void * arg, unsigned int core_num);
+void kern_bench_child(unsigned int core);
+void kern_bench_done();
+void kern_bench_main();
+
+void kalloc_pcp_bench();
+void kalloc_mag_bench();
+void kalloc_cache_color_bench();
+void kalloc_arena_bench();
+
+#endif
@@ -7,6 +7,25 @@ void kalloc_slab_test();
 void kalloc_cache_test();
 void mm_test();
 void kalloc_test();
+void kalloc_pcp_test();
+void kalloc_page_bulk_test();
+void kalloc_page_range_test();
+void kalloc_pages_exact_test();
+void kalloc_zero_test();
+void mm_type_test();
+void kalloc_huge_test();
+void kalloc_compact_test();
+void kalloc_reclaim_test();
+void kalloc_mag_test();
+void kalloc_mag_remote_test();
+void kalloc_cache_lookup_test();
+void kalloc_entry_test();
+void kalloc_cache_grow_test();
+void kalloc_slab_format_test();
+void kalloc_cache_color_test();
+void kalloc_named_cache_test();
+void kalloc_arena_test();
+void kalloc_prof_test();
 void queue_test();
 
 #endif
\ No newline at end of file
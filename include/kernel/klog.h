@@ -6,10 +6,16 @@
 #include <stdarg.h>
 
 #include <common/lock.h>
+#include <kernel/mmu.h>
 #include <kernel/task.h>
 
 #define KLOG_MSG_SIZE 128
 #define KLOG_BUF_SIZE (256 * 2 * 2)
+/* The ring is kept in pages so the log can give some back under memory pressure,
+ * never going below KLOG_MIN_PAGE_NUM. */
+#define KLOG_MSGS_PER_PAGE (PAGE_SIZE / KLOG_MSG_SIZE)
+#define KLOG_PAGE_NUM (KLOG_BUF_SIZE / KLOG_MSGS_PER_PAGE)
+#define KLOG_MIN_PAGE_NUM 4
 
 typedef struct {
     char msg[KLOG_MSG_SIZE];
@@ -21,7 +27,10 @@ typedef struct {
     rw_lock_t rw_lock;
     void(*handler) (char*);
     task_t * flush_task;
-    klog_msg_t msgs[KLOG_BUF_SIZE];
+    /* Number of msgs the ring currently holds, page_num * KLOG_MSGS_PER_PAGE. */
+    uint64_t msg_num;
+    unsigned int page_num;
+    klog_msg_t * msg_pages[KLOG_PAGE_NUM];
 } klog_t  __attribute__ ((aligned (8)));
 
 void klog_init(void(*handler) (char*));
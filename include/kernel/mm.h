@@ -6,6 +6,7 @@
 #include <common/bitmap.h>
 #include <common/bits.h>
 #include <common/linkedlist.h>
+#include <common/queue.h>
 #include <common/lock.h>
 
 /* The max order of page orders that we keep track of. Similiar to the linux max order size. 
@@ -14,6 +15,46 @@
 #define MM_INVALID_ORDER ((unsigned int)~0)
 #define MM_MAX_INDEX_ORDER (MM_MAX_ORDER + 1)
 #define MM_AREA_SIZE (PAGE_SIZE << (MM_MAX_ORDER + 1)) //8MB
+#define MM_AREA_PAGE_NUM (1 << (MM_MAX_ORDER + 1))
+#define MM_AREA_BUDDY_NUM (MM_AREA_PAGE_NUM / 2)
+/* Memorder 0 and 1 buddies both have one bit per page pair, every memorder after that has half
+ * the bits of the one before it, so all the memorders fit in 3 * MM_AREA_BUDDY_NUM bits. */
+#define MM_AREA_FREE_BITMAP_SIZE ((MM_AREA_BUDDY_NUM * 3) / BITMAP_BITS_PER_BITMAP_ENTRY)
+
+/* Free areas initialized by mm_init on top of the ones holding early memory, the rest are deferred. */
+#define MM_BOOT_FREE_AREA_NUM 2
+
+/* Allocation types, each area only hands out pages of one type so long lived pages do not
+ * end up scattered over every area and break up the higher memorders. */
+#define MM_TYPE_UNMOVABLE 0
+/* Pages that can be given back or moved on demand, e.g. slab pages of shrinkable caches. */
+#define MM_TYPE_RECLAIMABLE 1
+#define MM_TYPE_NUM 2
+/* Areas that have nothing allocated from them yet, these are claimed by the first type to use them. */
+#define MM_TYPE_NONE MM_TYPE_NUM
+#define MM_AREA_TYPE_NUM (MM_TYPE_NUM + 1)
+
+/* Low bits of mm_page_t page_flags hold the type of the block starting at that page. */
+#define MM_PAGE_TYPE_MASK 0x3
+/* Set on the first page of a block handed out by kalloc_huge_pages. */
+#define MM_PAGE_HUGE_F (1 << 2)
+
+/* Huge blocks match the 2MB level 1 block descriptors so they can be mapped with a single entry. */
+#define MM_HUGE_MEMORDER 9
+#define MM_HUGE_PAGE_SIZE MM_MEMORDER_SIZE(MM_HUGE_MEMORDER)
+#define MM_HUGE_PAGE_NUM MM_MEMORDER_TO_PAGES(MM_HUGE_MEMORDER)
+
+/* Free page watermarks of an area. Below low the reclaim task is asked to give memory back until the
+ * free pages are over high again, below min it takes back everything the shrinkers have. */
+#define MM_WMARK_MIN 0
+#define MM_WMARK_LOW 1
+#define MM_WMARK_HIGH 2
+#define MM_WMARK_NUM 3
+/* The min watermark is this fraction of the free pages of the area, low and high are a quarter and a half above min. */
+#define MM_WMARK_MIN_SHIFT 6
+
+/* mm_frag_index value when a block of the memorder is free, the alloc would not fail at all. */
+#define MM_FRAG_INDEX_FREE (-1000)
 
 #define MM_AREA_INDEX(ADDR) ((ADDR)/ MM_AREA_SIZE)
 #define MM_AREA_FROM_ADDR(ADDR) (&mm_global_area()->global_areas[MM_AREA_INDEX(ADDR)])
@@ -24,46 +65,68 @@
 
 #define MM_MEMORDER_TO_PAGES(MEMORDER) (1 << (MEMORDER))
 
-#define MM_AREA_FREE_BUDDY(AREA, MEMORDER) ((list_node_t *)ll_peek_first(&(AREA)->free_buddy_list[MEMORDER]))
-#define MM_GLOBAL_AREA_FREE_AREA(MEMORDER) ((sll_node_t *)ll_peek_first(&mm_global_area()->free_areas_list[MEMORDER]))
+#define MM_AREA_FREE_BUDDY(AREA, MEMORDER) (queue_empty(&(AREA)->free_buddy_list[MEMORDER]) ? NULL : queue_first(&(AREA)->free_buddy_list[MEMORDER]))
 
-#define MM_PAGE_VALID (1 << 0)
-
-typedef struct mm_addr_map {
-    uint64_t virt_addr;
-} mm_addr_map_t;
+/* Page obj ptrs are stored as the 8 byte aligned physical address shifted down, which covers 32GB. */
+#define MM_PAGE_OBJ_SHIFT 3
 
+/* One per page pair, the memorder of a buddy is kept in the mm_page_t of its first page. */
 typedef struct kalloc_buddy {
-    unsigned int buddy_memorder;
-    list_node_t buddy_node;
+    queue_chain_t buddy_node;
 } kalloc_buddy_t;
 
+/* Page valid state is kept in the global page bitmap rather than here. */
 typedef struct mm_page {
-    /* Virtual mapping info. */
-    mm_addr_map_t mapping;
-    /* Kalloc obj i.e. slab ptr or other memory objs for easier lookups. */
-    void * obj;
-    flags_t page_flags;
+    /* Compressed kalloc obj i.e. slab ptr or other memory objs for easier lookups. */
+    uint32_t obj;
+    /* Memorder of the buddy starting at this page. */
+    uint8_t buddy_memorder;
+    uint8_t page_flags;
+    /* Pages of an exact size alloc starting at this page, 0 for plain buddy blocks. */
+    uint16_t range_page_num;
 } mm_page_t __attribute__ ((aligned (8)));
 
 typedef struct mm_area {
+    /* Protects the buddies, free lists and pages of this area. */
+    spinlock_t lock;
+    /* Set once mm_area_init is done, areas past the boot areas are initialized late. */
+    uint32_t initialized;
+    /* MM_TYPE_* of the pages allocated from this area, MM_TYPE_NONE while it is fully free. */
+    unsigned int type;
     unsigned int free_page_num;
+    /* Free pages of the area when nothing is allocated from it. */
+    unsigned int max_free_page_num;
+    /* Free page watermarks, indexed by MM_WMARK_*. */
+    unsigned int wmark[MM_WMARK_NUM];
     unsigned int start_page_index;
     uint64_t phys_addr_start;
     kalloc_buddy_t * buddies;
-    /* Simple ll list for keeping track of free buddies. */
-    ll_head_t free_buddy_list[MM_MAX_INDEX_ORDER];
-    /* Nodes for linking to global area count lists. Area ptr is embedded in data. */
-    sll_node_t global_area_nodes[MM_MAX_INDEX_ORDER];
+    /* Intrusive lists of the free buddies of each memorder. */
+    queue_head_t free_buddy_list[MM_MAX_INDEX_ORDER];
+    /* Number of buddies on each free list. */
+    unsigned int free_buddy_num[MM_MAX_INDEX_ORDER];
+    /* A set bit means the buddy is on the free list of that memorder. */
+    bitmap_t free_buddy_bitmap[MM_AREA_FREE_BITMAP_SIZE];
 } mm_area_t;
 
 typedef struct mm_global_area {
     mm_page_t * global_pages;
+    /* One bit per page, set while the page is allocated or reserved. */
+    bitmap_t * page_valid_bitmap;
     unsigned int page_count;
     mm_area_t * global_areas;
     kalloc_buddy_t * global_buddies;
     unsigned int area_count;
-    ll_head_t free_areas_list[MM_MAX_INDEX_ORDER];
+    /* One bit per area for every memorder, set while the area has a free buddy of that memorder.
+     * Bits are flipped atomically so no global lock is needed. */
+    bitmap_t * free_areas_bitmap[MM_MAX_INDEX_ORDER];
+    /* One bit per area for every area type, set while the area is of that type. */
+    bitmap_t * type_areas_bitmap[MM_AREA_TYPE_NUM];
+    unsigned int free_areas_bitmap_size;
+    /* Number of times an alloc of each type had to fall back to an area of another type. */
+    uint64_t type_steal_num[MM_TYPE_NUM];
+    /* Sums of the watermarks of the initialized areas. */
+    uint64_t wmark_page_num[MM_WMARK_NUM];
     spinlock_t lock;
 } mm_global_area_t;
 
@@ -73,17 +136,53 @@ int mm_pages_are_valid(unsigned int start_page_index, unsigned int page_num);
 void mm_mark_page_valid(unsigned int page_index);
 void mm_mark_pages_valid(unsigned int start_page_index, unsigned int page_num);
 int mm_pages_are_free(unsigned int start_page_index, unsigned int page_num);
+void mm_mark_page_free(unsigned int page_index);
 void mm_mark_pages_free(unsigned int start_page_index, unsigned int page_num);
 void * mm_get_page_obj_ptr(unsigned int page_index);
 void mm_link_page_obj_ptr(unsigned int page_index, void * ptr);
 
 unsigned int mm_pages_to_memorder(unsigned int page_num);
-mm_area_t * mm_find_free_area(unsigned int memorder);
+unsigned int mm_range_max_memorder(unsigned int page_index, unsigned int page_num);
+/* MUST HOLD AREA LOCK. */
+int mm_area_has_free_buddy(mm_area_t * area, unsigned int memorder);
+/* Returns a free area with its lock held, preferring areas of the given type. */
+mm_area_t * mm_find_free_area(unsigned int memorder, unsigned int type);
+/* MUST HOLD AREA LOCK. */
+void mm_set_area_type(mm_area_t * area, unsigned int type);
+unsigned int mm_get_page_type(unsigned int page_index);
+void mm_set_page_type(unsigned int page_index, unsigned int type);
+unsigned int mm_test_page_flag(unsigned int page_index, unsigned int flag);
+void mm_set_page_flag(unsigned int page_index, unsigned int flag);
+void mm_clear_page_flag(unsigned int page_index, unsigned int flag);
+unsigned int mm_get_page_range_num(unsigned int page_index);
+void mm_set_page_range_num(unsigned int page_index, unsigned int page_num);
+/* Fragmentation index of a memorder in thousandths. Near 0 an alloc of memorder would fail from lack
+ * of memory, near 1000 it would fail from fragmentation. MM_FRAG_INDEX_FREE if a block is free. */
+int mm_frag_index(unsigned int memorder);
+/* Share of the free pages that are in blocks too small for memorder, in thousandths. */
+unsigned int mm_unusable_index(unsigned int memorder);
+void mm_dump_frag();
+/* Free pages over every initialized area. */
+uint64_t mm_free_page_num();
+/* Sum of the wmark watermarks of every initialized area. */
+uint64_t mm_wmark_page_num(unsigned int wmark);
+int mm_below_wmark(unsigned int wmark);
+/* Number of blocks of memorder the free blocks of every area could make. */
+uint64_t mm_free_block_num(unsigned int memorder);
+void mm_add_free_area(mm_area_t * area, unsigned int memorder);
+void mm_remove_free_area(mm_area_t * area, unsigned int memorder);
 mm_area_t * mm_area_from_addr(uint64_t addr);
 mm_global_area_t * mm_global_area();
 
 int mm_is_initialized();
 int mm_area_init(mm_global_area_t * global_area, mm_area_t * area, unsigned int start_page_index);
+int mm_area_is_initialized(mm_area_t * area);
+/* Wait for a deferred area to be initialized, initializing it ourselves if nobody has claimed it yet. */
+void mm_area_wait_initialized(mm_area_t * area);
 void mm_init();
+/* Init the areas left uninitialized by mm_init, can be run on any number of cores at once.
+ * Returns the number of areas this core initialized. */
+unsigned int mm_deferred_init();
+int mm_deferred_init_done();
 
 #endif
\ No newline at end of file
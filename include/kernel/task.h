@@ -74,8 +74,16 @@ typedef struct task {
 
 int task_lock(task_t * task);
 void task_unlock(task_t * task);
+/* Puts a task in the constructed state task_init expects, tasks not taken from task_alloc have to be passed through it first. */
+void task_ctor(void * obj);
+void task_cache_init();
+task_t * task_alloc();
+/* The task has to be off the task list and every wait queue. */
+void task_free(task_t * task);
 void task_init(task_t * task, uint64_t * stack_top, uint64_t * start_addr);
 void task_create(task_t * task, void * code_addr);
+/* Create task_num tasks running code_addr, allocating their stacks in bulk. */
+void task_create_bulk(task_t ** tasks, unsigned int task_num, void * code_addr);
 void task_reload(task_t * task);
 extern uint64_t * task_init_stack(uint64_t * stack_addr, uint64_t * task_start, void * params);
 extern void task_start();
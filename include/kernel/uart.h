@@ -5,6 +5,7 @@ int uart_isready();
 void uart_init();
 void uart_send(unsigned int c);
 char uart_getc();
+int uart_trygetc();
 void uart_puts(char *s);
 void uart_hex(uint64_t d);
 
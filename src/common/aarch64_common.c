@@ -1,5 +1,6 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <common/aarch64_common.h>
 
 void aarch64_nop()
 {
@@ -65,3 +66,29 @@ void aarch64_cache_flush_invalidate(uint64_t addr)
     // Make sure to put a memory barrier to make sure that the invalidate is finished before continuing
     aarch64_dsb();
 }
+
+/* Zero the memory range with dc zva, which zeroes a whole cache line at a time without reading it in first.
+ * The range has to be aligned to the zva block size, which is 64 bytes on the cortex-a53. Only for normal memory. */
+void aarch64_zero_range(void * addr, size_t size)
+{
+    uint64_t dczid;
+    uint64_t block_size;
+    uint8_t * ptr = (uint8_t *)addr;
+    uint8_t * end = ptr + size;
+
+    AARCH64_MRS(dczid_el0, dczid);
+
+    // dc zva is prohibited, fall back to plain stores
+    if (dczid & AARCH64_DCZID_DZP) {
+        for (uint64_t * word = (uint64_t *)ptr; word < (uint64_t *)end; word++) {
+            *word = 0;
+        }
+        return;
+    }
+
+    block_size = 4 << (dczid & AARCH64_DCZID_BS_MASK);
+
+    for (; ptr < end; ptr += block_size) {
+        asm volatile ("dc zva, %0" : : "r" (ptr) : "memory");
+    }
+}
@@ -35,3 +35,73 @@ void bitmap_free(bitmap_t * bitmap, unsigned int index)
 {
     bits_free_64(&bitmap[_bitmap_index(index)], _bit_index(index), 1);
 }
+
+/* Mask of the bits [index, index + num) that fall in the entry holding index, and the number of them. */
+static inline uint64_t _range_mask(unsigned int index, unsigned int num, unsigned int * mask_num)
+{
+    unsigned int bit = _bit_index(index);
+
+    *mask_num = BITS_PER_BITMAP - bit;
+    if (*mask_num > num)
+        *mask_num = num;
+
+    return BITS(*mask_num) << bit;
+}
+
+void bitmap_set_range(bitmap_t * bitmap, unsigned int index, unsigned int num)
+{
+    unsigned int mask_num;
+    uint64_t mask;
+
+    while (num) {
+        mask = _range_mask(index, num, &mask_num);
+        bitmap[_bitmap_index(index)] |= mask;
+        index += mask_num;
+        num -= mask_num;
+    }
+}
+
+void bitmap_free_range(bitmap_t * bitmap, unsigned int index, unsigned int num)
+{
+    unsigned int mask_num;
+    uint64_t mask;
+
+    while (num) {
+        mask = _range_mask(index, num, &mask_num);
+        bitmap[_bitmap_index(index)] &= ~mask;
+        index += mask_num;
+        num -= mask_num;
+    }
+}
+
+unsigned int bitmap_range_is_set(bitmap_t * bitmap, unsigned int index, unsigned int num)
+{
+    unsigned int mask_num;
+    uint64_t mask;
+
+    while (num) {
+        mask = _range_mask(index, num, &mask_num);
+        if ((bitmap[_bitmap_index(index)] & mask) != mask)
+            return 0;
+        index += mask_num;
+        num -= mask_num;
+    }
+
+    return 1;
+}
+
+unsigned int bitmap_range_is_free(bitmap_t * bitmap, unsigned int index, unsigned int num)
+{
+    unsigned int mask_num;
+    uint64_t mask;
+
+    while (num) {
+        mask = _range_mask(index, num, &mask_num);
+        if (bitmap[_bitmap_index(index)] & mask)
+            return 0;
+        index += mask_num;
+        num -= mask_num;
+    }
+
+    return 1;
+}
@@ -19,28 +19,28 @@ unsigned int _bits_count(uint64_t bits, unsigned int num)
 
 unsigned int bits_msb_index_64(uint64_t bits)
 {
-    uint64_t mask = 1;
-
-    for (unsigned int i = 0; i < 63; i++) {
-        if (bits < mask)
-            return i;
-        mask = mask << 1;
-    }
+    if (!bits)
+        return 0;
 
-    return 63;
+    return 63 - __builtin_clzll(bits);
 }
 
 unsigned int bits_msb_index_32(uint32_t bits)
 {
-    uint64_t mask = 1;
+    if (!bits)
+        return 0;
 
-    for (unsigned int i = 0; i < 31; i++) {
-        if (bits < mask)
-            return i;
-        mask = mask << 1;
-    }
+    return 31 - __builtin_clz(bits);
+}
+
+unsigned int bits_clz_64(uint64_t bits)
+{
+    return __builtin_clzll(bits);
+}
 
-    return 31;
+unsigned int bits_ctz_64(uint64_t bits)
+{
+    return __builtin_ctzll(bits);
 }
 
 unsigned int bits_count_64(uint64_t bits)
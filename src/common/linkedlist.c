@@ -64,8 +64,8 @@ static int _ll_append_node(ll_head_t * head, ll_node_t * node, ll_node_t * last)
 
     // Empty list add
     if (!head->next) {
-        ASSERT_PANIC(!last, "Last should be Null if this is the only one in the list");
-        ASSERT_PANIC(!head->count,"Head count should be 0");
+        CHECK_CHEAP(!last, "Last should be Null if this is the only one in the list");
+        CHECK_CHEAP(!head->count,"Head count should be 0");
 
         head->next = node;
         head->last = node;
@@ -165,10 +165,13 @@ int ll_insert_node(ll_head_t * head, ll_node_t * node, ll_node_t * last)
 
     CHECK_NULL(head && node);
     
-    ret = ll_node_exists(head, node); 
-    if (ret) { // TOGGLE THIS AS DEBUG
-        DEBUG_PANIC("The node already exists");
-        return ret;
+    // Walks the whole list, only done at the full check level
+    if (CHECK_ENABLED(CHECK_LEVEL_FULL)) {
+        ret = ll_node_exists(head, node);
+        if (ret) {
+            DEBUG_PANIC("The node already exists");
+            return ret;
+        }
     }
 
     ret = _ll_append_node(head, node, last);
@@ -193,10 +196,13 @@ int ll_delete_node(ll_head_t * head, ll_node_t * node)
     if (head->count == 0)
         return 1;
 
-    ret = ll_node_exists(head, node);
-    if (!ret) { // TOGGLE THIS AS DEBUG
-        DEBUG_PANIC("Could not delete, the node does not exist."); // Again throw an assert here to catch if we wanted to delete something that isnt in the list
-        return !ret;
+    // Walks the whole list, only done at the full check level
+    if (CHECK_ENABLED(CHECK_LEVEL_FULL)) {
+        ret = ll_node_exists(head, node);
+        if (!ret) {
+            DEBUG_PANIC("Could not delete, the node does not exist."); // Again throw an assert here to catch if we wanted to delete something that isnt in the list
+            return !ret;
+        }
     }
 
     // We need to find the last node before the one we want to delete
@@ -206,6 +212,9 @@ int ll_delete_node(ll_head_t * head, ll_node_t * node)
                 break;
             found_last = p;
         }
+        // Deleting a node that is not on the list is an error at every check level
+        if (!p)
+            return 1;
 
     } else {
         found_last = node->dll.last;
@@ -250,10 +259,13 @@ int ll_push_list(ll_head_t * head, ll_node_t * node)
 
     CHECK_NULL(head && node);
 
-    ret = ll_node_exists(head, node);
-    if (ret) { // TOGGLE THIS AS DEBUG
-        DEBUG_PANIC("The node already exists in the list");// Again throw an assert here to catch if we wanted to delete something that isnt in the list
-        return ret;
+    // Walks the whole list, only done at the full check level
+    if (CHECK_ENABLED(CHECK_LEVEL_FULL)) {
+        ret = ll_node_exists(head, node);
+        if (ret) {
+            DEBUG_PANIC("The node already exists in the list");// Again throw an assert here to catch if we wanted to delete something that isnt in the list
+            return ret;
+        }
     }
 
     ret = _ll_append_node(head, node, head->last);
@@ -272,10 +284,13 @@ int ll_queue_list(ll_head_t * head, ll_node_t * node)
     int ret = 0;
 
     CHECK_NULL(head && node);
-    ret = ll_node_exists(head, node);
-    if (ret) { // TOGGLE THIS AS DEBUG
-        DEBUG_PANIC("The node already exists in the list"); // Again throw an assert here to catch if we wanted to delete something that isnt in the list
-        return ret;
+    // Walks the whole list, only done at the full check level
+    if (CHECK_ENABLED(CHECK_LEVEL_FULL)) {
+        ret = ll_node_exists(head, node);
+        if (ret) {
+            DEBUG_PANIC("The node already exists in the list"); // Again throw an assert here to catch if we wanted to delete something that isnt in the list
+            return ret;
+        }
     }
     
     ret = _ll_append_node(head, node, NULL);
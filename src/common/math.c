@@ -48,5 +48,8 @@ unsigned int math_align_power2_64(uint64_t num)
 {
     unsigned int msb = bits_msb_index_64(num);
 
-    return 1 << msb;
+    if (math_is_power2_64(num))
+        return num;
+
+    return 1 << (msb + 1);
 }
\ No newline at end of file
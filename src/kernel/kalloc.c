@@ -11,15 +11,32 @@
 #include <common/bits.h>
 #include <common/math.h>
 #include <kernel/kalloc_page.h>
+#include <kernel/kalloc_pcp.h>
+#include <kernel/kalloc_zero.h>
+#include <kernel/kalloc_compact.h>
+#include <kernel/kalloc_reclaim.h>
+#include <kernel/kalloc_mag.h>
+#include <kernel/kalloc_prof.h>
 #include <kernel/mmu.h>
+#include <kernel/cpu.h>
+#include <kernel/irq.h>
+#include <kernel/printf.h>
 
-#define KALLOC_ENTRY_NUM 8
-#define KALLOC_MAX_ENTRY_ALLOC 2048
 #define KALLOC_MAX_ALLOC_SIZE (MM_MEMORDER_TO_PAGES(MM_MAX_ORDER) * PAGE_SIZE)
+/* Number of slabs added to a cache each time it runs out of objects. */
+#define KALLOC_EXPAND_SLAB_NUM 2
+/* Number of magazine objects freed back to the caches per drain call. */
+#define KALLOC_MAG_DRAIN_BATCH 32
 
 DEFINE_SPINLOCK(lock);
 static unsigned int kalloc_initialized = 0;
 static kalloc_cache_t entry_cache[KALLOC_ENTRY_NUM];
+/* The magazines are in front of the entry caches. Frees of objs another cpu took out of the cache go on the lock free
+ * remote free list of that cpu instead, which it takes back on its next alloc. */
+static kalloc_mag_cache_t entry_mags[KALLOC_ENTRY_NUM];
+static kalloc_shrinker_t cache_shrinker;
+/* Named caches are only taken and given back under the kalloc lock, their objs are under their own cache lock. */
+static kalloc_cache_t named_caches[KALLOC_NAMED_CACHE_NUM];
 
 typedef struct kalloc_entry {
     size_t size;
@@ -28,17 +45,53 @@ typedef struct kalloc_entry {
     unsigned int alloc_num;
 } kalloc_entry_t;
 
+/* The half steps between the powers of two keep the rounding waste of a class under a third. */
 static kalloc_entry_t entries[] = {
     {16, &entry_cache[0], 2, 0},
-    {32, &entry_cache[1], 2, 0},
-    {64, &entry_cache[2], 2, 0},
-    {128, &entry_cache[3], 4, 0}, 
-    {256, &entry_cache[4], 4, 0}, 
-    {512, &entry_cache[5], 4, 0}, 
-    {1024, &entry_cache[6], 8, 0}, 
-    {2048, &entry_cache[7], 8, 0}
+    {24, &entry_cache[1], 2, 0},
+    {32, &entry_cache[2], 2, 0},
+    {48, &entry_cache[3], 2, 0},
+    {64, &entry_cache[4], 2, 0},
+    {96, &entry_cache[5], 4, 0},
+    {128, &entry_cache[6], 4, 0}, 
+    {192, &entry_cache[7], 4, 0}, 
+    {256, &entry_cache[8], 4, 0}, 
+    {384, &entry_cache[9], 4, 0}, 
+    {512, &entry_cache[10], 4, 0}, 
+    {768, &entry_cache[11], 8, 0}, 
+    {1024, &entry_cache[12], 8, 0}, 
+    {1536, &entry_cache[13], 8, 0}, 
+    {2048, &entry_cache[14], 8, 0},
+    {3072, &entry_cache[15], 8, 0}
 };
 
+#define ENTRY_SIZE_INDEX(size) (((size) + (1 << KALLOC_ENTRY_SIZE_SHIFT) - 1) >> KALLOC_ENTRY_SIZE_SHIFT)
+
+/* Entry num of every size up to KALLOC_MAX_ENTRY_ALLOC, indexed by ENTRY_SIZE_INDEX. Each range
+ * ends at the index of the size of its entry. */
+static const uint8_t entry_size_table[ENTRY_SIZE_INDEX(KALLOC_MAX_ENTRY_ALLOC) + 1] = {
+    [0 ... ENTRY_SIZE_INDEX(16)] = 0,
+    [ENTRY_SIZE_INDEX(16) + 1 ... ENTRY_SIZE_INDEX(24)] = 1,
+    [ENTRY_SIZE_INDEX(24) + 1 ... ENTRY_SIZE_INDEX(32)] = 2,
+    [ENTRY_SIZE_INDEX(32) + 1 ... ENTRY_SIZE_INDEX(48)] = 3,
+    [ENTRY_SIZE_INDEX(48) + 1 ... ENTRY_SIZE_INDEX(64)] = 4,
+    [ENTRY_SIZE_INDEX(64) + 1 ... ENTRY_SIZE_INDEX(96)] = 5,
+    [ENTRY_SIZE_INDEX(96) + 1 ... ENTRY_SIZE_INDEX(128)] = 6,
+    [ENTRY_SIZE_INDEX(128) + 1 ... ENTRY_SIZE_INDEX(192)] = 7,
+    [ENTRY_SIZE_INDEX(192) + 1 ... ENTRY_SIZE_INDEX(256)] = 8,
+    [ENTRY_SIZE_INDEX(256) + 1 ... ENTRY_SIZE_INDEX(384)] = 9,
+    [ENTRY_SIZE_INDEX(384) + 1 ... ENTRY_SIZE_INDEX(512)] = 10,
+    [ENTRY_SIZE_INDEX(512) + 1 ... ENTRY_SIZE_INDEX(768)] = 11,
+    [ENTRY_SIZE_INDEX(768) + 1 ... ENTRY_SIZE_INDEX(1024)] = 12,
+    [ENTRY_SIZE_INDEX(1024) + 1 ... ENTRY_SIZE_INDEX(1536)] = 13,
+    [ENTRY_SIZE_INDEX(1536) + 1 ... ENTRY_SIZE_INDEX(2048)] = 14,
+    [ENTRY_SIZE_INDEX(2048) + 1 ... ENTRY_SIZE_INDEX(3072)] = 15
+};
+
+/* Per cpu so the counting stays off the shared cache lines of the magazine fast path.
+ * Only counted in profile builds, the rest of the time the counts stay 0. */
+static kalloc_entry_stats_t entry_stats[CORE_NUM][KALLOC_ENTRY_NUM];
+
 static uint64_t normalize_addr(uint64_t addr)
 {
     return addr & ~MMU_UPPER_ADDRESS;
@@ -46,111 +99,243 @@ static uint64_t normalize_addr(uint64_t addr)
 
 static int get_entry_num_from_size(size_t size)
 {
-    for (int i = 0; i < KALLOC_ENTRY_NUM; i++) {
-        if (size <= entries[i].size) {
-            return i;
-        }
-    }
-
-    return KALLOC_ENTRY_NUM - 1;
+    return entry_size_table[ENTRY_SIZE_INDEX(size)];
 }
 
 static int get_entry_num_from_cache(kalloc_cache_t * cache)
 {
-    for (int i = 0; i < KALLOC_ENTRY_NUM; i++) {
-        if (cache == entries[i].cache) {
-            return i;
-        }
-    }
+    if (cache < &entry_cache[0] || cache >= &entry_cache[KALLOC_ENTRY_NUM])
+        return -1;
 
-    return -1;
+    return cache->index;
 }
 
-static kalloc_cache_t * get_cache_from_addr(void * addr)
+static int is_named_cache(kalloc_cache_t * cache)
 {
-    kalloc_cache_t * cache;
+    return cache >= &named_caches[0] && cache < &named_caches[KALLOC_NAMED_CACHE_NUM] && cache->name;
+}
+
+#ifdef KALLOC_PROFILE
+/* Irqs are disabled so we can not be moved to another cpu halfway through the update. */
+static void entry_stats_alloc(unsigned int entry_num, size_t size)
+{
+    kalloc_entry_stats_t * stats;
+    uint64_t irq_flags;
+
+    irq_save_disable(&irq_flags);
+    stats = &entry_stats[cpu_get_id()][entry_num];
+    stats->alloc_num++;
+    stats->req_size += size;
+    stats->waste_size += entries[entry_num].size - size;
+    irq_restore(irq_flags);
+}
+
+/* Bytes an alloc of size really takes, the profiler counts by size class. */
+static size_t prof_class_size(size_t size)
+{
+    if (size > KALLOC_MAX_ENTRY_ALLOC)
+        return ALIGN_UP(size, PAGE_SIZE);
+
+    return entries[get_entry_num_from_size(size)].size;
+}
+#endif
+
+/* The page obj is the slab the page belongs to, which points back to its cache. */
+static kalloc_slab_t * get_slab_from_addr(void * addr)
+{
+    kalloc_slab_t * slab;
     unsigned int page_index = PAGE_INDEX_FROM_PTR(addr);
 
-    cache = mm_get_page_obj_ptr(page_index);
+    slab = mm_get_page_obj_ptr(page_index);
     /* If the page_obj_ptr is not a valid address, it might be invalid or it is a page entry address. */
-    if ((uint64_t) cache < PAGE_SIZE) {
+    if ((uint64_t) slab < PAGE_SIZE) {
         return NULL;
     }
 
-    return cache;
+    return slab;
 }
 
-static unsigned int cache_expand(kalloc_cache_t * cache, unsigned int entry_num)
+/* Slow path once the page allocator is out of blocks of memorder, free up what we can and try again. */
+static uint64_t alloc_pages_slowpath(unsigned int memorder, flags_t flags)
 {
-    kalloc_slab_t * slab;
-    void * slab_mem;
+    uint64_t addr;
 
-    slab_mem = (void *)kalloc_page_alloc_pages(mm_pages_to_memorder(entries[entry_num].slab_init_page_num), 0);
+    /* Pull back the pages cached on every cpu. */
+    kalloc_pcp_drain_all();
+    kalloc_zero_drain();
 
-    ASSERT_PANIC(slab_mem, "Slab mem alloc failed");
+    addr = kalloc_page_alloc_pages(memorder, flags);
+    if (addr)
+        return addr;
 
-    slab = kalloc_cache_add_slab_pages(entries[entry_num].cache, slab_mem, 
-                                    entries[entry_num].slab_init_page_num);
-    ASSERT_PANIC(slab, "Slab add failed.");
+    /* Have the background tasks give back memory and rebuild the higher memorders, the pcp lists could
+     * have been refilled by the other cores in the meantime so try once more. */
+    kalloc_reclaim_request();
+    kalloc_compact_request(memorder);
 
-    return 0;
+    return kalloc_page_alloc_pages(memorder, flags);
 }
 
-static unsigned int check_cache_needs_expand(kalloc_cache_t * cache)
+void * kalloc_pages(unsigned int page_num, flags_t flags)
 {
-    // TODO implement some sort of threshold system so we can preexpand
-    if (cache->num != cache->max_num)
-        return 0;
+    uint64_t addr = 0;
+    unsigned int memorder;
 
-    return 1; 
-}
+    CHECK_CHEAP(page_num, "Kalloc_pages page num is 0");
 
-void * kalloc_pages(unsigned int page_num, flags_t flags)
-{
-    void * ptr = NULL;
+    memorder = mm_pages_to_memorder(page_num);
 
-    ASSERT_PANIC(page_num, "Kalloc_pages page num is 0");
+    /* Single unmovable pages are zeroed ahead of time by the idle cores. */
+    if ((flags & KALLOC_ZERO_F) && memorder == 0 && KALLOC_FLAGS_TYPE(flags) == MM_TYPE_UNMOVABLE) {
+        addr = kalloc_zero_alloc();
+        if (addr)
+            goto kalloc_pages_exit;
+    }
 
-    page_num = math_align_power2_64(page_num);
+    /* Low memorders are served from the per cpu lists without taking an area lock. */
+    if (memorder <= KALLOC_PCP_MAX_ORDER) {
+        addr = kalloc_pcp_alloc(memorder, flags);
+        if (addr) {
+            if (flags & KALLOC_ZERO_F)
+                kalloc_zero_pages(addr, memorder);
+            goto kalloc_pages_exit;
+        }
+    }
 
-    lock_spinlock(&lock);
+    /* The page allocator zeroes the block itself for KALLOC_ZERO_F. */
+    addr = kalloc_page_alloc_pages(memorder, flags);
+    if (addr)
+        goto kalloc_pages_exit;
 
-    ptr = (void *)kalloc_page_alloc_pages(mm_pages_to_memorder(page_num), flags);
-    if (!ptr) {
+    addr = alloc_pages_slowpath(memorder, flags);
+    if (!addr) {
         DEBUG_PANIC("Kalloc pages alloc pages failed.");
-        goto kalloc_pages_exit;
+        return NULL;
     }
 
 kalloc_pages_exit:
-    unlock_spinlock(&lock);
+    /* Blocks come in powers of two, the tail past page_num goes straight back to the free lists. */
+    if (page_num != (unsigned int)MM_MEMORDER_TO_PAGES(memorder))
+        kalloc_page_trim_pages(addr, page_num);
+
+    return (void *)(addr | MMU_UPPER_ADDRESS);
+}
+
+/* Returns the number of blocks of page_num pages written to ptrs. */
+unsigned int kalloc_pages_bulk(unsigned int page_num, unsigned int count, void ** ptrs, flags_t flags)
+{
+    unsigned int num;
+    unsigned int memorder;
 
-    ptr = (void *)((uint64_t)ptr | MMU_UPPER_ADDRESS);
+    CHECK_CHEAP(page_num, "Kalloc_pages page num is 0");
 
-    return ptr;
+    page_num = math_align_power2_64(page_num);
+    memorder = mm_pages_to_memorder(page_num);
+
+    /* The addrs are written over the ptrs array in place. */
+    num = kalloc_page_alloc_bulk(memorder, count, (uint64_t *)ptrs, flags);
+    if (num != count) {
+        kalloc_pcp_drain_all();
+        num += kalloc_page_alloc_bulk(memorder, count - num, (uint64_t *)&ptrs[num], flags);
+    }
+
+    for (unsigned int i = 0; i < num; i++) {
+        ptrs[i] = (void *)((uint64_t)ptrs[i] | MMU_UPPER_ADDRESS);
+    }
+
+    return num;
 }
 
 int kalloc_free_pages(void * page_ptr, flags_t flags)
 {
     int ret = 0;
+    uint64_t addr = normalize_addr((uint64_t)page_ptr);
+    /* The block is still allocated so its memorder is stable without the lock. */
+    unsigned int memorder = kalloc_get_buddy_memorder(kalloc_get_buddy_from_addr(addr));
+    unsigned int page_num = mm_get_page_range_num(addr / PAGE_SIZE);
+
+    /* Trimmed allocs are made of several blocks, they go back the same way a reserved range does. */
+    if (page_num) {
+        mm_set_page_range_num(addr / PAGE_SIZE, 0);
+        return kalloc_page_free_range(addr, page_num * PAGE_SIZE);
+    }
 
-    lock_spinlock(&lock);
-
-    ret = kalloc_page_free_pages((uint64_t)page_ptr, flags);
+    if (memorder <= KALLOC_PCP_MAX_ORDER && !kalloc_pcp_free(addr, memorder, flags))
+        return 0;
 
-    unlock_spinlock(&lock);
+    ret = kalloc_page_free_pages(addr, flags);
     
-    ASSERT_PANIC(!ret, "Kalloc free pages failed.");
+    CHECK_CHEAP(!ret, "Kalloc free pages failed.");
     return ret;
 }
 
-void * kalloc_alloc(size_t size, flags_t flags)
+#if MM_HUGE_PAGE_SIZE != MMU_LEVEL1_BLOCKSIZE
+#error "Huge pages must match the level 1 block size"
+#endif
+
+/* Returns huge_num contiguous 2MB blocks aligned to the level 1 block size, so the range can be
+ * mapped with block descriptors instead of a full table of page entries. */
+void * kalloc_huge_pages(unsigned int huge_num, flags_t flags)
+{
+    uint64_t addr;
+    unsigned int memorder = MM_HUGE_MEMORDER;
+
+    CHECK_CHEAP(huge_num, "Kalloc_huge_pages huge num is 0");
+
+    while ((unsigned int)MM_MEMORDER_TO_PAGES(memorder) < huge_num * MM_HUGE_PAGE_NUM)
+        memorder++;
+
+    if (memorder > MM_MAX_ORDER) {
+        DEBUG_THROW("Kalloc huge pages num is larger than max order.");
+        return NULL;
+    }
+
+    // Buddies are aligned to their own size, so the block is always aligned to a huge page
+    addr = kalloc_page_alloc_pages(memorder, flags);
+    if (!addr)
+        addr = alloc_pages_slowpath(memorder, flags);
+
+    if (!addr) {
+        DEBUG_THROW("Kalloc huge pages alloc pages failed.");
+        return NULL;
+    }
+
+    CHECK_CHEAP(IS_ALIGNED(addr, MM_HUGE_PAGE_SIZE), "Huge page is not block aligned.");
+
+    // The block is ours, nobody else touches its page flags until it is freed
+    mm_set_page_flag(addr / PAGE_SIZE, MM_PAGE_HUGE_F);
+
+    return (void *)(addr | MMU_UPPER_ADDRESS);
+}
+
+int kalloc_is_huge_page(void * page_ptr)
+{
+    return mm_test_page_flag(normalize_addr((uint64_t)page_ptr) / PAGE_SIZE, MM_PAGE_HUGE_F);
+}
+
+int kalloc_free_huge_pages(void * page_ptr, flags_t flags)
+{
+    int ret;
+    uint64_t addr = normalize_addr((uint64_t)page_ptr);
+
+    if (!kalloc_is_huge_page(page_ptr)) {
+        DEBUG_THROW("Kalloc free huge pages ptr is not a huge page.");
+        return 1;
+    }
+
+    // The free clears the huge flag under the area lock
+    ret = kalloc_page_free_pages(addr, flags);
+
+    CHECK_CHEAP(!ret, "Kalloc free huge pages failed.");
+    return ret;
+}
+
+static void * _kalloc_alloc(size_t size, flags_t flags)
 {   
     kalloc_cache_t * cache;
     unsigned int page_num;
     int entry_num;
     void * obj;
-
-    int ret = 0;
     
     ASSERT_PANIC(kalloc_initialized, "Kalloc is not initialized");
 
@@ -159,21 +344,20 @@ void * kalloc_alloc(size_t size, flags_t flags)
         return kalloc_pages(page_num, flags);
     }
 
-    lock_spinlock(&lock);
-
     entry_num = get_entry_num_from_size(size);
+#ifdef KALLOC_PROFILE
+    entry_stats_alloc(entry_num, size);
+#endif
 
-    cache = entries[entry_num].cache;
+    obj = kalloc_mag_alloc(&entry_mags[entry_num]);
+    if (obj)
+        return (void *)((uint64_t)obj | MMU_UPPER_ADDRESS);
 
-    if (check_cache_needs_expand(cache)) {
-        ret = cache_expand(cache, entry_num);
-        if (ret) {
-            DEBUG_THROW("Kalloc entry cache expand failed.");
-            obj = NULL;
-            goto kalloc_alloc_exit;
-        }
-    }
+    lock_spinlock(&lock);
 
+    cache = entries[entry_num].cache;
+
+    // The cache grows itself through entry_page_allocator
     obj = kalloc_cache_alloc(cache);
     if (!obj) {
         DEBUG_THROW("Kalloc entry alloc failed.");
@@ -182,10 +366,25 @@ void * kalloc_alloc(size_t size, flags_t flags)
 
     entries[entry_num].alloc_num++;
 
+    // Frees of the objs of this slab on the other cpus come back to us, it is only a hint so we can be moved after
+    get_slab_from_addr(obj)->owner_cpu = cpu_get_id();
+
 kalloc_alloc_exit:
     unlock_spinlock(&lock);
 
-    obj = (void *)((uint64_t)obj | MMU_UPPER_ADDRESS);
+    if (obj)
+        obj = (void *)((uint64_t)obj | MMU_UPPER_ADDRESS);
+
+    return obj;
+}
+
+/* Every return of the alloc comes back through here, so the profiler sees the caller of kalloc_alloc. */
+void * kalloc_alloc(size_t size, flags_t flags)
+{
+    void * obj = _kalloc_alloc(size, flags);
+
+    if (obj)
+        KALLOC_PROF_ALLOC(__builtin_return_address(0), obj, prof_class_size(size));
 
     return obj;
 }
@@ -193,31 +392,46 @@ kalloc_alloc_exit:
 int kalloc_free(void * obj, flags_t flags)
 {
     kalloc_cache_t * cache;
+    kalloc_slab_t * slab;
     unsigned int page_num;
     int entry_num;
     int ret = 0;
 
     ASSERT_PANIC(kalloc_initialized, "Kalloc is not initialized");
 
+    KALLOC_PROF_FREE(obj);
+
     obj = (void *)((uint64_t)obj & ~MMU_UPPER_ADDRESS);
 
-    cache = get_cache_from_addr(obj);
-    if (!cache) {
-        if (!IS_ALIGNED((uint64_t)obj, PAGE_SIZE)) {
+    slab = get_slab_from_addr(obj);
+    if (!slab) {
+        if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !IS_ALIGNED((uint64_t)obj, PAGE_SIZE)) {
             DEBUG_PANIC("Suspected page pointer is not aligned.");
         }
 
-        return kalloc_page_free_pages((uint64_t)obj, flags);
+        return kalloc_free_pages(obj, flags);
     }
 
-    lock_spinlock(&lock);
+    cache = slab->cache;
 
+    // The entries never change after init so the lookup does not need the lock
     entry_num = get_entry_num_from_cache(cache);
     if (entry_num == -1) {
+        if (is_named_cache(cache))
+            return kalloc_obj_free(cache, (void *)((uint64_t)obj | MMU_UPPER_ADDRESS));
+
         DEBUG_PANIC("Could not find entry from linked cache.");
-        ret = 1;
-        goto kalloc_free_exit;
+        return 1;
     }
+
+    // The owner_cpu read races the alloc that sets it, a stale cpu only sends the obj to the wrong magazines
+    if (!kalloc_mag_remote_free(&entry_mags[entry_num], obj, slab->owner_cpu))
+        return 0;
+
+    if (!kalloc_mag_free(&entry_mags[entry_num], obj))
+        return 0;
+
+    lock_spinlock(&lock);
     
     ret = kalloc_cache_free(cache, obj);
     if (ret) {
@@ -233,27 +447,349 @@ kalloc_free_exit:
     return ret;
 }
 
+/* Slab pages can be given back once the cache shrinks, keep them together in reclaimable areas. */
+static void * entry_page_allocator(unsigned int page_num, flags_t flags)
+{
+    uint64_t addr;
+    unsigned int memorder = mm_pages_to_memorder(page_num);
+
+    (void)flags;
+
+    addr = kalloc_page_alloc_pages(memorder, KALLOC_RECLAIMABLE_F);
+    if (!addr)
+        addr = alloc_pages_slowpath(memorder, KALLOC_RECLAIMABLE_F);
+
+    return (void *)addr;
+}
+
+static int entry_page_destructor(void * page_ptr, unsigned int page_num, flags_t flags)
+{
+    (void)page_num;
+    (void)flags;
+
+    return kalloc_page_free_pages(mmu_get_phys_addr((uint64_t)page_ptr), 0);
+}
+
+kalloc_cache_t * kalloc_cache_create(const char * name, size_t size, size_t align, void (*ctor)(void *), void (*dtor)(void *))
+{
+    kalloc_cache_t * cache = NULL;
+    unsigned int page_num = 1;
+    int ret;
+
+    ASSERT_PANIC(kalloc_initialized, "Kalloc is not initialized");
+    ASSERT_PANIC(name && size, "Kalloc cache create needs a name and size");
+
+    if (!align || (align & (align - 1)) || align > KALLOC_SLAB_MAX_ALIGN) {
+        DEBUG_THROW("Kalloc cache align is not a power of two the slabs can keep.");
+        return NULL;
+    }
+
+    // Slabs align their objs to the lowest set bit of the size, and need at least a word
+    size = ALIGN_UP(ALIGN_UP(size, sizeof(uint64_t)), align);
+
+    while (kalloc_slab_inline_obj_num_pages(size, page_num) < KALLOC_NAMED_CACHE_MIN_OBJ_NUM &&
+           page_num < MM_MEMORDER_TO_PAGES(MM_MAX_ORDER))
+        page_num <<= 1;
+
+    lock_spinlock(&lock);
+
+    for (unsigned int i = 0; i < KALLOC_NAMED_CACHE_NUM; i++) {
+        if (!named_caches[i].name) {
+            cache = &named_caches[i];
+            break;
+        }
+    }
+
+    if (!cache) {
+        DEBUG_THROW("Out of named kalloc caches.");
+        goto kalloc_cache_create_exit;
+    }
+
+    ret = kalloc_cache_init(cache, size, page_num, entry_page_allocator, entry_page_destructor, 0);
+    ASSERT_PANIC(!ret, "Named cache failed to initialize.");
+    kalloc_cache_set_ctor(cache, ctor, dtor);
+    cache->name = name;
+
+kalloc_cache_create_exit:
+    unlock_spinlock(&lock);
+
+    return cache;
+}
+
+int kalloc_cache_destroy(kalloc_cache_t * cache)
+{
+    kalloc_slab_t * slab;
+    int ret = 0;
+
+    ASSERT_PANIC(is_named_cache(cache), "Kalloc cache destroy of a cache that was not created.");
+
+    lock_spinlock(&lock);
+    lock_spinlock(&cache->lock);
+
+    if (cache->num) {
+        DEBUG_THROW("Kalloc cache destroy with objs still in use.");
+        ret = 1;
+        goto kalloc_cache_destroy_exit;
+    }
+
+    // Popping the slab runs the dtor over its objs before the pages go
+    while ((slab = kalloc_cache_pop_free_slab(cache))) {
+        ret = entry_page_destructor((void *)slab, slab->mem_page_num, 0);
+        ASSERT_PANIC(!ret, "Kalloc cache destroy page free failed.");
+    }
+
+    ASSERT_PANIC(!cache->page_num, "Kalloc cache destroy left slabs behind.");
+    cache->name = NULL;
+
+kalloc_cache_destroy_exit:
+    unlock_spinlock(&cache->lock);
+    unlock_spinlock(&lock);
+
+    return ret;
+}
+
+void * kalloc_obj_alloc(kalloc_cache_t * cache)
+{
+    void * obj;
+
+    ASSERT_PANIC(is_named_cache(cache), "Kalloc obj alloc from a cache that was not created.");
+
+    lock_spinlock(&cache->lock);
+    obj = kalloc_cache_alloc(cache);
+    unlock_spinlock(&cache->lock);
+
+    if (!obj) {
+        DEBUG_THROW("Kalloc obj alloc failed.");
+        return NULL;
+    }
+
+    return (void *)((uint64_t)obj | MMU_UPPER_ADDRESS);
+}
+
+int kalloc_obj_free(kalloc_cache_t * cache, void * obj)
+{
+    int ret;
+
+    ASSERT_PANIC(is_named_cache(cache), "Kalloc obj free to a cache that was not created.");
+
+    lock_spinlock(&cache->lock);
+    ret = kalloc_cache_free(cache, (void *)normalize_addr((uint64_t)obj));
+    unlock_spinlock(&cache->lock);
+
+    if (ret) {
+        DEBUG_PANIC("Kalloc could not free obj to its named cache.");
+    }
+
+    return ret;
+}
+
+/* Give every object held by the magazines of an entry back to its cache. MUST HOLD THE KALLOC LOCK. */
+static void drain_mags(unsigned int entry_num)
+{
+    void * objs[KALLOC_MAG_DRAIN_BATCH];
+    unsigned int num;
+    int ret;
+
+    while ((num = kalloc_mag_drain(&entry_mags[entry_num], &objs[0], KALLOC_MAG_DRAIN_BATCH))) {
+        for (unsigned int i = 0; i < num; i++) {
+            ret = kalloc_cache_free(entries[entry_num].cache, objs[i]);
+            ASSERT_PANIC(!ret, "Kalloc mag drain free failed.");
+        }
+        entries[entry_num].alloc_num -= num;
+    }
+}
+
+static unsigned int shrink_caches(unsigned int page_num)
+{
+    unsigned int freed_num = 0;
+
+    lock_spinlock(&lock);
+
+    // A cache expands again on its next alloc if we took every slab it had
+    for (int i = 0; i < KALLOC_ENTRY_NUM && freed_num < page_num; i++) {
+        drain_mags(i);
+        freed_num += kalloc_cache_shrink(entries[i].cache, page_num - freed_num);
+    }
+
+    for (int i = 0; i < KALLOC_NAMED_CACHE_NUM && freed_num < page_num; i++) {
+        if (!named_caches[i].name)
+            continue;
+
+        lock_spinlock(&named_caches[i].lock);
+        freed_num += kalloc_cache_shrink(&named_caches[i], page_num - freed_num);
+        unlock_spinlock(&named_caches[i].lock);
+    }
+
+    unlock_spinlock(&lock);
+
+    return freed_num;
+}
+
+unsigned int kalloc_shrink_caches()
+{
+    return shrink_caches(KALLOC_RECLAIM_ALL);
+}
+
+unsigned int kalloc_move_slabs(void *(*move_pages)(void *, unsigned int))
+{
+    unsigned int page_num = 0;
+
+    lock_spinlock(&lock);
+
+    // Objs sitting in the magazines would keep their slabs from ever being empty
+    for (int i = 0; i < KALLOC_ENTRY_NUM; i++) {
+        drain_mags(i);
+        page_num += kalloc_cache_move_slabs(entries[i].cache, move_pages);
+    }
+
+    for (int i = 0; i < KALLOC_NAMED_CACHE_NUM; i++) {
+        if (!named_caches[i].name)
+            continue;
+
+        lock_spinlock(&named_caches[i].lock);
+        page_num += kalloc_cache_move_slabs(&named_caches[i], move_pages);
+        unlock_spinlock(&named_caches[i].lock);
+    }
+
+    unlock_spinlock(&lock);
+
+    return page_num;
+}
+
+unsigned int kalloc_reap_caches()
+{
+    unsigned int page_num = 0;
+
+    lock_spinlock(&lock);
+
+    for (int i = 0; i < KALLOC_ENTRY_NUM; i++) {
+        page_num += kalloc_cache_reap(entries[i].cache);
+    }
+
+    for (int i = 0; i < KALLOC_NAMED_CACHE_NUM; i++) {
+        if (!named_caches[i].name)
+            continue;
+
+        lock_spinlock(&named_caches[i].lock);
+        page_num += kalloc_cache_reap(&named_caches[i]);
+        unlock_spinlock(&named_caches[i].lock);
+    }
+
+    unlock_spinlock(&lock);
+
+    return page_num;
+}
+
+static unsigned int cache_shrinker_count(void * data)
+{
+    unsigned int page_num = 0;
+
+    (void)data;
+
+    lock_spinlock(&lock);
+    for (int i = 0; i < KALLOC_ENTRY_NUM; i++) {
+        page_num += kalloc_cache_free_page_num(entries[i].cache);
+    }
+    for (int i = 0; i < KALLOC_NAMED_CACHE_NUM; i++) {
+        if (!named_caches[i].name)
+            continue;
+
+        lock_spinlock(&named_caches[i].lock);
+        page_num += kalloc_cache_free_page_num(&named_caches[i]);
+        unlock_spinlock(&named_caches[i].lock);
+    }
+    unlock_spinlock(&lock);
+
+    return page_num;
+}
+
+static unsigned int cache_shrinker_shrink(void * data, unsigned int page_num)
+{
+    (void)data;
+
+    return shrink_caches(page_num);
+}
+
 int kalloc_init()
 {   
     DEBUG("-- Kalloc init --");
 
-    kalloc_cache_t * cache;
+    unsigned int slab_num;
     int ret = 0;
 
     ASSERT_PANIC(mm_is_initialized(), "MM is not initialized");
+    ASSERT_PANIC(sizeof(entries) / sizeof(kalloc_entry_t) == KALLOC_ENTRY_NUM, "Kalloc entry table size wrong.");
+
+    kalloc_pcp_init();
+    kalloc_zero_init();
+    kalloc_compact_init();
+    kalloc_reclaim_init();
 
     for (int i = 0; i < KALLOC_ENTRY_NUM; i++) {
         ret = kalloc_cache_init(entries[i].cache, entries[i].size, 
-                                entries[i].slab_init_page_num, NULL, NULL, 
-                                KALLOC_CACHE_NO_EXPAND_F | KALLOC_CACHE_NO_SHRINK_F);
+                                entries[i].slab_init_page_num, entry_page_allocator, entry_page_destructor, 0);
         ASSERT_PANIC(!ret, "Cache failed to initialize.");
+        entries[i].cache->index = i;
+        entries[i].cache->expand_slab_num = KALLOC_EXPAND_SLAB_NUM;
 
-        ret = cache_expand(cache, i);
-        ASSERT_PANIC(!ret, "Initial cache expand failed.");
+        slab_num = kalloc_cache_grow(entries[i].cache, KALLOC_EXPAND_SLAB_NUM);
+        ASSERT_PANIC(slab_num, "Initial cache expand failed.");
+
+        kalloc_mag_cache_init(&entry_mags[i], entries[i].cache);
     }
 
+    cache_shrinker.name = "kalloc caches";
+    cache_shrinker.count = cache_shrinker_count;
+    cache_shrinker.shrink = cache_shrinker_shrink;
+    cache_shrinker.data = NULL;
+    kalloc_shrinker_register(&cache_shrinker);
+
     kalloc_initialized = 1;
 
     DEBUG("-- Kalloc init done --");
     return 0;
-}
\ No newline at end of file
+}
+
+unsigned int kalloc_entry_num(size_t size)
+{
+    CHECK_CHEAP(size <= KALLOC_MAX_ENTRY_ALLOC, "Kalloc entry size too large.");
+
+    return get_entry_num_from_size(size);
+}
+
+void kalloc_entry_stats(unsigned int entry_num, kalloc_entry_stats_t * stats)
+{
+    kalloc_entry_stats_t * cpu_stats;
+
+    ASSERT_PANIC(entry_num < KALLOC_ENTRY_NUM, "Kalloc entry num out of range.");
+
+    memset(stats, 0, sizeof(kalloc_entry_stats_t));
+    stats->size = entries[entry_num].size;
+
+    for (unsigned int i = 0; i < CORE_NUM; i++) {
+        cpu_stats = &entry_stats[i][entry_num];
+        stats->alloc_num += cpu_stats->alloc_num;
+        stats->req_size += cpu_stats->req_size;
+        stats->waste_size += cpu_stats->waste_size;
+    }
+}
+
+void kalloc_entry_dump()
+{
+    kalloc_entry_stats_t stats;
+
+    lock_printlock();
+    printf("Kalloc entry internal fragmentation\n");
+    for (unsigned int i = 0; i < KALLOC_ENTRY_NUM; i++) {
+        kalloc_entry_stats(i, &stats);
+        if (!stats.alloc_num)
+            continue;
+
+        printfdigit("size=", stats.size);
+        printfdigit(" allocs=", stats.alloc_num);
+        printfdigit(" requested bytes=", stats.req_size);
+        printfdigit(" wasted bytes=", stats.waste_size);
+        printfdigit(" wasted per mille=", (stats.waste_size * 1000) / (stats.alloc_num * stats.size));
+    }
+    unlock_printlock();
+}
@@ -0,0 +1,132 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/assert.h>
+#include <common/string.h>
+#include <kernel/mm.h>
+#include <kernel/kalloc.h>
+#include <kernel/kalloc_arena.h>
+
+static size_t chunk_size(kalloc_arena_chunk_t * chunk)
+{
+    return chunk->page_num * PAGE_SIZE;
+}
+
+/* Offset into the chunk an alloc of align would start at. */
+static size_t chunk_alloc_offset(kalloc_arena_chunk_t * chunk, size_t align)
+{
+    return ALIGN_UP((uint64_t)chunk + chunk->used, align) - (uint64_t)chunk;
+}
+
+static void free_chunk(kalloc_arena_t * arena, kalloc_arena_chunk_t * chunk)
+{
+    int ret;
+
+    arena->chunk = chunk->prev;
+    arena->stats.chunk_num--;
+    arena->stats.page_num -= chunk->page_num;
+
+    ret = kalloc_free_pages(chunk, 0);
+    ASSERT_PANIC(!ret, "Arena chunk free failed.");
+}
+
+static kalloc_arena_chunk_t * add_chunk(kalloc_arena_t * arena, size_t size, size_t align)
+{
+    kalloc_arena_chunk_t * chunk;
+    unsigned int page_num = arena->chunk_page_num;
+    size_t need = ALIGN_UP(sizeof(kalloc_arena_chunk_t), align) + size;
+
+    // Allocs larger than a chunk get a chunk of their own size, kalloc_pages does not round it up
+    if (need > page_num * PAGE_SIZE)
+        page_num = ALIGN_UP(need, PAGE_SIZE) / PAGE_SIZE;
+
+    chunk = (kalloc_arena_chunk_t *)kalloc_pages(page_num, arena->flags);
+    if (!chunk) {
+        DEBUG_THROW("Arena chunk alloc failed.");
+        return NULL;
+    }
+
+    // The tail of the chunk we are leaving is never used again
+    if (arena->chunk)
+        arena->stats.waste_size += chunk_size(arena->chunk) - arena->chunk->used;
+
+    chunk->prev = arena->chunk;
+    chunk->page_num = page_num;
+    chunk->used = sizeof(kalloc_arena_chunk_t);
+    arena->chunk = chunk;
+
+    arena->stats.chunk_num++;
+    arena->stats.page_num += page_num;
+    if (arena->stats.page_num > arena->stats.max_page_num)
+        arena->stats.max_page_num = arena->stats.page_num;
+
+    return chunk;
+}
+
+void kalloc_arena_init(kalloc_arena_t * arena, unsigned int chunk_page_num, flags_t flags)
+{
+    ASSERT(arena);
+
+    memset(arena, 0, sizeof(kalloc_arena_t));
+    arena->chunk_page_num = chunk_page_num ? chunk_page_num : KALLOC_ARENA_CHUNK_PAGE_NUM;
+    arena->flags = flags;
+}
+
+void * kalloc_arena_alloc(kalloc_arena_t * arena, size_t size, size_t align)
+{
+    kalloc_arena_chunk_t * chunk = arena->chunk;
+    size_t offset;
+
+    if (!align)
+        align = KALLOC_ARENA_MIN_ALIGN;
+
+    CHECK_CHEAP(!(align & (align - 1)) && align <= PAGE_SIZE, "Arena align is not a power of two up to a page.");
+
+    if (align < KALLOC_ARENA_MIN_ALIGN)
+        align = KALLOC_ARENA_MIN_ALIGN;
+
+    if (!chunk || chunk_alloc_offset(chunk, align) + size > chunk_size(chunk)) {
+        chunk = add_chunk(arena, size, align);
+        if (!chunk)
+            return NULL;
+    }
+
+    offset = chunk_alloc_offset(chunk, align);
+
+    arena->stats.alloc_num++;
+    arena->stats.alloc_size += size;
+    arena->stats.waste_size += offset - chunk->used;
+
+    chunk->used = offset + size;
+
+    return (void *)((char *)chunk + offset);
+}
+
+void kalloc_arena_mark(kalloc_arena_t * arena, kalloc_arena_mark_t * mark)
+{
+    mark->chunk = arena->chunk;
+    mark->used = arena->chunk ? arena->chunk->used : 0;
+}
+
+void kalloc_arena_rewind(kalloc_arena_t * arena, kalloc_arena_mark_t * mark)
+{
+    while (arena->chunk && arena->chunk != mark->chunk) {
+        free_chunk(arena, arena->chunk);
+    }
+
+    CHECK_CHEAP(arena->chunk == mark->chunk, "Arena mark is not a chunk of this arena.");
+
+    if (arena->chunk) {
+        CHECK_CHEAP(mark->used <= arena->chunk->used, "Arena mark is past the arena.");
+        arena->chunk->used = mark->used;
+    }
+
+    arena->stats.rewind_num++;
+}
+
+void kalloc_arena_destroy(kalloc_arena_t * arena)
+{
+    while (arena->chunk) {
+        free_chunk(arena, arena->chunk);
+    }
+}
@@ -6,6 +6,7 @@
 #include <common/assert.h>
 #include <common/lock.h>
 #include <kernel/mm.h>
+#include <kernel/mmu.h>
 #include <kernel/kalloc_slab.h>
 #include <kernel/kalloc_cache.h>
 
@@ -58,8 +59,8 @@ static kalloc_slab_t * get_free_slab(kalloc_cache_t * cache)
     }
 
     slab = STRUCT_P(slab_node, kalloc_slab_t, node);
-    ASSERT_PANIC(slab->max_num, "Max num is 0, slab not free or malformed");
-    ASSERT_PANIC(slab->num != slab->max_num, "Slab is full but in free list");
+    CHECK_CHEAP(slab->max_num, "Max num is 0, slab not free or malformed");
+    CHECK_CHEAP(slab->num != slab->max_num, "Slab is full but in free list");
 
     KALLOC_SLAB_VERIFY(slab);
     return slab;
@@ -81,7 +82,8 @@ static kalloc_slab_t * _get_slab_from_addr(ll_head_t * list, void * obj)
     return NULL;
 }
 
-static kalloc_slab_t * get_slab_from_addr(kalloc_cache_t * cache, void * obj)
+/* Unlinked caches have no page objs, so we have to search every slab they hold. */
+static kalloc_slab_t * search_slab_from_addr(kalloc_cache_t * cache, void * obj)
 {
     kalloc_slab_t * slab;
 
@@ -102,12 +104,36 @@ static kalloc_slab_t * get_slab_from_addr(kalloc_cache_t * cache, void * obj)
     return NULL;
 }
 
+static kalloc_slab_t * get_slab_from_addr(kalloc_cache_t * cache, void * obj)
+{
+    uint64_t slab_addr;
+    kalloc_slab_t * slab;
+
+    if (cache->flags & KALLOC_CACHE_NO_LINK_F)
+        return search_slab_from_addr(cache, obj);
+
+    slab_addr = (uint64_t)mm_get_page_obj_ptr(PAGE_INDEX_FROM_PTR(mmu_get_phys_addr((uint64_t)obj)));
+    if (!slab_addr)
+        return NULL;
+
+    // Page objs come back as virtual ptrs, the cache lists hold the slab in the same form as its objs
+    slab = (kalloc_slab_t *)(mmu_get_phys_addr(slab_addr) | ((uint64_t)obj & MMU_UPPER_ADDRESS));
+    KALLOC_SLAB_VERIFY(slab);
+
+    if (slab->cache != cache || !PTR_IN_RANGE(obj, slab->mem_ptr, slab->obj_size * slab->max_num)) {
+        DEBUG_THROW("Obj page is not linked to a slab of this cache");
+        return NULL;
+    }
+
+    return slab;
+}
+
 static int check_slab_and_update_list(kalloc_cache_t * cache, kalloc_slab_t * slab)
 {
     ll_head_t * to_list, * curr_list;
     
     KALLOC_SLAB_VERIFY(slab);
-    ASSERT(cache && slab);
+    CHECK_CHEAP(cache && slab, "Cache or slab is NULL");
 
     curr_list = get_curr_slab_list(cache, slab);
     if (!curr_list) {
@@ -119,6 +145,7 @@ static int check_slab_and_update_list(kalloc_cache_t * cache, kalloc_slab_t * sl
         to_list = &cache->full_list;
     } else if (!slab->num && curr_list != &cache->free_list) {
         to_list = &cache->free_list;
+        slab->free_reap_num = cache->reap_num;
     } else if (curr_list != &cache->partial_list) {
         to_list = &cache->partial_list;
     } else  {
@@ -133,9 +160,24 @@ static int check_slab_and_update_list(kalloc_cache_t * cache, kalloc_slab_t * sl
     return 0;
 }
 
+static void slab_run_obj_fn(kalloc_slab_t * slab, void (*fn)(void *))
+{
+    for (unsigned int i = 0; i < slab->max_num; i++) {
+        fn((void *)((uint64_t)((char *)slab->mem_ptr + i * slab->obj_size) | MMU_UPPER_ADDRESS));
+    }
+}
+
+void kalloc_cache_set_ctor(kalloc_cache_t * cache, void (*ctor)(void *), void (*dtor)(void *))
+{
+    ASSERT_PANIC(!cache->page_num, "Cache ctor set after slabs were added");
+
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+}
+
 int kalloc_cache_add_slab(kalloc_cache_t * cache, kalloc_slab_t * slab)
 {
-    ASSERT_PANIC(slab->num == 0, "Slab is being added that is not free");
+    CHECK_CHEAP(slab->num == 0, "Slab is being added that is not free");
 
     unsigned int page_index;
 
@@ -148,13 +190,21 @@ int kalloc_cache_add_slab(kalloc_cache_t * cache, kalloc_slab_t * slab)
     
     cache->max_num += slab->max_num;
     cache->page_num += slab->mem_page_num;
+    slab->cache = cache;
+    slab->free_reap_num = cache->reap_num;
+
+    // Objs are constructed once here instead of on every alloc
+    if (cache->ctor)
+        slab_run_obj_fn(slab, cache->ctor);
 
     if (cache->flags & KALLOC_CACHE_NO_LINK_F)
         return ret;
 
-    page_index = PAGE_INDEX_FROM_PTR(slab->mem_ptr);
+    // Every page of the slab points back at it so a free finds its slab without a search. The pages start
+    // at the inline slab struct, the objs can start on a later page past the free indexs and the color.
+    page_index = PAGE_INDEX_FROM_PTR(slab);
     for (unsigned int i = 0; i < slab->mem_page_num; i++) {
-        mm_link_page_obj_ptr(page_index + i, (void*)cache);
+        mm_link_page_obj_ptr(page_index + i, (void*)slab);
     }
 
     return ret;
@@ -163,8 +213,15 @@ int kalloc_cache_add_slab(kalloc_cache_t * cache, kalloc_slab_t * slab)
 kalloc_slab_t * kalloc_cache_add_slab_pages(kalloc_cache_t * cache, void * page_ptr, unsigned int page_num)
 {   
     kalloc_slab_t * slab;
+    size_t color = 0;
+
+    // Colors are worked out for slab_init_page_num, other slab sizes start at no offset
+    if (page_num == cache->slab_init_page_num && cache->color_num) {
+        color = cache->color_next * KALLOC_CACHE_LINE_SIZE;
+        cache->color_next = (cache->color_next + 1) % cache->color_num;
+    }
 
-    slab = kalloc_slab_init(NULL, page_ptr, page_num, cache->obj_size, 0);
+    slab = kalloc_slab_init_color(page_ptr, page_num, cache->obj_size, color, 0);
     if (!slab) {
         DEBUG_THROW("Slab returned is NULL");
         return slab;
@@ -179,7 +236,7 @@ kalloc_slab_t * kalloc_cache_add_slab_pages(kalloc_cache_t * cache, void * page_
     return slab;
 }
 
-int kalloc_cache_remove_slab(kalloc_cache_t * cache, kalloc_slab_t * slab)
+static int unlink_slab(kalloc_cache_t * cache, kalloc_slab_t * slab)
 {
     unsigned int page_index;
     ll_head_t * curr_list;
@@ -198,47 +255,213 @@ int kalloc_cache_remove_slab(kalloc_cache_t * cache, kalloc_slab_t * slab)
         return 1;
     }
 
-    ASSERT_PANIC(cache->max_num >= slab->max_num, "Cache max num less than the total found in slab, out of sync?");
+    CHECK_CHEAP(cache->max_num >= slab->max_num, "Cache max num less than the total found in slab, out of sync?");
+
+    if (add_remove_cache_list(NULL, curr_list, slab)) {
+        DEBUG_THROW("Removing slab from free list failed");
+        return 1;
+    }
 
     cache->max_num -= slab->max_num;
     cache->page_num -= slab->mem_page_num;
+    slab->cache = NULL;
+
+    if (cache->dtor)
+        slab_run_obj_fn(slab, cache->dtor);
 
     if (cache->flags & KALLOC_CACHE_NO_LINK_F)
         return ret;
 
-    page_index = (uint64_t)slab->mem_ptr / PAGE_SIZE;
+    page_index = PAGE_INDEX_FROM_PTR(slab);
     for (unsigned int i = 0; i < slab->mem_page_num; i++) {
         mm_link_page_obj_ptr(page_index + i, NULL);
     }
 
-    // TODO do we free the slab here as well?
+    return ret;
+}
+
+int kalloc_cache_remove_slab(kalloc_cache_t * cache, kalloc_slab_t * slab)
+{
+    int ret;
+
+    ret = unlink_slab(cache, slab);
+    if (ret || !cache->page_destructor)
+        return ret;
+
+    // The slab struct is inlined at the start of its pages
+    ret = cache->page_destructor((void *)slab, slab->mem_page_num, cache->flags);
+    if (ret) {
+        DEBUG_THROW("Cache page destructor failed.");
+    }
 
     return ret;
 }
 
-void * kalloc_cache_alloc(kalloc_cache_t * cache)
+kalloc_slab_t * kalloc_cache_pop_free_slab(kalloc_cache_t * cache)
 {
     kalloc_slab_t * slab;
-    void * obj;
-    
-    ASSERT_PANIC(cache, "Cache is NULL");
-    
-    if (cache->num == cache->max_num) {
-        /*
-        if (cache->flags & KALLOC_CACHE_NO_EXPAND_F || !cache->page_allocator) {
-            DEBUG_THROW("Cache is full and no expand set");
-            goto cache_alloc_fail;
+    sll_node_t * slab_node;
+
+    slab_node = (sll_node_t *)ll_peek_first(&cache->free_list);
+    if (!slab_node)
+        return NULL;
+
+    slab = STRUCT_P(slab_node, kalloc_slab_t, node);
+    if (unlink_slab(cache, slab)) {
+        DEBUG_THROW("Could not remove free slab from cache");
+        return NULL;
+    }
+
+    return slab;
+}
+
+unsigned int kalloc_cache_grow(kalloc_cache_t * cache, unsigned int slab_num)
+{
+    void * page_ptr;
+    unsigned int num;
+
+    if (cache->flags & KALLOC_CACHE_NO_EXPAND_F || !cache->page_allocator)
+        return 0;
+
+    for (num = 0; num < slab_num; num++) {
+        page_ptr = cache->page_allocator(cache->slab_init_page_num, cache->flags);
+        if (!page_ptr) {
+            cache->grow_failed = 1;
+            break;
         }
 
-        ret = cache->page_allocator(cache->slab_init_page_num, cache->flags);
+        if (!kalloc_cache_add_slab_pages(cache, page_ptr, cache->slab_init_page_num)) {
+            DEBUG_THROW("Cache grow add slab failed.");
+            if (cache->page_destructor)
+                cache->page_destructor(page_ptr, cache->slab_init_page_num, cache->flags);
+            break;
+        }
+
+        cache->grow_failed = 0;
+    }
+
+    return num;
+}
+
+unsigned int kalloc_cache_reap(kalloc_cache_t * cache)
+{
+    kalloc_slab_t * slab;
+    sll_node_t * slab_node;
+    unsigned int page_num = 0;
+    int ret;
+
+    cache->reap_num++;
+
+    if (cache->flags & KALLOC_CACHE_NO_SHRINK_F || !cache->page_destructor)
+        return 0;
+
+    // Slabs are appended as they become empty, so the ones that have been empty the longest are first
+    while ((slab_node = (sll_node_t *)ll_peek_first(&cache->free_list))) {
+        slab = STRUCT_P(slab_node, kalloc_slab_t, node);
+        if (cache->reap_num - slab->free_reap_num < cache->reap_delay)
+            break;
+
+        page_num += slab->mem_page_num;
+        ret = kalloc_cache_remove_slab(cache, slab);
+        ASSERT_PANIC(!ret, "Cache reap remove slab failed.");
+    }
+
+    return page_num;
+}
+
+unsigned int kalloc_cache_free_page_num(kalloc_cache_t * cache)
+{
+    ll_node_t * p;
+    kalloc_slab_t * slab;
+    unsigned int page_num = 0;
+
+    LL_ITER_LIST(&cache->free_list, p) {
+        slab = STRUCT_P(p, kalloc_slab_t, node);
+        page_num += slab->mem_page_num;
+    }
+
+    return page_num;
+}
+
+unsigned int kalloc_cache_shrink(kalloc_cache_t * cache, unsigned int page_num)
+{
+    kalloc_slab_t * slab;
+    unsigned int slab_page_num;
+    unsigned int freed_num = 0;
+    int ret;
+
+    if (cache->flags & KALLOC_CACHE_NO_SHRINK_F || !cache->page_destructor)
+        return 0;
 
-        if (ret || cache->num == cache->max_num) {
-            DEBUG_THROW("Allocator could not expand cache.");
-            goto cache_alloc_fail;
+    while (freed_num < page_num && (slab = kalloc_cache_pop_free_slab(cache))) {
+        // The slab struct lives in the slab pages, read it before they are gone
+        slab_page_num = slab->mem_page_num;
+
+        ret = cache->page_destructor((void *)slab, slab_page_num, cache->flags);
+        ASSERT_PANIC(!ret, "Cache page destructor failed.");
+
+        freed_num += slab_page_num;
+    }
+
+    return freed_num;
+}
+
+unsigned int kalloc_cache_move_slabs(kalloc_cache_t * cache, void *(*move_pages)(void *, unsigned int))
+{
+    kalloc_slab_t * slab;
+    kalloc_slab_t * new_slab;
+    ll_node_t * p;
+    ll_node_t * next;
+    ll_node_t * last;
+    void * page_ptr;
+    unsigned int page_num;
+    unsigned int moved_num = 0;
+    int ret;
+
+    if (cache->flags & (KALLOC_CACHE_NO_EXPAND_F | KALLOC_CACHE_NO_SHRINK_F) || !cache->page_destructor)
+        return 0;
+
+    // Moved slabs are appended to the free list, stop at the last slab that was on it to begin with
+    last = ll_peek_last(&cache->free_list);
+    for (p = ll_peek_first(&cache->free_list); p; p = next) {
+        next = p == last ? NULL : p->list.next;
+        slab = STRUCT_P(p, kalloc_slab_t, node);
+        page_num = slab->mem_page_num;
+
+        page_ptr = move_pages((void *)slab, page_num);
+        if (!page_ptr)
+            continue;
+
+        // Adding the slab links the new pages to it, removing the old one unlinks and frees the old pages
+        new_slab = kalloc_cache_add_slab_pages(cache, page_ptr, page_num);
+        if (!new_slab) {
+            DEBUG_THROW("Cache move add slab failed.");
+            cache->page_destructor(page_ptr, page_num, cache->flags);
+            break;
         }
-        */
-       DEBUG_THROW("Kalloc cache is full, can't alloc.");
-       return NULL;
+
+        // The slab has been empty for as long as the one it replaces
+        new_slab->free_reap_num = slab->free_reap_num;
+
+        ret = kalloc_cache_remove_slab(cache, slab);
+        ASSERT_PANIC(!ret, "Cache move remove slab failed.");
+
+        moved_num += page_num;
+    }
+
+    return moved_num;
+}
+
+void * kalloc_cache_alloc(kalloc_cache_t * cache)
+{
+    kalloc_slab_t * slab;
+    void * obj;
+    
+    CHECK_CHEAP(cache, "Cache is NULL");
+    
+    if (cache->num == cache->max_num && !kalloc_cache_grow(cache, cache->expand_slab_num)) {
+        DEBUG_THROW("Kalloc cache is full, can't alloc.");
+        return NULL;
     }
 
     slab = get_free_slab(cache);
@@ -260,6 +483,12 @@ void * kalloc_cache_alloc(kalloc_cache_t * cache)
     }
 
     cache->num ++;
+
+    // Grow ahead of demand, failing here is fine as the next allocs still have objects left. Once the page
+    // allocator has failed, every grow would go through its slow path, so wait for a free or a grow to succeed
+    if (!cache->grow_failed && cache->num * 100 >= cache->max_num * cache->expand_threshold)
+        kalloc_cache_grow(cache, cache->expand_slab_num);
+
     return obj;
 
 cache_alloc_fail:
@@ -270,7 +499,7 @@ int kalloc_cache_free(kalloc_cache_t * cache, void * obj)
 {
     kalloc_slab_t * slab;
     int ret = 0;
-    ASSERT(cache && obj);
+    CHECK_CHEAP(cache && obj, "Cache or obj is NULL");
 
     if (cache->num == 0) {
         DEBUG_THROW("Kalloc cache is empty, can't free.");
@@ -297,6 +526,7 @@ cache_free_obj:
     }
 
     cache->num --;
+    cache->grow_failed = 0;
 cache_free_exit:
     return ret;
 }
@@ -311,9 +541,18 @@ int kalloc_cache_init(kalloc_cache_t * cache, size_t obj_size,
     
     memset(cache, 0, sizeof(kalloc_cache_t));
 
+    if (flags & KALLOC_CACHE_HWCACHE_ALIGN_F)
+        obj_size = ALIGN_UP(obj_size, KALLOC_CACHE_LINE_SIZE);
+
+    if (!(flags & KALLOC_CACHE_NO_COLOR_F) && slab_init_page_num)
+        cache->color_num = kalloc_slab_inline_free_size(obj_size, slab_init_page_num) / KALLOC_CACHE_LINE_SIZE + 1;
+
     cache->obj_size = obj_size;
     cache->slab_init_page_num = slab_init_page_num;
     cache->flags = flags;
+    cache->expand_threshold = KALLOC_CACHE_EXPAND_THRESHOLD;
+    cache->expand_slab_num = 1;
+    cache->reap_delay = KALLOC_CACHE_REAP_DELAY;
 
     lock_init(&cache->lock);
     ll_head_init(&cache->free_list, SLL_NODE_T);
@@ -0,0 +1,187 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/assert.h>
+#include <common/lock.h>
+#include <common/atomic.h>
+#include <common/string.h>
+#include <kernel/mm.h>
+#include <kernel/mmu.h>
+#include <kernel/kalloc.h>
+#include <kernel/kalloc_pcp.h>
+#include <kernel/kalloc_zero.h>
+#include <kernel/kalloc_compact.h>
+#include <kernel/sched.h>
+#include <kernel/printf.h>
+
+static kalloc_compact_stats_t compact_stats;
+/* Only one pass runs at a time, anyone else finding a pass running just skips theirs. */
+DEFINE_SPINLOCK(compact_lock);
+/* One bit per memorder an alloc failed for since the last pass. */
+ATOMIC_UINT64(compact_request);
+static event_id_t compact_event;
+/* Memorder of the pass running, only written with the compact lock held. */
+static unsigned int compact_memorder;
+
+void kalloc_compact_init()
+{
+    memset(&compact_stats, 0, sizeof(kalloc_compact_stats_t));
+    spinlock_init(&compact_lock);
+}
+
+kalloc_compact_stats_t * kalloc_compact_stats()
+{
+    return &compact_stats;
+}
+
+/* Areas that have the free pages for a block of memorder but can not hand one out, what is still allocated from them
+ * keeps their buddies from coalescing. Read without the area lock, it only picks what to move. */
+static int area_is_fragmented(mm_area_t * area, unsigned int memorder)
+{
+    if (area->free_page_num < (unsigned int)MM_MEMORDER_TO_PAGES(memorder))
+        return 0;
+
+    for (unsigned int order = memorder; order < MM_MAX_ORDER + 1; order++) {
+        if (area->free_buddy_num[order])
+            return 0;
+    }
+
+    return 1;
+}
+
+/* The reclaimable area with the fewest free pages, and fewer than src_area, that has a free block of memorder below
+ * compact_memorder. Filling the denser areas first is what frees up the sparse ones. */
+static mm_area_t * find_dest_area(mm_area_t * src_area, unsigned int memorder)
+{
+    mm_global_area_t * global_area = mm_global_area();
+    mm_area_t * dest_area = NULL;
+    mm_area_t * area;
+
+    for (unsigned int i = 0; i < global_area->area_count; i++) {
+        area = &global_area->global_areas[i];
+
+        if (area == src_area || !mm_area_is_initialized(area) || area->type != MM_TYPE_RECLAIMABLE)
+            continue;
+
+        if (area->free_page_num >= (dest_area ? dest_area->free_page_num : src_area->free_page_num))
+            continue;
+
+        for (unsigned int order = memorder; order < compact_memorder; order++) {
+            if (area->free_buddy_num[order]) {
+                dest_area = area;
+                break;
+            }
+        }
+    }
+
+    return dest_area;
+}
+
+/* Move callback for the empty slabs of the kalloc caches, returns new pages for the slabs in fragmented areas. */
+static void * compact_move_pages(void * page_ptr, unsigned int page_num)
+{
+    mm_area_t * src_area = mm_area_from_addr(mmu_get_phys_addr((uint64_t)page_ptr));
+    mm_area_t * dest_area;
+    unsigned int memorder = mm_pages_to_memorder(page_num);
+
+    if (memorder >= compact_memorder || !area_is_fragmented(src_area, compact_memorder))
+        return NULL;
+
+    dest_area = find_dest_area(src_area, memorder);
+    if (!dest_area)
+        return NULL;
+
+    // Slab pages are reclaimable like the ones the caches allocate themselves, so their destructor frees these too
+    return (void *)kalloc_page_alloc_area_pages(dest_area, memorder, compact_memorder, KALLOC_RECLAIMABLE_F);
+}
+
+unsigned int kalloc_compact(unsigned int memorder)
+{
+    uint64_t start_block_num;
+    uint64_t block_num;
+    unsigned int gain_num = 0;
+
+    ASSERT_PANIC(memorder <= MM_MAX_ORDER, "Compact memorder out of range.");
+
+    if (lock_trylock(&compact_lock))
+        return 0;
+
+    start_block_num = mm_free_block_num(memorder);
+
+    // Free pages cached in the pcp lists and the zero pool keep their buddies from coalescing
+    kalloc_pcp_drain_all();
+    kalloc_zero_drain();
+
+    // Empty slabs the caches keep around are moved out of the areas they fragment rather than freed,
+    // giving them back is left to the reclaim task
+    compact_memorder = memorder;
+    compact_stats.slab_page_num += kalloc_move_slabs(compact_move_pages);
+
+    block_num = mm_free_block_num(memorder);
+    if (block_num > start_block_num)
+        gain_num = block_num - start_block_num;
+
+    compact_stats.run_num++;
+    compact_stats.block_gain_num += gain_num;
+
+    unlock_spinlock(&compact_lock);
+
+    return gain_num;
+}
+
+void kalloc_compact_request(unsigned int memorder)
+{
+    uint64_t bit = (uint64_t)1 << memorder;
+
+    // Failed allocs keep asking until the pass is done, only wake the task when the memorder is new
+    if (atomic_ld_64(&compact_request) & bit)
+        return;
+
+    atomic_fetch_or_64(&compact_request, bit);
+    atomic_fetch_add_64(&compact_stats.request_num, 1);
+
+    // Allocs can fail before the scheduler has started the task, it picks the request up on its first pass
+    if (compact_event)
+        event_signal(compact_event);
+}
+
+void kalloc_compact_task()
+{
+    uint64_t request;
+    unsigned int memorder;
+
+    compact_event = event_init();
+
+    while (1) {
+        event_waiton(compact_event, KALLOC_COMPACT_PERIOD_US);
+
+        // Only clear the bits we saw, requests made after the load stay for the next pass
+        request = atomic_ld_64(&compact_request);
+        if (request)
+            atomic_fetch_and_64(&compact_request, ~request);
+
+        if (request) {
+            // The largest memorder that failed, its blocks make the lower ones as well
+            memorder = MM_MAX_ORDER;
+            while (!(request & ((uint64_t)1 << memorder)))
+                memorder--;
+        } else if (mm_frag_index(KALLOC_COMPACT_ORDER) >= KALLOC_COMPACT_FRAG_THRESHOLD) {
+            memorder = KALLOC_COMPACT_ORDER;
+        } else {
+            continue;
+        }
+
+        kalloc_compact(memorder);
+    }
+}
+
+void kalloc_compact_dump()
+{
+    lock_printlock();
+    printf("Kalloc compact stats\n");
+    printfdigit("runs=", compact_stats.run_num);
+    printfdigit("requests=", compact_stats.request_num);
+    printfdigit("slab pages moved=", compact_stats.slab_page_num);
+    printfdigit("blocks gained=", compact_stats.block_gain_num);
+    unlock_printlock();
+}
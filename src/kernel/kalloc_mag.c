@@ -0,0 +1,302 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/assert.h>
+#include <common/string.h>
+#include <common/lock.h>
+#include <common/atomic.h>
+#include <kernel/cpu.h>
+#include <kernel/mmu.h>
+#include <kernel/irq.h>
+#include <kernel/kalloc_cache.h>
+#include <kernel/kalloc_mag.h>
+
+static kalloc_mag_t * mag_pop(kalloc_mag_t ** list)
+{
+    kalloc_mag_t * mag = *list;
+
+    if (mag) {
+        *list = mag->next;
+        mag->next = NULL;
+    }
+
+    return mag;
+}
+
+static void mag_push(kalloc_mag_t ** list, kalloc_mag_t * mag)
+{
+    mag->next = *list;
+    *list = mag;
+}
+
+static void swap_mags(kalloc_mag_cpu_t * cpu)
+{
+    kalloc_mag_t * mag = cpu->loaded;
+
+    cpu->loaded = cpu->previous;
+    cpu->previous = mag;
+}
+
+/* The cpu is looked up after irqs are off so we can not migrate. */
+static kalloc_mag_cpu_t * lock_curr_cpu(kalloc_mag_cache_t * mag_cache, uint64_t * irq_flags)
+{
+    kalloc_mag_cpu_t * cpu;
+
+    irq_save_disable(irq_flags);
+    cpu = &mag_cache->cpus[cpu_get_id()];
+    lock_spinlock(&cpu->lock);
+
+    return cpu;
+}
+
+static void unlock_cpu(kalloc_mag_cpu_t * cpu, uint64_t irq_flags)
+{
+    unlock_spinlock_irqrestore(&cpu->lock, irq_flags);
+}
+
+/* Trade the empty previous magazine for a full one from the depot. Returns 0 on success. */
+static int depot_exchange_full(kalloc_mag_cache_t * mag_cache, kalloc_mag_cpu_t * cpu)
+{
+    kalloc_mag_t * mag;
+
+    lock_spinlock(&mag_cache->cache->lock);
+
+    mag = mag_pop(&mag_cache->full_list);
+    if (mag) {
+        mag_cache->full_num--;
+        mag_push(&mag_cache->empty_list, cpu->previous);
+        mag_cache->empty_num++;
+        mag_cache->exchange_num++;
+
+        cpu->previous = cpu->loaded;
+        cpu->loaded = mag;
+    }
+
+    unlock_spinlock(&mag_cache->cache->lock);
+
+    return !mag;
+}
+
+/* Trade the full previous magazine for an empty one from the depot. Returns 0 on success. */
+static int depot_exchange_empty(kalloc_mag_cache_t * mag_cache, kalloc_mag_cpu_t * cpu)
+{
+    kalloc_mag_t * mag;
+
+    lock_spinlock(&mag_cache->cache->lock);
+
+    mag = mag_pop(&mag_cache->empty_list);
+    if (mag) {
+        mag_cache->empty_num--;
+        mag_push(&mag_cache->full_list, cpu->previous);
+        mag_cache->full_num++;
+        mag_cache->exchange_num++;
+
+        cpu->previous = cpu->loaded;
+        cpu->loaded = mag;
+    }
+
+    unlock_spinlock(&mag_cache->cache->lock);
+
+    return !mag;
+}
+
+/* The remote free lists link objs through their first word, written through the upper mapping. */
+static uint64_t * remote_next(uint64_t obj)
+{
+    return (uint64_t *)(obj | MMU_UPPER_ADDRESS);
+}
+
+/* Hand out the next obj of the remote batch of the cpu, taking its whole remote free list as the next batch once
+ * the last one is used up. MUST HOLD THE CPU LOCK. */
+static void * remote_batch_pop(kalloc_mag_cache_t * mag_cache, kalloc_mag_cpu_t * cpu)
+{
+    kalloc_mag_remote_t * remote = &mag_cache->remotes[cpu - mag_cache->cpus];
+    uint64_t obj;
+
+    if (!cpu->remote_batch) {
+        // Only a load while the list is empty, so the line stays shared until another cpu pushes
+        if (!atomic_ld_64(&remote->list))
+            return NULL;
+
+        cpu->remote_batch = atomic_xchg_64(&remote->list, 0);
+        cpu->remote_reclaim_num++;
+    }
+
+    obj = cpu->remote_batch;
+    cpu->remote_batch = *remote_next(obj);
+    cpu->remote_taken_num++;
+
+    // One atomic per batch, the pushes see the list as fuller than it is until then
+    if (!cpu->remote_batch) {
+        atomic_fetch_sub_64(&remote->num, cpu->remote_taken_num);
+        cpu->remote_taken_num = 0;
+    }
+
+    return (void *)obj;
+}
+
+void * kalloc_mag_alloc(kalloc_mag_cache_t * mag_cache)
+{
+    kalloc_mag_cpu_t * cpu;
+    uint64_t irq_flags;
+    void * obj = NULL;
+
+    cpu = lock_curr_cpu(mag_cache, &irq_flags);
+
+    // Objs the other cpus freed back to us go first, so the remote free list never sits at its cap
+    obj = remote_batch_pop(mag_cache, cpu);
+    if (obj) {
+        cpu->alloc_num++;
+        goto kalloc_mag_alloc_exit;
+    }
+
+    if (!cpu->loaded->round_num) {
+        if (cpu->previous->round_num) {
+            swap_mags(cpu);
+        } else if (depot_exchange_full(mag_cache, cpu)) {
+            cpu->alloc_miss_num++;
+            goto kalloc_mag_alloc_exit;
+        }
+    }
+
+    cpu->loaded->round_num--;
+    obj = cpu->loaded->rounds[cpu->loaded->round_num];
+    cpu->alloc_num++;
+
+kalloc_mag_alloc_exit:
+    unlock_cpu(cpu, irq_flags);
+
+    return obj;
+}
+
+int kalloc_mag_free(kalloc_mag_cache_t * mag_cache, void * obj)
+{
+    kalloc_mag_cpu_t * cpu;
+    uint64_t irq_flags;
+    int ret = 0;
+
+    cpu = lock_curr_cpu(mag_cache, &irq_flags);
+
+    if (cpu->loaded->round_num == KALLOC_MAG_SIZE) {
+        if (cpu->previous->round_num != KALLOC_MAG_SIZE) {
+            swap_mags(cpu);
+        } else if (depot_exchange_empty(mag_cache, cpu)) {
+            cpu->free_miss_num++;
+            ret = 1;
+            goto kalloc_mag_free_exit;
+        }
+    }
+
+    cpu->loaded->rounds[cpu->loaded->round_num] = obj;
+    cpu->loaded->round_num++;
+    cpu->free_num++;
+
+kalloc_mag_free_exit:
+    unlock_cpu(cpu, irq_flags);
+
+    return ret;
+}
+
+int kalloc_mag_remote_free(kalloc_mag_cache_t * mag_cache, void * obj, unsigned int owner_cpu)
+{
+    kalloc_mag_remote_t * remote;
+    uint64_t irq_flags;
+    uint64_t head;
+
+    CHECK_CHEAP(owner_cpu < CORE_NUM, "Mag remote free owner cpu out of range.");
+
+    // Read with irqs on, being moved after the check only sends the obj down the other free path
+    if (owner_cpu == cpu_get_id())
+        return 1;
+
+    remote = &mag_cache->remotes[owner_cpu];
+    if (atomic_fetch_add_64(&remote->num, 1) > KALLOC_MAG_REMOTE_MAX) {
+        atomic_fetch_sub_64(&remote->num, 1);
+        return 1;
+    }
+
+    do {
+        head = atomic_ld_64(&remote->list);
+        *remote_next((uint64_t)obj) = head;
+    } while (atomic_cmpxchg_64(&remote->list, head, (uint64_t)obj));
+
+    // Only the stats need the cpu, the push itself is safe from anywhere
+    irq_save_disable(&irq_flags);
+    mag_cache->cpus[cpu_get_id()].remote_free_num++;
+    irq_restore(irq_flags);
+
+    return 0;
+}
+
+static unsigned int take_rounds(kalloc_mag_t * mag, void ** objs, unsigned int max_num)
+{
+    unsigned int num = 0;
+
+    while (num < max_num && mag->round_num) {
+        mag->round_num--;
+        objs[num++] = mag->rounds[mag->round_num];
+    }
+
+    return num;
+}
+
+unsigned int kalloc_mag_drain(kalloc_mag_cache_t * mag_cache, void ** objs, unsigned int max_num)
+{
+    kalloc_mag_cpu_t * cpu;
+    kalloc_mag_t * mag;
+    uint64_t irq_flags;
+    void * obj;
+    unsigned int num = 0;
+
+    for (unsigned int i = 0; i < CORE_NUM && num < max_num; i++) {
+        cpu = &mag_cache->cpus[i];
+
+        lock_spinlock_irqsave(&cpu->lock, &irq_flags);
+        while (num < max_num && (obj = remote_batch_pop(mag_cache, cpu)))
+            objs[num++] = obj;
+        num += take_rounds(cpu->loaded, &objs[num], max_num - num);
+        num += take_rounds(cpu->previous, &objs[num], max_num - num);
+        unlock_spinlock_irqrestore(&cpu->lock, irq_flags);
+    }
+
+    lock_spinlock_irqsave(&mag_cache->cache->lock, &irq_flags);
+
+    while (num < max_num && (mag = mag_pop(&mag_cache->full_list))) {
+        mag_cache->full_num--;
+        num += take_rounds(mag, &objs[num], max_num - num);
+
+        // Whatever we could not take stays in the depot for the next call
+        if (mag->round_num) {
+            mag_push(&mag_cache->full_list, mag);
+            mag_cache->full_num++;
+        } else {
+            mag_push(&mag_cache->empty_list, mag);
+            mag_cache->empty_num++;
+        }
+    }
+
+    unlock_spinlock_irqrestore(&mag_cache->cache->lock, irq_flags);
+
+    return num;
+}
+
+void kalloc_mag_cache_init(kalloc_mag_cache_t * mag_cache, kalloc_cache_t * cache)
+{
+    kalloc_mag_cpu_t * cpu;
+    unsigned int i;
+
+    memset(mag_cache, 0, sizeof(kalloc_mag_cache_t));
+    mag_cache->cache = cache;
+
+    for (i = 0; i < CORE_NUM; i++) {
+        cpu = &mag_cache->cpus[i];
+        cpu->loaded = &mag_cache->mags[i * 2];
+        cpu->previous = &mag_cache->mags[i * 2 + 1];
+        spinlock_init(&cpu->lock);
+    }
+
+    for (i = CORE_NUM * 2; i < KALLOC_MAG_NUM; i++) {
+        mag_push(&mag_cache->empty_list, &mag_cache->mags[i]);
+        mag_cache->empty_num++;
+    }
+}
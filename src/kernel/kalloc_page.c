@@ -6,64 +6,73 @@
 #include <kernel/mm.h>
 #include <kernel/kalloc_page.h>
 #include <kernel/kalloc_cache.h>
+#include <kernel/kalloc.h>
+#include <kernel/kalloc_zero.h>
+#include <kernel/kalloc_reclaim.h>
 
 #define LEFT_BUDDY 1
 #define RIGHT_BUDDY 2
 
+/* Index of the buddy's bit in the area free bitmap for the given memorder. */
+static unsigned int buddy_bitmap_index(mm_area_t * area, kalloc_buddy_t * buddy, unsigned int memorder)
+{
+    unsigned int offset = kalloc_get_buddy_page_index(buddy) - area->start_page_index;
+
+    if (!memorder)
+        return offset >> 1;
+
+    // Skip over the memorder 0 bits and the bits of every memorder from 1 up to this one
+    return MM_AREA_BUDDY_NUM + (MM_AREA_PAGE_NUM - (MM_AREA_PAGE_NUM >> (memorder - 1))) + (offset >> memorder);
+}
+
 /* Add a buddy_node to the area->free_list as well as checking if the area should be added to
- * the global_area->free_list. */
+ * the global_area->free_list. MUST HOLD AREA LOCK. */
 static void add_buddy_list(mm_area_t * area, kalloc_buddy_t * buddy)
 {
-    unsigned int memorder = buddy->buddy_memorder;
-    ll_head_t * global_areas_list = &mm_global_area()->free_areas_list[memorder];
-    ll_head_t * buddy_list = &area->free_buddy_list[memorder];
-
-    // If the area list was empty before, we push this area to the global free lists
-    if (!MM_AREA_FREE_BUDDY(area, memorder)) {
-        ll_node_init((ll_node_t *)&area->global_area_nodes[memorder], area, SLL_NODE_T);
-        if (ll_push_list(global_areas_list, (ll_node_t *)&area->global_area_nodes[memorder]))  {
-            DEBUG_PANIC("Could not push global areas list");
-            return;
-        }
-    }
+    unsigned int memorder = kalloc_get_buddy_memorder(buddy);
+    unsigned int bit = buddy_bitmap_index(area, buddy, memorder);
 
-    if (ll_push_list(buddy_list, (ll_node_t *)&buddy->buddy_node))  {
-        DEBUG_PANIC("LL node push list failed");
+    if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && bitmap_get(area->free_buddy_bitmap, bit)) {
+        DEBUG_PANIC("Buddy is already on free list");
         return;
     }
+
+    // If the area list was empty before, we push this area to the global free lists
+    if (!MM_AREA_FREE_BUDDY(area, memorder))
+        mm_add_free_area(area, memorder);
+
+    enqueue_tail(&area->free_buddy_list[memorder], &buddy->buddy_node);
+    bitmap_set(area->free_buddy_bitmap, bit);
+    area->free_buddy_num[memorder]++;
 }
 
 /* Remove from an area's->free_list and check if we need to remove an area from the 
- * global_areas->free_list. */
+ * global_areas->free_list. MUST HOLD AREA LOCK. */
 static void remove_buddy_list(mm_area_t * area, kalloc_buddy_t * buddy)
 {
-    unsigned int memorder = buddy->buddy_memorder;
-    ll_head_t * global_areas_list = &mm_global_area()->free_areas_list[memorder];
-    ll_head_t * buddy_list = &area->free_buddy_list[memorder];
+    unsigned int memorder = kalloc_get_buddy_memorder(buddy);
+    unsigned int bit = buddy_bitmap_index(area, buddy, memorder);
 
-    if (ll_delete_node(buddy_list, (ll_node_t *)&buddy->buddy_node))  {
-        DEBUG_PANIC("Ll node delete fail");
+    if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !bitmap_get(area->free_buddy_bitmap, bit)) {
+        DEBUG_PANIC("Buddy is not on free list");
         return;
     }
 
+    rmqueue(&buddy->buddy_node);
     // Reset the buddy node to indicate this node is not free
-    ll_node_init((ll_node_t *)&buddy->buddy_node, NULL, LIST_NODE_T);
+    queue_zero(&buddy->buddy_node);
+    bitmap_free(area->free_buddy_bitmap, bit);
+    area->free_buddy_num[memorder]--;
 
     // If there are no more free buddys of this memorder in this area, remove it from the global areas free list
-    if (!MM_AREA_FREE_BUDDY(area, memorder))  {
-        if (ll_delete_node(global_areas_list, (ll_node_t *)&area->global_area_nodes[memorder])) {
-            DEBUG_PANIC("LL area list delete fail");
-            return;
-        }
-
-        ll_node_init((ll_node_t *)&area->global_area_nodes[memorder], area, SLL_NODE_T);
-    }
+    if (!MM_AREA_FREE_BUDDY(area, memorder))
+        mm_remove_free_area(area, memorder);
 }
 
 void kalloc_init_buddy(mm_area_t * area, kalloc_buddy_t * buddy, unsigned int memorder, unsigned int add_to_list)
 {
-    memset(&buddy->buddy_node, 0, sizeof(list_node_t));
-    buddy->buddy_memorder = memorder;
+    queue_zero(&buddy->buddy_node);
+    kalloc_set_buddy_memorder(buddy, memorder);
 
     if (add_to_list)
         add_buddy_list(area, buddy);
@@ -79,9 +88,14 @@ kalloc_buddy_t * kalloc_get_buddy_from_page_index(unsigned int page_index)
     return &mm_global_area()->global_buddies[page_index / 2];
 }
 
+unsigned int kalloc_get_buddy_memorder(kalloc_buddy_t * buddy)
+{
+    return mm_global_area()->global_pages[kalloc_get_buddy_page_index(buddy)].buddy_memorder;
+}
+
 void kalloc_set_buddy_memorder(kalloc_buddy_t * buddy, unsigned int memorder)
 {
-    buddy->buddy_memorder = memorder;
+    mm_global_area()->global_pages[kalloc_get_buddy_page_index(buddy)].buddy_memorder = memorder;
 }
 
 kalloc_buddy_t * kalloc_get_buddy_from_addr(uint64_t addr)
@@ -91,9 +105,9 @@ kalloc_buddy_t * kalloc_get_buddy_from_addr(uint64_t addr)
 
 kalloc_buddy_t * kalloc_get_buddy_sibling(kalloc_buddy_t * buddy)
 {
-    ASSERT_PANIC(buddy->buddy_memorder <= MM_MAX_ORDER, "Getting buddy sibling for max order buddy. ");
+    CHECK_CHEAP(kalloc_get_buddy_memorder(buddy) <= MM_MAX_ORDER, "Getting buddy sibling for max order buddy. ");
 
-    unsigned int memorder_pages = MM_MEMORDER_TO_PAGES(buddy->buddy_memorder);
+    unsigned int memorder_pages = MM_MEMORDER_TO_PAGES(kalloc_get_buddy_memorder(buddy));
     unsigned int index = kalloc_get_buddy_page_index(buddy);
     return kalloc_get_buddy_from_page_index(BITS_INVERT(index, memorder_pages));
 }
@@ -103,7 +117,7 @@ static inline uint64_t get_buddy_addr(kalloc_buddy_t * buddy)
     return (kalloc_get_buddy_page_index(buddy)) * PAGE_SIZE;
 }
 
-static inline kalloc_buddy_t * get_buddy_from_node(list_node_t * node)
+static inline kalloc_buddy_t * get_buddy_from_node(queue_chain_t * node)
 {
     return STRUCT_P(node, kalloc_buddy_t, buddy_node);
 }
@@ -125,10 +139,10 @@ static kalloc_buddy_t * get_buddy_child(kalloc_buddy_t * buddy, unsigned int chi
 {
     unsigned int index = kalloc_get_buddy_page_index(buddy);
 
-    ASSERT_PANIC(buddy->buddy_memorder != 0, "Getting child of memorder 0 buddy.");
+    CHECK_CHEAP(kalloc_get_buddy_memorder(buddy) != 0, "Getting child of memorder 0 buddy.");
 
     if (child == RIGHT_BUDDY) {
-        return kalloc_get_buddy_from_page_index(index + MM_MEMORDER_TO_PAGES(buddy->buddy_memorder - 1));
+        return kalloc_get_buddy_from_page_index(index + MM_MEMORDER_TO_PAGES(kalloc_get_buddy_memorder(buddy) - 1));
     }
 
     // The buddy of the left child is the current buddy, that would be later relabeled as the child
@@ -137,41 +151,22 @@ static kalloc_buddy_t * get_buddy_child(kalloc_buddy_t * buddy, unsigned int chi
 
 static unsigned int is_buddy_free(mm_area_t * area, kalloc_buddy_t * buddy)
 {
-    ll_head_t * buddy_list = &area->free_buddy_list[buddy->buddy_memorder];
-
-    if ((buddy_list->last == (ll_node_t *)&buddy->buddy_node && !buddy->buddy_node.next) || 
-         buddy->buddy_node.next)
-        return 1;
-
-    return 0;
-
-    //return mm_pages_are_free(kalloc_get_buddy_page_index(buddy), MM_MEMORDER_TO_PAGES(buddy->buddy_memorder));
+    return bitmap_get(area->free_buddy_bitmap, buddy_bitmap_index(area, buddy, kalloc_get_buddy_memorder(buddy)));
 }
 
-/* Get the highest order free ancestor including the given buddy. */
-static kalloc_buddy_t * get_free_ancestor(mm_area_t * area, kalloc_buddy_t * buddy)
+/* Get the free buddy that holds the page. Only the first page of a buddy has its memorder set, so rather than
+ * walking up from the page's own buddy we check the free bit of every aligned buddy that could hold it. */
+static kalloc_buddy_t * get_free_ancestor(mm_area_t * area, unsigned int page_index)
 {
-    kalloc_buddy_t * parent;
-    unsigned int memorder = buddy->buddy_memorder;
-
-    // This is the topmost buddy
-    if (memorder == MM_MAX_ORDER)
-        return buddy;
+    kalloc_buddy_t * buddy;
 
-    while (memorder != MM_MAX_ORDER) {
-        parent = get_buddy_parent(buddy);
+    for (unsigned int memorder = 0; memorder < MM_MAX_ORDER + 1; memorder++) {
+        buddy = kalloc_get_buddy_from_page_index(ALIGN_DOWN(page_index, (unsigned int)MM_MEMORDER_TO_PAGES(memorder)));
 
-        if (is_buddy_free(area, buddy)) {
+        if (bitmap_get(area->free_buddy_bitmap, buddy_bitmap_index(area, buddy, memorder))) {
+            CHECK_CHEAP(kalloc_get_buddy_memorder(buddy) == memorder, "Free buddy has the wrong memorder.");
             return buddy;
         }
-
-        if (parent == buddy) {
-            DEBUG_PANIC("Buddy is topmost buddy but is not free");
-            return NULL;
-        }
-
-        buddy = parent;
-        memorder = buddy->buddy_memorder;
     }
 
     return NULL;
@@ -180,9 +175,9 @@ static kalloc_buddy_t * get_free_ancestor(mm_area_t * area, kalloc_buddy_t * bud
 static kalloc_buddy_t * next_child_from_addr(mm_area_t * area, kalloc_buddy_t * buddy, uint64_t target_addr)
 {
     uint64_t buddy_addr = get_buddy_addr(buddy);
-    unsigned int pages = MM_MEMORDER_TO_PAGES(buddy->buddy_memorder);
+    unsigned int pages = MM_MEMORDER_TO_PAGES(kalloc_get_buddy_memorder(buddy));
 
-    ASSERT_PANIC(VAL_IN_RANGE(target_addr, buddy_addr, (pages * PAGE_SIZE)), "Buddy addr not in found range");
+    CHECK_CHEAP(VAL_IN_RANGE(target_addr, buddy_addr, (pages * PAGE_SIZE)), "Buddy addr not in found range");
 
     if (VAL_IN_RANGE(target_addr, buddy_addr, (pages * PAGE_SIZE) / 2)) {
         return get_buddy_child(buddy, LEFT_BUDDY);
@@ -193,11 +188,11 @@ static kalloc_buddy_t * next_child_from_addr(mm_area_t * area, kalloc_buddy_t *
 
 static kalloc_buddy_t * split_buddy(mm_area_t * area, kalloc_buddy_t * buddy)
 {
-    unsigned int memorder = buddy->buddy_memorder;
+    unsigned int memorder = kalloc_get_buddy_memorder(buddy);
     kalloc_buddy_t * left = get_buddy_child(buddy, LEFT_BUDDY);
     kalloc_buddy_t * right = get_buddy_child(buddy, RIGHT_BUDDY);
 
-    if (memorder == 0) {
+    if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && memorder == 0) {
         DEBUG_PANIC("Splitting buddy of memorder 0");
         return NULL;
     }
@@ -222,22 +217,22 @@ static kalloc_buddy_t * split_to_target_addr(mm_area_t * area, kalloc_buddy_t *
     kalloc_buddy_t * curr_buddy = start_buddy;
     kalloc_buddy_t * next_buddy;
 
-    ASSERT_PANIC(start_buddy->buddy_memorder >= target_memorder, "Start buddy below target memorder. ");
+    CHECK_CHEAP(kalloc_get_buddy_memorder(start_buddy) >= target_memorder, "Start buddy below target memorder. ");
 
-    if (VAL_IN_RANGE_INCLUSIVE(target_addr, get_buddy_addr(start_buddy), MM_MEMORDER_TO_PAGES(start_buddy->buddy_memorder) * PAGE_SIZE) && 
-        start_buddy->buddy_memorder == target_memorder) {
+    if (VAL_IN_RANGE_INCLUSIVE(target_addr, get_buddy_addr(start_buddy), MM_MEMORDER_TO_PAGES(kalloc_get_buddy_memorder(start_buddy)) * PAGE_SIZE) && 
+        kalloc_get_buddy_memorder(start_buddy) == target_memorder) {
         return start_buddy;
-    } else if (start_buddy->buddy_memorder == target_memorder) {
+    } else if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && kalloc_get_buddy_memorder(start_buddy) == target_memorder) {
         DEBUG_PANIC("Already at target memorder but not at correct buddy address. ");
     }
 
-    for (int i = (int)start_buddy->buddy_memorder; i > (int)target_memorder; i--) {
+    for (int i = (int)kalloc_get_buddy_memorder(start_buddy); i > (int)target_memorder; i--) {
         next_buddy = next_child_from_addr(area, curr_buddy, target_addr);
         split_buddy(area, curr_buddy);
         curr_buddy = next_buddy;
     }
 
-    ASSERT_PANIC(VAL_IN_RANGE_INCLUSIVE(target_addr, get_buddy_addr(curr_buddy), MM_MEMORDER_TO_PAGES(curr_buddy->buddy_memorder) * PAGE_SIZE), "Split to buddy but not to correct buddy. ");
+    CHECK_CHEAP(VAL_IN_RANGE_INCLUSIVE(target_addr, get_buddy_addr(curr_buddy), MM_MEMORDER_TO_PAGES(kalloc_get_buddy_memorder(curr_buddy)) * PAGE_SIZE), "Split to buddy but not to correct buddy. ");
 
     return curr_buddy;
 }
@@ -247,9 +242,9 @@ static kalloc_buddy_t * split_to_target_memorder(mm_area_t * area, kalloc_buddy_
     kalloc_buddy_t * curr_buddy = start_buddy;
     kalloc_buddy_t * next_buddy;
 
-    ASSERT_PANIC(start_buddy->buddy_memorder >= target_memorder, "Start buddy below target memorder.");
+    CHECK_CHEAP(kalloc_get_buddy_memorder(start_buddy) >= target_memorder, "Start buddy below target memorder.");
 
-    for (int i = (int)start_buddy->buddy_memorder; i > (int)target_memorder; i--) {
+    for (int i = (int)kalloc_get_buddy_memorder(start_buddy); i > (int)target_memorder; i--) {
         // Default to splitting from left child
         next_buddy = get_buddy_child(curr_buddy, LEFT_BUDDY);
         split_buddy(area, curr_buddy);
@@ -261,11 +256,11 @@ static kalloc_buddy_t * split_to_target_memorder(mm_area_t * area, kalloc_buddy_
 
 static kalloc_buddy_t * find_free_buddy(mm_area_t * area, unsigned int memorder)
 {
-    list_node_t * buddy_node;
+    queue_chain_t * buddy_node;
     kalloc_buddy_t * buddy;
     unsigned int free_memorder;
 
-    ASSERT_PANIC(area && memorder <= MM_MAX_ORDER, "Area null or memorder outside range");
+    CHECK_CHEAP(area && memorder <= MM_MAX_ORDER, "Area null or memorder outside range");
 
     // Go up the memorder list to find a free memorder
     for (free_memorder = memorder; free_memorder < MM_MAX_ORDER + 1; free_memorder++) {
@@ -274,12 +269,12 @@ static kalloc_buddy_t * find_free_buddy(mm_area_t * area, unsigned int memorder)
             break;
     }
 
-    ASSERT_PANIC(buddy_node, "No free buddy node found");
+    CHECK_CHEAP(buddy_node, "No free buddy node found");
 
     buddy = get_buddy_from_node(buddy_node);
 
     // We already found a free node
-    if (buddy_node && buddy->buddy_memorder == memorder)
+    if (buddy_node && kalloc_get_buddy_memorder(buddy) == memorder)
         return buddy;
 
     return split_to_target_memorder(area, buddy, memorder);
@@ -288,7 +283,7 @@ static kalloc_buddy_t * find_free_buddy(mm_area_t * area, unsigned int memorder)
 static unsigned int get_buddy_free_page(kalloc_buddy_t * buddy)
 {
     unsigned int page_index = kalloc_get_buddy_page_index(buddy);
-    ASSERT_PANIC(buddy->buddy_memorder == 0, "Assign page Buddy is not memorder 0.");
+    CHECK_CHEAP(kalloc_get_buddy_memorder(buddy) == 0, "Assign page Buddy is not memorder 0.");
 
     if (!mm_page_is_valid(page_index))
         return page_index;
@@ -298,10 +293,10 @@ static unsigned int get_buddy_free_page(kalloc_buddy_t * buddy)
 
 static uint64_t assign_buddy_page(mm_area_t * area, kalloc_buddy_t * buddy, unsigned int assign_page_index)
 {
-    ASSERT_PANIC(kalloc_get_buddy_from_page_index(assign_page_index) == buddy, "assigning page index does not map to buddy.");
-    ASSERT_PANIC(buddy->buddy_memorder == 0, "Assign page Buddy is not memorder 0.");
+    CHECK_CHEAP(kalloc_get_buddy_from_page_index(assign_page_index) == buddy, "assigning page index does not map to buddy.");
+    CHECK_CHEAP(kalloc_get_buddy_memorder(buddy) == 0, "Assign page Buddy is not memorder 0.");
 
-    if (mm_page_is_valid(assign_page_index)) {
+    if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && mm_page_is_valid(assign_page_index)) {
         DEBUG_PANIC("Assigning page when page is valid. ");
         return 0;
     }
@@ -318,10 +313,10 @@ static uint64_t assign_buddy_page(mm_area_t * area, kalloc_buddy_t * buddy, unsi
 
 static void free_buddy_page(mm_area_t * area, kalloc_buddy_t * buddy, unsigned int free_page_index)
 {
-    ASSERT_PANIC(kalloc_get_buddy_from_page_index(free_page_index) == buddy, "assigning page index does not map to buddy.");
-    ASSERT_PANIC(buddy->buddy_memorder == 0, "Assign page Buddy is not memorder 0.");
+    CHECK_CHEAP(kalloc_get_buddy_from_page_index(free_page_index) == buddy, "assigning page index does not map to buddy.");
+    CHECK_CHEAP(kalloc_get_buddy_memorder(buddy) == 0, "Assign page Buddy is not memorder 0.");
 
-    if (!mm_page_is_valid(free_page_index)) {
+    if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !mm_page_is_valid(free_page_index)) {
         DEBUG_PANIC("Assinging page when page is valid. ");
         return;
     }
@@ -340,12 +335,10 @@ static void free_buddy_page(mm_area_t * area, kalloc_buddy_t * buddy, unsigned i
 
 static uint64_t assign_buddy(mm_area_t * area, kalloc_buddy_t * buddy)
 {   
-    unsigned int memorder_pages = MM_MEMORDER_TO_PAGES(buddy->buddy_memorder);
+    unsigned int memorder_pages = MM_MEMORDER_TO_PAGES(kalloc_get_buddy_memorder(buddy));
     unsigned int page_index = kalloc_get_buddy_page_index(buddy);
 
-    if (!is_buddy_free(area, buddy)) {
-        DEBUG_PANIC("Non zero memorder assign is not complely free.");
-    }
+    CHECK_CHEAP(is_buddy_free(area, buddy), "Non zero memorder assign is not complely free.");
 
     mm_mark_pages_valid(page_index, memorder_pages);
     remove_buddy_list(area, buddy);
@@ -358,10 +351,10 @@ static void coalesce_buddies(mm_area_t * area, kalloc_buddy_t * buddy)
     kalloc_buddy_t * sibling;
     kalloc_buddy_t * parent;
 
-    for (unsigned int i = buddy->buddy_memorder; i < MM_MAX_ORDER; i++)  {
+    for (unsigned int i = kalloc_get_buddy_memorder(buddy); i < MM_MAX_ORDER; i++)  {
         sibling = kalloc_get_buddy_sibling(buddy);
 
-        if (!buddy->buddy_memorder || sibling->buddy_memorder != buddy->buddy_memorder ||
+        if (!kalloc_get_buddy_memorder(buddy) || kalloc_get_buddy_memorder(sibling) != kalloc_get_buddy_memorder(buddy) ||
             !is_buddy_free(area, buddy) || !is_buddy_free(area, sibling))
             break;
 
@@ -377,58 +370,104 @@ static void coalesce_buddies(mm_area_t * area, kalloc_buddy_t * buddy)
     }
 }
 
-int kalloc_page_free_pages(uint64_t addr, flags_t flags)
+/* Put the block at addr back on the area free lists without coalescing. MUST HOLD AREA LOCK. */
+static kalloc_buddy_t * free_area_pages(mm_area_t * area, uint64_t addr)
 {
-    mm_area_t * area = mm_area_from_addr(addr);
     unsigned int page_index = addr / PAGE_SIZE;
     kalloc_buddy_t * buddy = kalloc_get_buddy_from_page_index(page_index);
-    unsigned int memorder_pages =  MM_MEMORDER_TO_PAGES(buddy->buddy_memorder);
+    unsigned int memorder_pages =  MM_MEMORDER_TO_PAGES(kalloc_get_buddy_memorder(buddy));
 
-    ASSERT_PANIC(area, "Area from addr not found. ");
-    ASSERT_PANIC(mm_is_initialized(), "Mm is not initialized.");
-    ASSERT_PANIC(IS_ALIGNED(addr, memorder_pages * PAGE_SIZE), "mm_free_pages addr is not aligned to memorder");
+    CHECK_CHEAP(IS_ALIGNED(addr, memorder_pages * PAGE_SIZE), "mm_free_pages addr is not aligned to memorder");
 
-    buddy = kalloc_get_buddy_from_page_index(page_index);
+    mm_clear_page_flag(page_index, MM_PAGE_HUGE_F);
 
-    if (buddy->buddy_memorder == 0) {
+    if (kalloc_get_buddy_memorder(buddy) == 0) {
         free_buddy_page(area, buddy, page_index);
     } else {
         mm_mark_pages_free(page_index, memorder_pages);
         add_buddy_list(area, buddy);
     }
 
+    area->free_page_num += memorder_pages;
+
+    // Nothing is allocated from the area anymore, let any type claim it again
+    if (area->free_page_num == MM_AREA_PAGE_NUM)
+        mm_set_area_type(area, MM_TYPE_NONE);
+
+    return buddy;
+}
+
+int kalloc_page_free_pages(uint64_t addr, flags_t flags)
+{
+    mm_area_t * area = mm_area_from_addr(addr);
+    kalloc_buddy_t * buddy;
+
+    CHECK_CHEAP(area, "Area from addr not found. ");
+    ASSERT_PANIC(mm_is_initialized(), "Mm is not initialized.");
+
+    lock_spinlock(&area->lock);
+
+    buddy = free_area_pages(area, addr);
     coalesce_buddies(area, buddy);
 
-    area->free_page_num += memorder_pages;
+    unlock_spinlock(&area->lock);
 
     return 0;
 }
 
-int kalloc_page_reserve_pages(uint64_t addr, unsigned int memorder, flags_t flags)
+int kalloc_page_free_bulk(uint64_t * addrs, unsigned int count, flags_t flags)
 {
-    kalloc_buddy_t * buddy;
-    uint64_t buddy_addr;
-    unsigned int page_index = addr / PAGE_SIZE;
-    mm_area_t * area = mm_area_from_addr(addr);
+    mm_area_t * area;
+    unsigned int start = 0;
+    unsigned int end;
+
+    (void)flags;
 
-    ASSERT_PANIC(area, "Free area not found from addr");
     ASSERT_PANIC(mm_is_initialized(), "Mm is not initialized.");
-    ASSERT_PANIC(IS_ALIGNED(addr, MM_MEMORDER_TO_PAGES(memorder) * PAGE_SIZE), "resrve addr is not aligned");
 
-    if (!mm_pages_are_free(page_index, MM_MEMORDER_TO_PAGES(memorder))) {
-        DEBUG_PANIC("Page is already reserved");
+    while (start < count) {
+        area = mm_area_from_addr(addrs[start]);
+        CHECK_CHEAP(area, "Area from addr not found. ");
+
+        lock_spinlock(&area->lock);
+
+        // Free the whole run of blocks that share this area under one lock
+        for (end = start; end < count && mm_area_from_addr(addrs[end]) == area; end++) {
+            free_area_pages(area, addrs[end]);
+        }
+
+        // Coalesce once every block of the run is back on the free lists. Buddies that were already
+        // merged into a parent are no longer on a free list and are skipped.
+        for (unsigned int i = start; i < end; i++) {
+            coalesce_buddies(area, kalloc_get_buddy_from_addr(addrs[i]));
+        }
+
+        unlock_spinlock(&area->lock);
+
+        start = end;
     }
 
-    buddy = kalloc_get_buddy_from_page_index(page_index);
+    return 0;
+}
+
+/* Take the free block of memorder at addr out of the area. MUST HOLD AREA LOCK. */
+static void reserve_area_pages(mm_area_t * area, uint64_t addr, unsigned int memorder)
+{
+    kalloc_buddy_t * buddy;
+    uint64_t buddy_addr;
+    unsigned int page_index = addr / PAGE_SIZE;
+
+    CHECK_CHEAP(mm_pages_are_free(page_index, MM_MEMORDER_TO_PAGES(memorder)), "Page is already reserved");
+
     // Make sure we get the topmost free ancestor so we can preserve the buddy structure
     // and split it later to the correct buddy we want to reserve
-    buddy = get_free_ancestor(area, buddy);
+    buddy = get_free_ancestor(area, page_index);
 
-    ASSERT_PANIC(buddy, "No free buddy found at given addr");
+    CHECK_CHEAP(buddy, "No free buddy found at given addr");
    
     buddy = split_to_target_addr(area, buddy, addr, memorder);
     
-    ASSERT_PANIC(buddy->buddy_memorder == memorder, "Found memorder is not the memorder we wanted.");
+    CHECK_CHEAP(kalloc_get_buddy_memorder(buddy) == memorder, "Found memorder is not the memorder we wanted.");
 
     if (memorder == 0) {
         buddy_addr = assign_buddy_page(area, buddy, page_index);
@@ -436,36 +475,147 @@ int kalloc_page_reserve_pages(uint64_t addr, unsigned int memorder, flags_t flag
         buddy_addr = assign_buddy(area, buddy);
     }
 
-    ASSERT_PANIC(buddy_addr == addr, "buddy addr does not equal assigned addr");
+    CHECK_CHEAP(buddy_addr == addr, "buddy addr does not equal assigned addr");
 
     area->free_page_num -= MM_MEMORDER_TO_PAGES(memorder);
 
+    // Reserved memory is never moved or reclaimed
+    mm_set_page_type(page_index, MM_TYPE_UNMOVABLE);
+    if (area->type == MM_TYPE_NONE)
+        mm_set_area_type(area, MM_TYPE_UNMOVABLE);
+}
+
+int kalloc_page_reserve_pages(uint64_t addr, unsigned int memorder, flags_t flags)
+{
+    mm_area_t * area = mm_area_from_addr(addr);
+
+    CHECK_CHEAP(area, "Free area not found from addr");
+    ASSERT_PANIC(mm_is_initialized(), "Mm is not initialized.");
+    CHECK_CHEAP(IS_ALIGNED(addr, MM_MEMORDER_TO_PAGES(memorder) * PAGE_SIZE), "resrve addr is not aligned");
+
+    mm_area_wait_initialized(area);
+
+    lock_spinlock(&area->lock);
+
+    reserve_area_pages(area, addr, memorder);
+
+    unlock_spinlock(&area->lock);
+
     return 0;
 }   
 
-/* Returns the page_addr of the first page in the requested memorder range. */
-uint64_t kalloc_page_alloc_pages(unsigned int memorder, flags_t flags)
+/* Free the pages [page_index, end_page_index) that sit in the area, using the same blocks
+ * kalloc_page_reserve_range split them into. Returns the first page index past the area. MUST HOLD AREA LOCK. */
+static unsigned int free_area_range(mm_area_t * area, unsigned int page_index, unsigned int end_page_index)
+{
+    unsigned int memorder;
+    unsigned int area_end_page_index = area->start_page_index + MM_AREA_PAGE_NUM;
+    unsigned int start_page_index = page_index;
+
+    if (end_page_index > area_end_page_index)
+        end_page_index = area_end_page_index;
+
+    while (page_index < end_page_index) {
+        memorder = mm_range_max_memorder(page_index, end_page_index - page_index);
+        CHECK_CHEAP(kalloc_get_buddy_memorder(kalloc_get_buddy_from_page_index(page_index)) == memorder,
+                    "Freed range does not match the reserved range.");
+        free_area_pages(area, page_index * PAGE_SIZE);
+        page_index += MM_MEMORDER_TO_PAGES(memorder);
+    }
+
+    // Coalesce once the whole range is back on the free lists, same as the bulk free
+    page_index = start_page_index;
+    while (page_index < end_page_index) {
+        memorder = mm_range_max_memorder(page_index, end_page_index - page_index);
+        coalesce_buddies(area, kalloc_get_buddy_from_page_index(page_index));
+        page_index += MM_MEMORDER_TO_PAGES(memorder);
+    }
+
+    return end_page_index;
+}
+
+int kalloc_page_free_range(uint64_t start, size_t size)
 {
     mm_area_t * area;
-    unsigned int found_memorder;
-    uint64_t buddy_addr;
-    kalloc_buddy_t * buddy;
+    unsigned int page_index = start / PAGE_SIZE;
+    unsigned int end_page_index = page_index + (size / PAGE_SIZE);
 
     ASSERT_PANIC(mm_is_initialized(), "Mm is not initialized.");
+    CHECK_CHEAP(IS_ALIGNED(start, PAGE_SIZE) && IS_ALIGNED(size, PAGE_SIZE), "Free range is not page aligned");
 
-    area = mm_find_free_area(memorder);
-    if (!area) {
-        DEBUG_PANIC("No free area found, full?");
+    while (page_index < end_page_index) {
+        area = mm_area_from_addr(page_index * PAGE_SIZE);
+        CHECK_CHEAP(area, "Area from addr not found. ");
+
+        lock_spinlock(&area->lock);
+        page_index = free_area_range(area, page_index, end_page_index);
+        unlock_spinlock(&area->lock);
+    }
+
+    return 0;
+}
+
+int kalloc_page_reserve_range(uint64_t start, size_t size)
+{
+    mm_area_t * area;
+    unsigned int memorder;
+    unsigned int area_end_page_index;
+    unsigned int page_index = start / PAGE_SIZE;
+    unsigned int end_page_index = page_index + (size / PAGE_SIZE);
+
+    ASSERT_PANIC(mm_is_initialized(), "Mm is not initialized.");
+    CHECK_CHEAP(IS_ALIGNED(start, PAGE_SIZE) && IS_ALIGNED(size, PAGE_SIZE), "Reserve range is not page aligned");
+
+    while (page_index < end_page_index) {
+        area = mm_area_from_addr(page_index * PAGE_SIZE);
+        if (!area) {
+            DEBUG_THROW("Reserve range is past the end of memory");
+            kalloc_page_free_range(start, (page_index * PAGE_SIZE) - start);
+            return 1;
+        }
+
+        mm_area_wait_initialized(area);
+
+        area_end_page_index = area->start_page_index + MM_AREA_PAGE_NUM;
+        if (area_end_page_index > end_page_index)
+            area_end_page_index = end_page_index;
+
+        lock_spinlock(&area->lock);
+
+        // Check the whole part of the range in this area up front so we never have to undo a split
+        if (!mm_pages_are_free(page_index, area_end_page_index - page_index)) {
+            unlock_spinlock(&area->lock);
+            DEBUG_THROW("Reserve range overlaps reserved pages");
+            kalloc_page_free_range(start, (page_index * PAGE_SIZE) - start);
+            return 1;
+        }
+
+        // Every block is the largest aligned one that fits, so each one costs a single split walk
+        while (page_index < area_end_page_index) {
+            memorder = mm_range_max_memorder(page_index, area_end_page_index - page_index);
+            reserve_area_pages(area, page_index * PAGE_SIZE, memorder);
+            page_index += MM_MEMORDER_TO_PAGES(memorder);
+        }
+
+        unlock_spinlock(&area->lock);
     }
 
+    return 0;
+}
+
+/* Take a free block of memorder from the area. MUST HOLD AREA LOCK. */
+static uint64_t alloc_area_pages(mm_area_t * area, unsigned int memorder, unsigned int type)
+{
+    uint64_t buddy_addr;
+    kalloc_buddy_t * buddy;
+
     buddy = find_free_buddy(area, memorder);
     if (!buddy) {
         DEBUG_PANIC("Cannot find free buddy node");
         return 0;
     }
 
-    found_memorder = buddy->buddy_memorder;
-    ASSERT_PANIC(found_memorder == memorder, "Found memorder is not the memorder we wanted");
+    CHECK_CHEAP(kalloc_get_buddy_memorder(buddy) == memorder, "Found memorder is not the memorder we wanted");
 
     if (memorder == 0) {
         buddy_addr = assign_buddy_page(area, buddy, get_buddy_free_page(buddy));
@@ -474,6 +624,135 @@ uint64_t kalloc_page_alloc_pages(unsigned int memorder, flags_t flags)
     }
 
     area->free_page_num -= MM_MEMORDER_TO_PAGES(memorder);
+    mm_set_page_type(buddy_addr / PAGE_SIZE, type);
+
+    // The reclaim task checks the totals, a single area running low is not memory pressure on its own
+    if (area->free_page_num < area->wmark[MM_WMARK_LOW])
+        kalloc_reclaim_request();
 
     return buddy_addr;
 }
+
+/* Returns the page_addr of the first page in the requested memorder range. */
+uint64_t kalloc_page_alloc_pages(unsigned int memorder, flags_t flags)
+{
+    mm_area_t * area;
+    uint64_t buddy_addr;
+    unsigned int type = KALLOC_FLAGS_TYPE(flags);
+
+    ASSERT_PANIC(mm_is_initialized(), "Mm is not initialized.");
+
+    // The area is returned locked
+    area = mm_find_free_area(memorder, type);
+    if (!area) {
+        DEBUG_THROW("No free area found, full?");
+        return 0;
+    }
+
+    buddy_addr = alloc_area_pages(area, memorder, type);
+
+    unlock_spinlock(&area->lock);
+
+    if (flags & KALLOC_ZERO_F)
+        kalloc_zero_pages(buddy_addr, memorder);
+
+    return buddy_addr;
+}
+
+uint64_t kalloc_page_alloc_area_pages(mm_area_t * area, unsigned int memorder, unsigned int max_memorder, flags_t flags)
+{
+    uint64_t buddy_addr = 0;
+    unsigned int type = KALLOC_FLAGS_TYPE(flags);
+    unsigned int free_memorder;
+
+    CHECK_CHEAP(area && memorder < max_memorder && max_memorder <= MM_MAX_ORDER + 1, "Area alloc memorder out of range.");
+
+    lock_spinlock(&area->lock);
+
+    // The area was picked without its lock, it could have changed type or run out of small blocks since
+    if (area->type != type)
+        goto alloc_area_pages_exit;
+
+    for (free_memorder = memorder; free_memorder < max_memorder; free_memorder++) {
+        if (MM_AREA_FREE_BUDDY(area, free_memorder))
+            break;
+    }
+
+    // The smallest free block is split for the alloc, so this leaves the blocks of max_memorder and up alone
+    if (free_memorder == max_memorder)
+        goto alloc_area_pages_exit;
+
+    buddy_addr = alloc_area_pages(area, memorder, type);
+
+alloc_area_pages_exit:
+    unlock_spinlock(&area->lock);
+
+    if (buddy_addr && (flags & KALLOC_ZERO_F))
+        kalloc_zero_pages(buddy_addr, memorder);
+
+    return buddy_addr;
+}
+
+void kalloc_page_trim_pages(uint64_t addr, unsigned int page_num)
+{
+    mm_area_t * area = mm_area_from_addr(addr);
+    unsigned int page_index = addr / PAGE_SIZE;
+    unsigned int memorder = kalloc_get_buddy_memorder(kalloc_get_buddy_from_page_index(page_index));
+    unsigned int end_page_index = page_index + MM_MEMORDER_TO_PAGES(memorder);
+    unsigned int order;
+    unsigned int i;
+
+    CHECK_CHEAP(area, "Area from addr not found. ");
+    CHECK_CHEAP(page_num && page_num < (unsigned int)MM_MEMORDER_TO_PAGES(memorder), "Trim page num does not fit in the block.");
+
+    lock_spinlock(&area->lock);
+
+    // The pages we keep are labeled as the same largest aligned blocks the range free walks
+    for (i = page_index; i < page_index + page_num; i += MM_MEMORDER_TO_PAGES(order)) {
+        order = mm_range_max_memorder(i, page_index + page_num - i);
+        kalloc_set_buddy_memorder(kalloc_get_buddy_from_page_index(i), order);
+    }
+
+    // Only an odd page_num splits a page pair, its memorder 0 buddy keeps the last page and frees the other
+    for (i = page_index + page_num; i < end_page_index; i += MM_MEMORDER_TO_PAGES(order)) {
+        order = mm_range_max_memorder(i, end_page_index - i);
+        kalloc_set_buddy_memorder(kalloc_get_buddy_from_page_index(i), order);
+        free_area_pages(area, i * PAGE_SIZE);
+    }
+
+    for (i = page_index + page_num; i < end_page_index; i += MM_MEMORDER_TO_PAGES(order)) {
+        order = mm_range_max_memorder(i, end_page_index - i);
+        coalesce_buddies(area, kalloc_get_buddy_from_page_index(i));
+    }
+
+    mm_set_page_range_num(page_index, page_num);
+
+    unlock_spinlock(&area->lock);
+}
+
+/* Returns the number of blocks written to addrs, which is less than count if we ran out of memory. */
+unsigned int kalloc_page_alloc_bulk(unsigned int memorder, unsigned int count, uint64_t * addrs, flags_t flags)
+{
+    mm_area_t * area;
+    unsigned int num = 0;
+    unsigned int type = KALLOC_FLAGS_TYPE(flags);
+
+    ASSERT_PANIC(mm_is_initialized(), "Mm is not initialized.");
+
+    while (num < count) {
+        area = mm_find_free_area(memorder, type);
+        if (!area) {
+            DEBUG_THROW("No free area found, full?");
+            break;
+        }
+
+        // Take as many blocks as we can from this area before moving on to the next one
+        do {
+            addrs[num++] = alloc_area_pages(area, memorder, type);
+        } while (num < count && mm_area_has_free_buddy(area, memorder));
+
+        unlock_spinlock(&area->lock);
+    }
+
+    return num;
+}
@@ -0,0 +1,249 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/assert.h>
+#include <common/string.h>
+#include <common/lock.h>
+#include <kernel/cpu.h>
+#include <kernel/irq.h>
+#include <kernel/mm.h>
+#include <kernel/kalloc.h>
+#include <kernel/kalloc_page.h>
+#include <kernel/kalloc_pcp.h>
+
+/* Each mm type gets its own lists so cached pages go back to the areas of their own type. */
+static kalloc_pcp_t pcps[CORE_NUM][KALLOC_PCP_ORDER_NUM][MM_TYPE_NUM];
+
+static inline unsigned int ring_index(kalloc_pcp_t * pcp, unsigned int i)
+{
+    return (pcp->start + i) % KALLOC_PCP_SIZE;
+}
+
+static void push_hot(kalloc_pcp_t * pcp, uint64_t addr)
+{
+    pcp->pages[ring_index(pcp, pcp->count)] = addr;
+    pcp->count++;
+}
+
+static void push_cold(kalloc_pcp_t * pcp, uint64_t addr)
+{
+    pcp->start = (pcp->start + KALLOC_PCP_SIZE - 1) % KALLOC_PCP_SIZE;
+    pcp->pages[pcp->start] = addr;
+    pcp->count++;
+}
+
+static uint64_t pop_hot(kalloc_pcp_t * pcp)
+{
+    pcp->count--;
+    return pcp->pages[ring_index(pcp, pcp->count)];
+}
+
+static uint64_t pop_cold(kalloc_pcp_t * pcp)
+{
+    uint64_t addr = pcp->pages[pcp->start];
+
+    pcp->start = (pcp->start + 1) % KALLOC_PCP_SIZE;
+    pcp->count--;
+
+    return addr;
+}
+
+/* Pcp lists are only touched by their own core with irqs disabled, the lock is only
+ * there for remote drains. The cpu is looked up after irqs are off so we can not migrate. */
+static kalloc_pcp_t * lock_curr_pcp(unsigned int memorder, unsigned int type, uint64_t * irq_flags)
+{
+    kalloc_pcp_t * pcp;
+
+    irq_save_disable(irq_flags);
+    pcp = &pcps[cpu_get_id()][memorder][type];
+    lock_spinlock(&pcp->lock);
+
+    return pcp;
+}
+
+static void unlock_pcp(kalloc_pcp_t * pcp, uint64_t irq_flags)
+{
+    unlock_spinlock_irqrestore(&pcp->lock, irq_flags);
+}
+
+static void buddy_free_batch(uint64_t * addrs, unsigned int num)
+{
+    int ret;
+
+    if (!num)
+        return;
+
+    ret = kalloc_page_free_bulk(addrs, num, 0);
+    CHECK_CHEAP(!ret, "Pcp drain free pages failed.");
+}
+
+/* Pop up to num pages from the cold end of the list, the caller returns them to the buddy
+ * allocator once the pcp lock is dropped. */
+static unsigned int take_cold_batch(kalloc_pcp_t * pcp, uint64_t * addrs, unsigned int num)
+{
+    unsigned int i;
+
+    for (i = 0; i < num && pcp->count; i++) {
+        addrs[i] = pop_cold(pcp);
+    }
+
+    if (i)
+        pcp->drain_num++;
+
+    return i;
+}
+
+static uint64_t pcp_refill_alloc(unsigned int memorder, flags_t flags)
+{
+    kalloc_pcp_t * pcp;
+    uint64_t irq_flags;
+    uint64_t addr;
+    uint64_t addrs[KALLOC_PCP_BATCH];
+    unsigned int num;
+    unsigned int extra = 0;
+
+    num = kalloc_page_alloc_bulk(memorder, KALLOC_PCP_BATCH, &addrs[0], flags);
+    if (!num)
+        return 0;
+
+    pcp = lock_curr_pcp(memorder, KALLOC_FLAGS_TYPE(flags), &irq_flags);
+
+    /* The first page of the batch is the one we hand out. */
+    addr = addrs[0];
+    for (unsigned int i = 1; i < num; i++) {
+        /* Someone refilled this list while we were in the buddy allocator. */
+        if (pcp->count >= pcp->high) {
+            addrs[extra++] = addrs[i];
+            continue;
+        }
+
+        push_cold(pcp, addrs[i]);
+    }
+
+    pcp->refill_num++;
+    pcp->alloc_num++;
+    unlock_pcp(pcp, irq_flags);
+
+    buddy_free_batch(&addrs[0], extra);
+
+    return addr;
+}
+
+uint64_t kalloc_pcp_alloc(unsigned int memorder, flags_t flags)
+{
+    kalloc_pcp_t * pcp;
+    uint64_t irq_flags;
+    uint64_t addr = 0;
+
+    CHECK_CHEAP(memorder <= KALLOC_PCP_MAX_ORDER, "Pcp alloc memorder not cached.");
+
+    pcp = lock_curr_pcp(memorder, KALLOC_FLAGS_TYPE(flags), &irq_flags);
+    if (pcp->count) {
+        addr = pop_hot(pcp);
+        pcp->alloc_num++;
+    }
+    unlock_pcp(pcp, irq_flags);
+
+    if (addr)
+        return addr;
+
+    return pcp_refill_alloc(memorder, flags);
+}
+
+int kalloc_pcp_free(uint64_t addr, unsigned int memorder, flags_t flags)
+{
+    kalloc_pcp_t * pcp;
+    uint64_t irq_flags;
+    uint64_t addrs[KALLOC_PCP_HIGH - KALLOC_PCP_LOW + 1];
+    unsigned int num = 0;
+
+    if (memorder > KALLOC_PCP_MAX_ORDER)
+        return 1;
+
+    // The block is still allocated so its type is stable
+    pcp = lock_curr_pcp(memorder, mm_get_page_type(addr / PAGE_SIZE), &irq_flags);
+
+    if (flags & KALLOC_COLD_F) {
+        push_cold(pcp, addr);
+    } else {
+        push_hot(pcp, addr);
+    }
+
+    pcp->free_num++;
+
+    if (pcp->count > pcp->high) {
+        num = take_cold_batch(pcp, &addrs[0], pcp->count - pcp->low);
+    }
+
+    unlock_pcp(pcp, irq_flags);
+
+    buddy_free_batch(&addrs[0], num);
+
+    return 0;
+}
+
+unsigned int kalloc_pcp_drain(unsigned int cpu_id)
+{
+    kalloc_pcp_t * pcp;
+    uint64_t irq_flags;
+    uint64_t addrs[KALLOC_PCP_BATCH];
+    unsigned int num;
+    unsigned int total = 0;
+
+    ASSERT_PANIC(cpu_id < CORE_NUM, "Pcp drain cpu id out of range.");
+
+    for (unsigned int i = 0; i < KALLOC_PCP_ORDER_NUM; i++) {
+        for (unsigned int type = 0; type < MM_TYPE_NUM; type++) {
+            pcp = &pcps[cpu_id][i][type];
+
+            /* Drain a batch at a time so the owning core is never locked out for long. */
+            do {
+                lock_spinlock_irqsave(&pcp->lock, &irq_flags);
+                num = take_cold_batch(pcp, &addrs[0], KALLOC_PCP_BATCH);
+                unlock_spinlock_irqrestore(&pcp->lock, irq_flags);
+
+                buddy_free_batch(&addrs[0], num);
+                total += num;
+            } while (num);
+        }
+    }
+
+    return total;
+}
+
+/* Memory pressure hook, give back every cached page so the buddy allocator can coalesce them. */
+unsigned int kalloc_pcp_drain_all()
+{
+    unsigned int total = 0;
+
+    for (unsigned int i = 0; i < CORE_NUM; i++) {
+        total += kalloc_pcp_drain(i);
+    }
+
+    return total;
+}
+
+kalloc_pcp_t * kalloc_pcp_get(unsigned int cpu_id, unsigned int memorder, unsigned int type)
+{
+    CHECK_CHEAP(cpu_id < CORE_NUM && memorder <= KALLOC_PCP_MAX_ORDER && type < MM_TYPE_NUM, "Pcp get out of range.");
+
+    return &pcps[cpu_id][memorder][type];
+}
+
+void kalloc_pcp_init()
+{
+    kalloc_pcp_t * pcp;
+
+    memset(pcps, 0, sizeof(pcps));
+
+    for (unsigned int i = 0; i < CORE_NUM; i++) {
+        for (unsigned int j = 0; j < KALLOC_PCP_ORDER_NUM; j++) {
+            for (unsigned int type = 0; type < MM_TYPE_NUM; type++) {
+                pcp = &pcps[i][j][type];
+                pcp->high = KALLOC_PCP_HIGH;
+                pcp->low = KALLOC_PCP_LOW;
+                spinlock_init(&pcp->lock);
+            }
+        }
+    }
+}
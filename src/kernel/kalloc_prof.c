@@ -0,0 +1,322 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/assert.h>
+#include <common/atomic.h>
+#include <common/lock.h>
+#include <common/string.h>
+#include <kernel/cpu.h>
+#include <kernel/irq.h>
+#include <kernel/timer.h>
+#include <kernel/uart.h>
+#include <kernel/printf.h>
+#include <kernel/task.h>
+#include <kernel/sched.h>
+#include <kernel/kalloc_prof.h>
+
+#ifdef KALLOC_PROFILE
+
+/* Keys of the obj table, objs are at least 8 byte aligned so neither is ever a real obj. */
+#define PROF_OBJ_EMPTY 0
+#define PROF_OBJ_TOMB 1
+/* Room for the sites of every cpu. */
+#define PROF_MERGE_SHIFT (KALLOC_PROF_SITE_SHIFT + 2)
+#define PROF_MERGE_NUM (1 << PROF_MERGE_SHIFT)
+
+typedef struct kalloc_prof_cpu {
+    kalloc_prof_site_t sites[KALLOC_PROF_SITE_NUM];
+    /* Allocs and frees left out of the counts as their table was full. */
+    uint64_t dropped_num;
+} kalloc_prof_cpu_t;
+
+typedef struct kalloc_prof_obj {
+    uint64_t obj;
+    uint64_t site;
+    uint64_t size;
+} kalloc_prof_obj_t;
+
+/* Only the owning cpu writes its table, with irqs disabled, so the counts need no atomics. */
+static kalloc_prof_cpu_t prof_cpus[CORE_NUM];
+/* Shared by every cpu, slots are claimed and released with a cmpxchg of their obj. */
+static kalloc_prof_obj_t prof_objs[KALLOC_PROF_OBJ_NUM];
+/* Scratch table the cpu tables are merged into, under the prof lock. */
+static kalloc_prof_site_t prof_merged[PROF_MERGE_NUM];
+/* Kept off the task stacks, only one dump is made at a time. */
+static kalloc_prof_site_t prof_dump_sites[KALLOC_PROF_DUMP_NUM];
+DEFINE_SPINLOCK(prof_lock);
+static uint64_t prof_start_time;
+
+static unsigned int prof_hash(uint64_t key, unsigned int shift)
+{
+    return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> (64 - shift));
+}
+
+/* Slot of the site, a free slot is claimed for it if it is not in the table yet. */
+static kalloc_prof_site_t * site_get(kalloc_prof_site_t * sites, unsigned int shift, unsigned int probe_num,
+                                     uint64_t site, size_t size)
+{
+    kalloc_prof_site_t * s;
+    unsigned int index = prof_hash(site ^ size, shift);
+
+    for (unsigned int i = 0; i < probe_num; i++) {
+        s = &sites[(index + i) & ((1 << shift) - 1)];
+        if (s->site == site && s->size == size)
+            return s;
+
+        if (!s->site) {
+            s->site = site;
+            s->size = size;
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+static int obj_insert(uint64_t obj, uint64_t site, size_t size)
+{
+    kalloc_prof_obj_t * slot;
+    uint64_t key;
+    unsigned int index = prof_hash(obj, KALLOC_PROF_OBJ_SHIFT);
+
+    for (unsigned int i = 0; i < KALLOC_PROF_PROBE_NUM; i++) {
+        slot = &prof_objs[(index + i) & (KALLOC_PROF_OBJ_NUM - 1)];
+        key = slot->obj;
+        if (key != PROF_OBJ_EMPTY && key != PROF_OBJ_TOMB)
+            continue;
+
+        // Lost the slot to another cpu, keep probing
+        if (atomic_cmpxchg_64(&slot->obj, key, obj))
+            continue;
+
+        slot->site = site;
+        slot->size = size;
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Release the slot of obj. Returns 1 if it was not alloced while profiling. */
+static int obj_remove(uint64_t obj, uint64_t * site, size_t * size)
+{
+    kalloc_prof_obj_t * slot;
+    uint64_t key;
+    unsigned int index = prof_hash(obj, KALLOC_PROF_OBJ_SHIFT);
+
+    for (unsigned int i = 0; i < KALLOC_PROF_PROBE_NUM; i++) {
+        slot = &prof_objs[(index + i) & (KALLOC_PROF_OBJ_NUM - 1)];
+        key = slot->obj;
+        // Slots are only emptied on a reset, an insert never skips an empty slot
+        if (key == PROF_OBJ_EMPTY)
+            return 1;
+
+        if (key != obj)
+            continue;
+
+        // The slot is not reused until the tomb is in, so these still belong to obj
+        *site = slot->site;
+        *size = slot->size;
+        return atomic_cmpxchg_64(&slot->obj, obj, PROF_OBJ_TOMB) ? 1 : 0;
+    }
+
+    return 1;
+}
+
+void kalloc_prof_alloc(void * site, void * obj, size_t size)
+{
+    kalloc_prof_cpu_t * cpu;
+    kalloc_prof_site_t * s;
+    uint64_t irq_flags;
+
+    irq_save_disable(&irq_flags);
+    cpu = &prof_cpus[cpu_get_id()];
+
+    // An alloc whose free could not be matched would show up as a leak, leave it out instead
+    s = site_get(cpu->sites, KALLOC_PROF_SITE_SHIFT, KALLOC_PROF_PROBE_NUM, (uint64_t)site, size);
+    if (!s || obj_insert((uint64_t)obj, (uint64_t)site, size)) {
+        cpu->dropped_num++;
+        goto prof_alloc_exit;
+    }
+
+    s->alloc_num++;
+    s->alloc_size += size;
+
+prof_alloc_exit:
+    irq_restore(irq_flags);
+}
+
+void kalloc_prof_free(void * obj)
+{
+    kalloc_prof_cpu_t * cpu;
+    kalloc_prof_site_t * s;
+    uint64_t site;
+    size_t size;
+    uint64_t irq_flags;
+
+    if (obj_remove((uint64_t)obj, &site, &size))
+        return;
+
+    irq_save_disable(&irq_flags);
+    cpu = &prof_cpus[cpu_get_id()];
+
+    s = site_get(cpu->sites, KALLOC_PROF_SITE_SHIFT, KALLOC_PROF_PROBE_NUM, site, size);
+    if (!s) {
+        cpu->dropped_num++;
+        goto prof_free_exit;
+    }
+
+    s->free_num++;
+    s->free_size += size;
+
+prof_free_exit:
+    irq_restore(irq_flags);
+}
+
+static uint64_t site_live_size(kalloc_prof_site_t * s)
+{
+    return s->alloc_size - s->free_size;
+}
+
+/* Whether a goes before b in the sort order. */
+static int site_before(kalloc_prof_site_t * a, kalloc_prof_site_t * b, kalloc_prof_sort_t sort)
+{
+    if (sort == KALLOC_PROF_SORT_LIVE && site_live_size(a) != site_live_size(b))
+        return site_live_size(a) > site_live_size(b);
+
+    return a->alloc_num > b->alloc_num;
+}
+
+unsigned int kalloc_prof_top(kalloc_prof_site_t * sites, unsigned int site_num, kalloc_prof_sort_t sort)
+{
+    kalloc_prof_site_t * cpu_site;
+    kalloc_prof_site_t * s;
+    unsigned int num = 0;
+    unsigned int best;
+
+    lock_spinlock(&prof_lock);
+
+    memset(prof_merged, 0, sizeof(prof_merged));
+    for (unsigned int i = 0; i < CORE_NUM; i++) {
+        for (unsigned int j = 0; j < KALLOC_PROF_SITE_NUM; j++) {
+            cpu_site = &prof_cpus[i].sites[j];
+            if (!cpu_site->site)
+                continue;
+
+            // The merge table has room for every site of every cpu, so the whole of it can be probed
+            s = site_get(prof_merged, PROF_MERGE_SHIFT, PROF_MERGE_NUM, cpu_site->site, cpu_site->size);
+
+            s->alloc_num += cpu_site->alloc_num;
+            s->free_num += cpu_site->free_num;
+            s->alloc_size += cpu_site->alloc_size;
+            s->free_size += cpu_site->free_size;
+        }
+    }
+
+    // Selection of the top few, the merge table is cleared again on the next call
+    for (; num < site_num; num++) {
+        best = PROF_MERGE_NUM;
+        for (unsigned int i = 0; i < PROF_MERGE_NUM; i++) {
+            if (!prof_merged[i].site)
+                continue;
+
+            if (best == PROF_MERGE_NUM || site_before(&prof_merged[i], &prof_merged[best], sort))
+                best = i;
+        }
+
+        if (best == PROF_MERGE_NUM)
+            break;
+
+        sites[num] = prof_merged[best];
+        prof_merged[best].site = 0;
+    }
+
+    unlock_spinlock(&prof_lock);
+
+    return num;
+}
+
+uint64_t kalloc_prof_dropped_num()
+{
+    uint64_t num = 0;
+
+    for (unsigned int i = 0; i < CORE_NUM; i++) {
+        num += prof_cpus[i].dropped_num;
+    }
+
+    return num;
+}
+
+void kalloc_prof_dump(unsigned int top_num, kalloc_prof_sort_t sort)
+{
+    kalloc_prof_site_t * sites = prof_dump_sites;
+    uint64_t time_us = systemtimer_gettime_64() - prof_start_time;
+    unsigned int num;
+
+    if (top_num > KALLOC_PROF_DUMP_NUM)
+        top_num = KALLOC_PROF_DUMP_NUM;
+
+    num = kalloc_prof_top(sites, top_num, sort);
+    // Rates are per second, keep the division away from 0 right after a reset
+    if (!time_us)
+        time_us = 1;
+
+    lock_printlock();
+    printf(sort == KALLOC_PROF_SORT_LIVE ? "Kalloc prof sites by live bytes\n" : "Kalloc prof sites by allocs\n");
+    for (unsigned int i = 0; i < num; i++) {
+        printfdata("site=", sites[i].site);
+        printfdigit(" size=", sites[i].size);
+        printfdigit(" allocs=", sites[i].alloc_num);
+        printfdigit(" frees=", sites[i].free_num);
+        printfdigit(" live bytes=", site_live_size(&sites[i]));
+        printfdigit(" allocs per sec=", (sites[i].alloc_num * 1000000) / time_us);
+        printfdigit(" frees per sec=", (sites[i].free_num * 1000000) / time_us);
+    }
+    printfdigit("dropped=", kalloc_prof_dropped_num());
+    unlock_printlock();
+}
+
+void kalloc_prof_reset()
+{
+    lock_spinlock(&prof_lock);
+    memset(prof_cpus, 0, sizeof(prof_cpus));
+    memset(prof_objs, 0, sizeof(prof_objs));
+    prof_start_time = systemtimer_gettime_64();
+    unlock_spinlock(&prof_lock);
+}
+
+void kalloc_prof_init()
+{
+    ASSERT_PANIC(PROF_MERGE_NUM >= CORE_NUM * KALLOC_PROF_SITE_NUM, "Kalloc prof merge table too small.");
+
+    prof_start_time = systemtimer_gettime_64();
+}
+
+static void kalloc_prof_task()
+{
+    int c;
+
+    while (1) {
+        c = uart_trygetc();
+        if (c == KALLOC_PROF_DUMP_LIVE_KEY)
+            kalloc_prof_dump(KALLOC_PROF_DUMP_NUM, KALLOC_PROF_SORT_LIVE);
+        else if (c == KALLOC_PROF_DUMP_ALLOC_KEY)
+            kalloc_prof_dump(KALLOC_PROF_DUMP_NUM, KALLOC_PROF_SORT_ALLOC);
+        else if (c == KALLOC_PROF_RESET_KEY)
+            kalloc_prof_reset();
+
+        sched_yield();
+    }
+}
+
+void kalloc_prof_task_init()
+{
+    task_t * task;
+
+    task = task_alloc();
+    ASSERT_PANIC(task, "Kalloc prof task alloc failed");
+    task_create(task, kalloc_prof_task);
+    sched_task_add(task, TASK_UNINT, 0);
+}
+
+#endif
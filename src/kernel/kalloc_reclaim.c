@@ -0,0 +1,152 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/assert.h>
+#include <common/lock.h>
+#include <common/atomic.h>
+#include <common/queue.h>
+#include <common/string.h>
+#include <kernel/mm.h>
+#include <kernel/kalloc.h>
+#include <kernel/kalloc_reclaim.h>
+#include <kernel/sched.h>
+#include <kernel/printf.h>
+
+static queue_head_t shrinker_list;
+/* Protects the shrinker list and is held while the shrinkers run, so only one reclaim runs at a time. */
+DEFINE_SPINLOCK(shrinker_lock);
+static kalloc_reclaim_stats_t reclaim_stats;
+ATOMIC_UINT64(reclaim_request);
+static event_id_t reclaim_event;
+
+void kalloc_reclaim_init()
+{
+    memset(&reclaim_stats, 0, sizeof(kalloc_reclaim_stats_t));
+    queue_init(&shrinker_list);
+    spinlock_init(&shrinker_lock);
+}
+
+kalloc_reclaim_stats_t * kalloc_reclaim_stats()
+{
+    return &reclaim_stats;
+}
+
+void kalloc_shrinker_register(kalloc_shrinker_t * shrinker)
+{
+    ASSERT_PANIC(shrinker && shrinker->shrink, "Shrinker has no shrink callback.");
+
+    shrinker->freed_page_num = 0;
+
+    lock_spinlock(&shrinker_lock);
+    enqueue_tail(&shrinker_list, &shrinker->chain);
+    unlock_spinlock(&shrinker_lock);
+}
+
+void kalloc_shrinker_unregister(kalloc_shrinker_t * shrinker)
+{
+    lock_spinlock(&shrinker_lock);
+    rmqueue(&shrinker->chain);
+    queue_zero(&shrinker->chain);
+    unlock_spinlock(&shrinker_lock);
+}
+
+unsigned int kalloc_reclaim(unsigned int page_num)
+{
+    queue_entry_t qe;
+    kalloc_shrinker_t * shrinker;
+    unsigned int freed_num = 0;
+    unsigned int num;
+
+    lock_spinlock(&shrinker_lock);
+
+    queue_iter(&shrinker_list, qe) {
+        if (freed_num >= page_num)
+            break;
+
+        shrinker = qe_chain_access(qe, kalloc_shrinker_t, chain);
+        if (shrinker->count && !shrinker->count(shrinker->data))
+            continue;
+
+        num = shrinker->shrink(shrinker->data, page_num - freed_num);
+        shrinker->freed_page_num += num;
+        freed_num += num;
+    }
+
+    reclaim_stats.run_num++;
+    reclaim_stats.freed_page_num += freed_num;
+
+    unlock_spinlock(&shrinker_lock);
+
+    return freed_num;
+}
+
+unsigned int kalloc_reclaim_balance()
+{
+    uint64_t free_page_num = mm_free_page_num();
+    uint64_t high_page_num;
+
+    if (free_page_num >= mm_wmark_page_num(MM_WMARK_LOW))
+        return 0;
+
+    if (free_page_num < mm_wmark_page_num(MM_WMARK_MIN))
+        return kalloc_reclaim(KALLOC_RECLAIM_ALL);
+
+    // Get back over the high watermark so we do not bounce right back under low
+    high_page_num = mm_wmark_page_num(MM_WMARK_HIGH);
+
+    return kalloc_reclaim(high_page_num - free_page_num);
+}
+
+void kalloc_reclaim_request()
+{
+    // Areas keep asking while they are under their low watermark, only write the flag when it changes
+    if (atomic_ld_64(&reclaim_request))
+        return;
+
+    atomic_str_64(&reclaim_request, 1);
+    atomic_fetch_add_64(&reclaim_stats.request_num, 1);
+}
+
+void kalloc_reclaim_task()
+{
+    reclaim_event = event_init();
+
+    while (1) {
+        event_waiton(reclaim_event, KALLOC_RECLAIM_PERIOD_US);
+
+        // Idle slabs go back after a few periods even without pressure, so the caches do not stay bloated
+        kalloc_reap_caches();
+
+        if (!atomic_ld_64(&reclaim_request))
+            continue;
+
+        atomic_str_64(&reclaim_request, 0);
+        kalloc_reclaim_balance();
+    }
+}
+
+void kalloc_reclaim_dump()
+{
+    queue_entry_t qe;
+    kalloc_shrinker_t * shrinker;
+
+    lock_printlock();
+    printf("Kalloc reclaim stats\n");
+    printfdigit("runs=", reclaim_stats.run_num);
+    printfdigit("requests=", reclaim_stats.request_num);
+    printfdigit("pages freed=", reclaim_stats.freed_page_num);
+    printfdigit("free pages=", mm_free_page_num());
+    printfdigit("min wmark=", mm_wmark_page_num(MM_WMARK_MIN));
+    printfdigit("low wmark=", mm_wmark_page_num(MM_WMARK_LOW));
+    printfdigit("high wmark=", mm_wmark_page_num(MM_WMARK_HIGH));
+
+    lock_spinlock(&shrinker_lock);
+    queue_iter(&shrinker_list, qe) {
+        shrinker = qe_chain_access(qe, kalloc_shrinker_t, chain);
+        printf(shrinker->name);
+        printfdigit(" pages freed=", shrinker->freed_page_num);
+    }
+    unlock_spinlock(&shrinker_lock);
+
+    unlock_printlock();
+}
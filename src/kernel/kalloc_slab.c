@@ -8,48 +8,69 @@
 
 size_t kalloc_slab_free_list_size(unsigned int obj_num)
 {
-    return (sizeof(unsigned int) * (obj_num - 1));
+    return (sizeof(kalloc_slab_index_t) * obj_num);
+}
+
+/* Objs start on the largest power of two boundary their size allows, so power of two objs do not
+ * straddle cache lines, without aligning the header all the way up to a large obj size. */
+static size_t obj_align(size_t obj_size)
+{
+    size_t align = obj_size & -obj_size;
+
+    return align > KALLOC_SLAB_MAX_ALIGN ? KALLOC_SLAB_MAX_ALIGN : align;
 }
 
 // return the size of the slab struct for allocating 
 size_t kalloc_slab_struct_size(unsigned int obj_num, size_t obj_size)
 {
     // The struct with the free_indexs array included after the struct
-    // The free indexs array is size (objnum - 1)
-    // Align everything up to the obj size so that objs start on their own size byte boundary
-    return (size_t)ALIGN_UP(sizeof(kalloc_slab_t) + kalloc_slab_free_list_size(obj_num), obj_size);
+    return (size_t)ALIGN_UP(sizeof(kalloc_slab_t) + kalloc_slab_free_list_size(obj_num), obj_align(obj_size));
 }
 
 // return the size of the total mem size when in-lining the struct in the memory region
 size_t kalloc_slab_total_size(unsigned int obj_num, size_t obj_size)
 {
-    return (size_t)(ALIGN_UP(kalloc_slab_struct_size(obj_num, obj_size), obj_size) + (obj_num * obj_size));
+    return (size_t)(kalloc_slab_struct_size(obj_num, obj_size) + (obj_num * obj_size));
 }
 
 unsigned int kalloc_slab_obj_num(size_t obj_size, size_t mem_size)
 {
-    return ALIGN_DOWN(mem_size, obj_size) / obj_size;
+    unsigned int num = ALIGN_DOWN(mem_size, obj_size) / obj_size;
+
+    return num > KALLOC_SLAB_MAX_OBJ_NUM ? KALLOC_SLAB_MAX_OBJ_NUM : num;
 }
 
-// TODO make this more logarithmic or make better guesses
 // return the number of objs that can fit within a page alongside the embedded slab struct
 unsigned int kalloc_slab_inline_obj_num_pages(size_t obj_size, unsigned int num_pages)
 {
-    size_t total_size;
     size_t mem_size = num_pages * PAGE_SIZE;
+    unsigned int num;
 
-    // Start the best guess at the number of objects with the struct and free list with 1 object
-    // TODO we could make this much more efficient
-    unsigned int num = kalloc_slab_obj_num(obj_size, mem_size);
-    do {
-        total_size = kalloc_slab_total_size(num, obj_size);
-        num --;
-    } while (num > 0 && total_size > mem_size);
+    if (mem_size <= sizeof(kalloc_slab_t))
+        return 0;
+
+    // Every obj costs its size plus its free index, only the header alignment can make this one too many
+    num = (mem_size - sizeof(kalloc_slab_t)) / (obj_size + sizeof(kalloc_slab_index_t));
+    if (num > KALLOC_SLAB_MAX_OBJ_NUM)
+        num = KALLOC_SLAB_MAX_OBJ_NUM;
+
+    if (num && kalloc_slab_total_size(num, obj_size) > mem_size)
+        num--;
 
     return num;
 }
 
-kalloc_slab_t * kalloc_slab_init(kalloc_slab_t * slab, void * mem_ptr, unsigned int mem_num_pages, size_t obj_size, flags_t flags)
+size_t kalloc_slab_inline_free_size(size_t obj_size, unsigned int page_num)
+{
+    unsigned int num = kalloc_slab_inline_obj_num_pages(obj_size, page_num);
+
+    if (!num)
+        return 0;
+
+    return page_num * PAGE_SIZE - kalloc_slab_total_size(num, obj_size);
+}
+
+static kalloc_slab_t * slab_init(kalloc_slab_t * slab, void * mem_ptr, unsigned int mem_num_pages, size_t obj_size, size_t color, flags_t flags)
 {
     size_t struct_size;
     unsigned int num;
@@ -63,13 +84,15 @@ kalloc_slab_t * kalloc_slab_init(kalloc_slab_t * slab, void * mem_ptr, unsigned
         num = kalloc_slab_inline_obj_num_pages(obj_size, mem_num_pages);
 
         ASSERT_PANIC(num, "Calculated num of objects is 0");
+        ASSERT_PANIC(color <= kalloc_slab_inline_free_size(obj_size, mem_num_pages) && IS_ALIGNED(color, obj_align(obj_size)), 
+                     "Slab color does not fit");
 
         struct_size = kalloc_slab_struct_size(num, obj_size);
 
         slab = (kalloc_slab_t *)mem_ptr;
-        slab->mem_ptr = (char*)mem_ptr + struct_size;
+        slab->mem_ptr = (char*)mem_ptr + struct_size + color;
 
-        ASSERT_PANIC((((uint64_t)slab->mem_ptr) + (slab->obj_size * slab->max_num)) < ((uint64_t)slab + PAGE_SIZE * mem_num_pages), 
+        ASSERT_PANIC((((uint64_t)slab->mem_ptr) + (obj_size * num)) <= ((uint64_t)slab + PAGE_SIZE * mem_num_pages), 
                     "Slab mem out of range");
     // We are allocating from a struct provided and filling the mem_ptr region up to the max_num objects providied
     } else {
@@ -88,10 +111,10 @@ kalloc_slab_t * kalloc_slab_init(kalloc_slab_t * slab, void * mem_ptr, unsigned
         // For every index the next index is free
         slab->free_indexs[i] = i + 1;
     }
+    // The last obj ends the chain, a full slab has free_index at the end marker instead of a spare obj
+    slab->free_indexs[num - 1] = KALLOC_SLAB_FREE_END;
 
-    /* We are reserving one memory space for the overflow that occurs when we fully allocate 
-     * the slab, so that slab->free_index is always pointing to an actual free index. */
-    slab->max_num = num - 1;
+    slab->max_num = num;
     slab->obj_size = obj_size;
     slab->mem_page_num = mem_num_pages;
     
@@ -101,31 +124,42 @@ kalloc_slab_t * kalloc_slab_init(kalloc_slab_t * slab, void * mem_ptr, unsigned
     return slab;
 }
 
+kalloc_slab_t * kalloc_slab_init(kalloc_slab_t * slab, void * mem_ptr, unsigned int mem_num_pages, size_t obj_size, flags_t flags)
+{
+    return slab_init(slab, mem_ptr, mem_num_pages, obj_size, 0, flags);
+}
+
+kalloc_slab_t * kalloc_slab_init_color(void * mem_ptr, unsigned int mem_num_pages, size_t obj_size, size_t color, flags_t flags)
+{
+    return slab_init(NULL, mem_ptr, mem_num_pages, obj_size, color, flags);
+}
+
 void * kalloc_slab_alloc(kalloc_slab_t * slab)
 {   
-    ASSERT_PANIC(slab->num != slab->max_num, "Slab is already full");
-    ASSERT_PANIC(slab->free_index <= slab->max_num, "Free index is not in max num range");
-    ASSERT_PANIC(slab->free_indexs[slab->free_index] <= slab->max_num, "Free indexs are not in max num range");
+    CHECK_CHEAP(slab->num != slab->max_num, "Slab is already full");
+    CHECK_CHEAP(slab->free_index < slab->max_num, "Free index is not in max num range");
+    CHECK_CHEAP(slab->free_indexs[slab->free_index] < slab->max_num || 
+                slab->free_indexs[slab->free_index] == KALLOC_SLAB_FREE_END, "Free indexs are not in max num range");
     
     void * obj = slab->mem_ptr + slab->obj_size * slab->free_index;
     slab->free_index = slab->free_indexs[slab->free_index];
     slab->num++;
 
-    ASSERT_PANIC(PTR_IN_RANGE(obj, slab->mem_ptr, slab->obj_size * (slab->max_num  + 1)), 
+    CHECK_CHEAP(PTR_IN_RANGE(obj, slab->mem_ptr, slab->obj_size * slab->max_num), 
                 "Alloced obj outside of mem range");
     return obj;
 }
 
 int kalloc_slab_free(kalloc_slab_t * slab, void * obj)
 {   
-    ASSERT_PANIC(slab->num, "Slab is all freed");
+    CHECK_CHEAP(slab->num, "Slab is all freed");
 
-    ASSERT_PANIC(PTR_IN_RANGE(obj, slab->mem_ptr, slab->obj_size * (slab->max_num  + 1)), 
+    CHECK_CHEAP(PTR_IN_RANGE(obj, slab->mem_ptr, slab->obj_size * slab->max_num), 
                 "Obj outside of slab range.");
 
     unsigned int index = (obj - slab->mem_ptr) / slab->obj_size;
 
-    ASSERT_PANIC(index <= slab->max_num, "index of free greated than max num entries");
+    CHECK_CHEAP(index < slab->max_num, "index of free greated than max num entries");
     slab->free_indexs[index] = slab->free_index;
     slab->free_index = index;
     slab->num --;
@@ -0,0 +1,111 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/assert.h>
+#include <common/lock.h>
+#include <common/string.h>
+#include <common/aarch64_common.h>
+#include <kernel/mm.h>
+#include <kernel/mmu.h>
+#include <kernel/kalloc.h>
+#include <kernel/kalloc_page.h>
+#include <kernel/kalloc_pcp.h>
+#include <kernel/kalloc_zero.h>
+
+static kalloc_zero_pool_t zero_pool;
+
+void kalloc_zero_init()
+{
+    memset(&zero_pool, 0, sizeof(kalloc_zero_pool_t));
+    spinlock_init(&zero_pool.lock);
+}
+
+kalloc_zero_pool_t * kalloc_zero_pool()
+{
+    return &zero_pool;
+}
+
+void kalloc_zero_pages(uint64_t addr, unsigned int memorder)
+{
+    aarch64_zero_range((void *)(addr | MMU_UPPER_ADDRESS), MM_MEMORDER_SIZE(memorder));
+}
+
+uint64_t kalloc_zero_alloc()
+{
+    uint64_t irq_flags;
+    uint64_t addr = 0;
+
+    lock_spinlock_irqsave(&zero_pool.lock, &irq_flags);
+
+    if (zero_pool.count) {
+        zero_pool.count--;
+        addr = zero_pool.pages[zero_pool.count];
+        zero_pool.hit_num++;
+    } else {
+        zero_pool.miss_num++;
+    }
+
+    unlock_spinlock_irqrestore(&zero_pool.lock, irq_flags);
+
+    return addr;
+}
+
+unsigned int kalloc_zero_fill(unsigned int max_num)
+{
+    uint64_t irq_flags;
+    uint64_t addr;
+    unsigned int num = 0;
+    int added;
+
+    while (num < max_num && zero_pool.count < KALLOC_ZERO_POOL_SIZE) {
+        addr = kalloc_pcp_alloc(0, 0);
+        if (!addr)
+            break;
+
+        // Zero outside the lock, this is the part we are taking off the alloc path
+        kalloc_zero_pages(addr, 0);
+
+        lock_spinlock_irqsave(&zero_pool.lock, &irq_flags);
+        added = zero_pool.count < KALLOC_ZERO_POOL_SIZE;
+        if (added) {
+            zero_pool.pages[zero_pool.count] = addr;
+            zero_pool.count++;
+            zero_pool.fill_num++;
+        }
+        unlock_spinlock_irqrestore(&zero_pool.lock, irq_flags);
+
+        // Another idle core filled the pool while we were zeroing
+        if (!added) {
+            kalloc_pcp_free(addr, 0, KALLOC_COLD_F);
+            break;
+        }
+
+        num++;
+    }
+
+    return num;
+}
+
+unsigned int kalloc_zero_drain()
+{
+    uint64_t irq_flags;
+    uint64_t addrs[KALLOC_ZERO_POOL_SIZE];
+    unsigned int num;
+    int ret;
+
+    lock_spinlock_irqsave(&zero_pool.lock, &irq_flags);
+    num = zero_pool.count;
+    for (unsigned int i = 0; i < num; i++) {
+        addrs[i] = zero_pool.pages[i];
+    }
+    zero_pool.count = 0;
+    unlock_spinlock_irqrestore(&zero_pool.lock, irq_flags);
+
+    if (!num)
+        return 0;
+
+    ret = kalloc_page_free_bulk(&addrs[0], num, 0);
+    ASSERT_PANIC(!ret, "Zero pool drain free pages failed.");
+
+    return num;
+}
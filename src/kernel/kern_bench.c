@@ -0,0 +1,362 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <common/common.h>
+#include <common/assert.h>
+#include <common/atomic.h>
+#include <common/aarch64_common.h>
+#include <kernel/cpu.h>
+#include <kernel/timer.h>
+#include <kernel/mm.h>
+#include <kernel/kalloc.h>
+#include <kernel/kalloc_pcp.h>
+#include <kernel/kalloc_cache.h>
+#include <kernel/mmu.h>
+#include <kernel/kalloc_arena.h>
+#include <kernel/kern_bench.h>
+#include <emb-stdio/emb-stdio.h>
+
+ATOMIC_UINT64(bench_round);
+ATOMIC_UINT64(bench_arrived);
+ATOMIC_UINT64(bench_finished);
+ATOMIC_UINT64(bench_exit);
+
+static kern_bench_fn_t bench_fn;
+static void * bench_arg;
+static unsigned int bench_core_num;
+
+/* Every participating core spins here so the timed section starts at the same time on all of them. */
+static void bench_barrier()
+{
+    atomic_fetch_add_64(&bench_arrived, 1);
+    while (atomic_ld_64(&bench_arrived) < bench_core_num) {
+        CYCLE_WAIT(10);
+    }
+}
+
+uint64_t kern_bench_run_cores(kern_bench_fn_t fn, void * arg, unsigned int core_num)
+{
+    uint64_t start;
+    uint64_t end;
+
+    ASSERT_PANIC(cpu_get_id() == 0, "Bench rounds are driven by core 0");
+    ASSERT_PANIC(core_num && core_num <= CORE_NUM, "Bench core num out of range.");
+
+    bench_fn = fn;
+    bench_arg = arg;
+    bench_core_num = core_num;
+    /* The other cores are parked waiting on bench_round, so these can not race. */
+    bench_arrived = 0;
+    bench_finished = 0;
+    aarch64_dsb();
+
+    atomic_fetch_add_64(&bench_round, 1);
+
+    bench_barrier();
+    start = systemtimer_gettime_64();
+
+    fn(0, arg);
+
+    while (atomic_ld_64(&bench_finished) != CORE_NUM - 1) {
+        CYCLE_WAIT(10);
+    }
+
+    end = systemtimer_gettime_64();
+
+    return end - start;
+}
+
+void kern_bench_child(unsigned int core)
+{
+    uint64_t seen_round = 0;
+    uint64_t round;
+
+    while (!atomic_ld_64(&bench_exit)) {
+        round = atomic_ld_64(&bench_round);
+        if (round == seen_round) {
+            CYCLE_WAIT(10);
+            continue;
+        }
+
+        seen_round = round;
+
+        if (core < bench_core_num) {
+            bench_barrier();
+            bench_fn(core, bench_arg);
+        }
+
+        atomic_fetch_add_64(&bench_finished, 1);
+    }
+}
+
+void kern_bench_done()
+{
+    atomic_fetch_add_64(&bench_exit, 1);
+}
+
+void kern_bench_main()
+{
+    stdio_printf("--- Kernel bench start ---\n");
+    /* Printed so the runs of the different check levels can be told apart. */
+    stdio_printf("check level=%u\n", CHECK_LEVEL);
+
+    kalloc_pcp_bench();
+    kalloc_mag_bench();
+    kalloc_cache_color_bench();
+    kalloc_arena_bench();
+
+    stdio_printf("--- Kernel bench end ---\n");
+
+    kern_bench_done();
+}
+
+#define PCP_BENCH_ITER 2000
+#define PCP_BENCH_BATCH 32
+
+static void pcp_bench_fn(unsigned int core, void * arg)
+{
+    void * pages[PCP_BENCH_BATCH];
+    int ret;
+
+    (void)core;
+    (void)arg;
+
+    for (unsigned int i = 0; i < PCP_BENCH_ITER; i++) {
+        for (unsigned int j = 0; j < PCP_BENCH_BATCH; j++) {
+            pages[j] = kalloc_pages(1, 0);
+            ASSERT_PANIC(pages[j], "Pcp bench alloc failed.");
+            /* Touch the page so cache hot reuse is part of what we measure. */
+            *(uint64_t *)pages[j] = i;
+        }
+
+        for (unsigned int j = 0; j < PCP_BENCH_BATCH; j++) {
+            ret = kalloc_free_pages(pages[j], 0);
+            ASSERT_PANIC(!ret, "Pcp bench free failed.");
+        }
+    }
+}
+
+static void pcp_stats_sum(uint64_t * refills, uint64_t * drains)
+{
+    kalloc_pcp_t * pcp;
+
+    *refills = 0;
+    *drains = 0;
+    for (unsigned int i = 0; i < CORE_NUM; i++) {
+        for (unsigned int j = 0; j <= KALLOC_PCP_MAX_ORDER; j++) {
+            for (unsigned int type = 0; type < MM_TYPE_NUM; type++) {
+                pcp = kalloc_pcp_get(i, j, type);
+                *refills += pcp->refill_num;
+                *drains += pcp->drain_num;
+            }
+        }
+    }
+}
+
+void kalloc_pcp_bench()
+{
+    uint64_t usecs;
+    uint64_t ops;
+    uint64_t refills_start, refills_end;
+    uint64_t drains_start, drains_end;
+
+    stdio_printf("kalloc_pages(1) alloc/free, %u pages per batch\n", PCP_BENCH_BATCH);
+
+    for (unsigned int core_num = 1; core_num <= CORE_NUM; core_num++) {
+        kalloc_pcp_drain_all();
+        pcp_stats_sum(&refills_start, &drains_start);
+
+        usecs = kern_bench_run_cores(pcp_bench_fn, NULL, core_num);
+        ops = (uint64_t)core_num * PCP_BENCH_ITER * PCP_BENCH_BATCH * 2;
+
+        pcp_stats_sum(&refills_end, &drains_end);
+
+        stdio_printf("cores=%u usecs=%lu ops=%lu ops/ms=%lu refills=%lu drains=%lu\n",
+                     core_num, usecs, ops, usecs ? (ops * 1000) / usecs : 0,
+                     refills_end - refills_start, drains_end - drains_start);
+    }
+}
+
+#define MAG_BENCH_ITER 2000
+#define MAG_BENCH_BATCH 32
+
+static void mag_bench_fn(unsigned int core, void * arg)
+{
+    void * objs[MAG_BENCH_BATCH];
+    size_t size = *(size_t *)arg;
+    int ret;
+
+    (void)core;
+
+    for (unsigned int i = 0; i < MAG_BENCH_ITER; i++) {
+        for (unsigned int j = 0; j < MAG_BENCH_BATCH; j++) {
+            objs[j] = kalloc_alloc(size, 0);
+            ASSERT_PANIC(objs[j], "Mag bench alloc failed.");
+            *(uint64_t *)objs[j] = i;
+        }
+
+        for (unsigned int j = 0; j < MAG_BENCH_BATCH; j++) {
+            ret = kalloc_free(objs[j], 0);
+            ASSERT_PANIC(!ret, "Mag bench free failed.");
+        }
+    }
+}
+
+void kalloc_mag_bench()
+{
+    uint64_t usecs;
+    uint64_t ops;
+    size_t size;
+
+    stdio_printf("kalloc_alloc/kalloc_free through the magazines, %u objs per batch\n", MAG_BENCH_BATCH);
+
+    for (size = 16; size <= 2048; size *= 2) {
+        for (unsigned int core_num = 1; core_num <= CORE_NUM; core_num++) {
+            kalloc_shrink_caches();
+
+            usecs = kern_bench_run_cores(mag_bench_fn, &size, core_num);
+            ops = (uint64_t)core_num * MAG_BENCH_ITER * MAG_BENCH_BATCH * 2;
+
+            stdio_printf("size=%lu cores=%u usecs=%lu ops=%lu ops/ms=%lu\n",
+                         size, core_num, usecs, ops, usecs ? (ops * 1000) / usecs : 0);
+        }
+    }
+}
+
+#define COLOR_BENCH_OBJ_SIZE 512
+#define COLOR_BENCH_SLAB_NUM 64
+#define COLOR_BENCH_ITER 2000
+
+typedef struct color_bench {
+    kalloc_cache_t cache;
+    void * pages[COLOR_BENCH_SLAB_NUM];
+    /* The first obj of every slab, the ones that collide in the cache sets without coloring. */
+    uint64_t * objs[COLOR_BENCH_SLAB_NUM];
+} color_bench_t;
+
+static color_bench_t color_bench;
+
+static void color_bench_fn(unsigned int core, void * arg)
+{
+    uint64_t sum = 0;
+
+    (void)core;
+
+    for (unsigned int i = 0; i < COLOR_BENCH_ITER; i++) {
+        for (unsigned int j = 0; j < COLOR_BENCH_SLAB_NUM; j++) {
+            sum += *color_bench.objs[j];
+        }
+    }
+
+    *(uint64_t *)arg = sum;
+}
+
+static void color_bench_setup(flags_t flags)
+{
+    kalloc_slab_t * slab;
+    int ret;
+
+    ret = kalloc_cache_init(&color_bench.cache, COLOR_BENCH_OBJ_SIZE, 1, NULL, NULL,
+                            KALLOC_CACHE_NO_EXPAND_F | KALLOC_CACHE_NO_SHRINK_F | flags);
+    ASSERT_PANIC(!ret, "Color bench cache init failed.");
+
+    for (unsigned int i = 0; i < COLOR_BENCH_SLAB_NUM; i++) {
+        color_bench.pages[i] = kalloc_pages(1, 0);
+        ASSERT_PANIC(color_bench.pages[i], "Color bench page alloc failed.");
+
+        slab = kalloc_cache_add_slab_pages(&color_bench.cache, (void *)mmu_get_phys_addr((uint64_t)color_bench.pages[i]), 1);
+        ASSERT_PANIC(slab, "Color bench add slab failed.");
+
+        color_bench.objs[i] = (uint64_t *)((uint64_t)slab->mem_ptr | MMU_UPPER_ADDRESS);
+        *color_bench.objs[i] = i;
+    }
+}
+
+static void color_bench_teardown()
+{
+    kalloc_slab_t * slab;
+    int ret;
+
+    for (unsigned int i = 0; i < COLOR_BENCH_SLAB_NUM; i++) {
+        slab = (kalloc_slab_t *)mmu_get_phys_addr((uint64_t)color_bench.pages[i]);
+        ret = kalloc_cache_remove_slab(&color_bench.cache, slab);
+        ASSERT_PANIC(!ret, "Color bench remove slab failed.");
+        kalloc_free_pages(color_bench.pages[i], 0);
+    }
+}
+
+void kalloc_cache_color_bench()
+{
+    uint64_t usecs;
+    uint64_t sum;
+    uint64_t ops = (uint64_t)COLOR_BENCH_ITER * COLOR_BENCH_SLAB_NUM;
+
+    stdio_printf("first obj of %u slabs of %u byte objs, read %u times\n", 
+                 COLOR_BENCH_SLAB_NUM, COLOR_BENCH_OBJ_SIZE, COLOR_BENCH_ITER);
+
+    for (unsigned int color = 0; color < 2; color++) {
+        color_bench_setup(color ? 0 : KALLOC_CACHE_NO_COLOR_F);
+
+        usecs = kern_bench_run_cores(color_bench_fn, &sum, 1);
+
+        stdio_printf("coloring=%u colors=%u usecs=%lu reads/ms=%lu\n", color, color_bench.cache.color_num,
+                     usecs, usecs ? (ops * 1000) / usecs : 0);
+
+        color_bench_teardown();
+    }
+}
+
+#define ARENA_BENCH_ITER 2000
+#define ARENA_BENCH_BATCH 32
+#define ARENA_BENCH_SIZE 64
+
+static kalloc_arena_t bench_arenas[CORE_NUM];
+
+/* Builds and throws away a batch of objs each iteration, with one rewind in place of the batch of frees. */
+static void arena_bench_fn(unsigned int core, void * arg)
+{
+    kalloc_arena_t * arena = &bench_arenas[core];
+    kalloc_arena_mark_t mark;
+    void * obj;
+
+    (void)arg;
+
+    kalloc_arena_mark(arena, &mark);
+
+    for (unsigned int i = 0; i < ARENA_BENCH_ITER; i++) {
+        for (unsigned int j = 0; j < ARENA_BENCH_BATCH; j++) {
+            obj = kalloc_arena_alloc(arena, ARENA_BENCH_SIZE, 0);
+            ASSERT_PANIC(obj, "Arena bench alloc failed.");
+            *(uint64_t *)obj = i;
+        }
+
+        kalloc_arena_rewind(arena, &mark);
+    }
+}
+
+void kalloc_arena_bench()
+{
+    uint64_t usecs;
+    uint64_t ops;
+    size_t size = ARENA_BENCH_SIZE;
+
+    stdio_printf("arena alloc/rewind against kalloc_alloc/kalloc_free, %u objs of %u bytes per batch\n",
+                 ARENA_BENCH_BATCH, ARENA_BENCH_SIZE);
+
+    for (unsigned int core_num = 1; core_num <= CORE_NUM; core_num++) {
+        for (unsigned int i = 0; i < core_num; i++) {
+            kalloc_arena_init(&bench_arenas[i], 0, 0);
+        }
+
+        usecs = kern_bench_run_cores(arena_bench_fn, NULL, core_num);
+        ops = (uint64_t)core_num * ARENA_BENCH_ITER * ARENA_BENCH_BATCH;
+        stdio_printf("arena cores=%u usecs=%lu allocs/ms=%lu\n", core_num, usecs, usecs ? (ops * 1000) / usecs : 0);
+
+        for (unsigned int i = 0; i < core_num; i++) {
+            kalloc_arena_destroy(&bench_arenas[i]);
+        }
+
+        kalloc_shrink_caches();
+        usecs = kern_bench_run_cores(mag_bench_fn, &size, core_num);
+        stdio_printf("kalloc cores=%u usecs=%lu allocs/ms=%lu\n", core_num, usecs, usecs ? (ops * 1000) / usecs : 0);
+    }
+}
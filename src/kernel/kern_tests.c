@@ -15,6 +15,17 @@
 #include <common/math.h>
 #include <common/rand.h>
 #include <common/queue.h>
+#include <kernel/kalloc_pcp.h>
+#include <kernel/kalloc_zero.h>
+#include <kernel/kalloc_compact.h>
+#include <kernel/kalloc_reclaim.h>
+#include <kernel/kalloc_mag.h>
+#include <kernel/task.h>
+#include <kernel/kalloc_arena.h>
+#include <kernel/kalloc_prof.h>
+#include <kernel/mmu.h>
+#include <common/string.h>
+#include <kernel/cpu.h>
 
 #define LL_TEST_NUM 6
 
@@ -35,6 +46,7 @@ static void list_test()
 	list_node_t node1;
 	list_node_t node2;
 	unsigned int i = 0;
+	int ret;
 
 	memset(&nodes[0], 0, sizeof(list_node_t) * LL_TEST_NUM);
 
@@ -61,6 +73,12 @@ static void list_test()
 	ASSERT_PANIC(head.last == &nodes[LL_TEST_NUM - 1], "Head is not pointing at last");
 	ASSERT_PANIC(head.next == &nodes[0], "Head is not pointing at first");
 
+	// The full check level panics on this, below it the delete has to fail without touching the list
+	if (!CHECK_ENABLED(CHECK_LEVEL_FULL)) {
+		ret = ll_delete_node(&head, (ll_node_t *)&node1);
+		ASSERT_PANIC(ret && head.count == LL_TEST_NUM && head.last == &nodes[LL_TEST_NUM - 1], "Delete of a missing node changed the list");
+	}
+
 	i = 0;
 	LL_ITER_LIST(&head, p) {
 		ASSERT_PANIC(head.next == &nodes[i], "Inorder delete failed");
@@ -227,6 +245,12 @@ void math_test()
 	ASSERT(math_is_power2_64(1024));
 	ASSERT(!math_is_power2_64(1025));
 
+	ASSERT(math_align_power2_64(1) == 1);
+	ASSERT(math_align_power2_64(4) == 4);
+	ASSERT(math_align_power2_64(5) == 8);
+	ASSERT(bits_msb_index_64(4) == 2);
+	ASSERT(bits_msb_index_64(7) == 2);
+
 	printf("MATH TEST DONE\n");
 }
 
@@ -623,7 +647,7 @@ void mm_test()
 			DEBUG_FUNC("MM free at memorder=", memorders[rand_free]);
 
 			buddy = kalloc_get_buddy_from_addr((uint64_t)ptrs[rand_free]);
-			ASSERT_PANIC(buddy->buddy_memorder == memorders[rand_free], "Buddy is not the past memorder");
+			ASSERT_PANIC(kalloc_get_buddy_memorder(buddy) == memorders[rand_free], "Buddy is not the past memorder");
 
 			ret = kalloc_page_free_pages((uint64_t)ptrs[rand_free], 0);
 			ASSERT_PANIC(!ret, "mm_free_pages failed");
@@ -690,7 +714,7 @@ void mm_test()
 		if (!ptrs[i])
 			continue;
 		buddy = kalloc_get_buddy_from_addr((uint64_t)ptrs[i]);
-		ASSERT_PANIC(buddy->buddy_memorder == memorders[i], "Buddy is not the past memorder");
+		ASSERT_PANIC(kalloc_get_buddy_memorder(buddy) == memorders[i], "Buddy is not the past memorder");
 		ret = kalloc_page_free_pages((uint64_t)ptrs[i], 0);
 		ASSERT_PANIC(!ret, "mm_free_pages failed");
 		_validate_mm_free((uint64_t)ptrs[i], memorders[i], vals[i]);
@@ -794,3 +818,1436 @@ void kalloc_test()
 
     DEBUG("--- Kalloc test end---");
 }
+
+void kalloc_pcp_test()
+{
+    DEBUG("--- Kalloc pcp test start ---");
+
+    #define PCP_TEST_NUM (KALLOC_PCP_HIGH + KALLOC_PCP_BATCH)
+
+    uint64_t * ptrs = (uint64_t *)mm_earlypage_alloc(1);
+    kalloc_pcp_t * pcp = kalloc_pcp_get(cpu_get_id(), 0, MM_TYPE_UNMOVABLE);
+    uint64_t page;
+    int ret = 0;
+
+    kalloc_pcp_drain_all();
+    ASSERT_PANIC(!pcp->count, "Pcp list not empty after drain.");
+
+    /* A refill leaves the rest of the batch on the list. */
+    page = kalloc_pcp_alloc(0, 0);
+    ASSERT_PANIC(page, "Pcp alloc failed.");
+    ASSERT_PANIC(pcp->count == KALLOC_PCP_BATCH - 1, "Pcp refill count wrong.");
+
+    /* Hot frees are handed back out first. */
+    ret = kalloc_pcp_free(page, 0, 0);
+    ASSERT_PANIC(!ret, "Pcp free failed.");
+    ptrs[0] = kalloc_pcp_alloc(0, 0);
+    ASSERT_PANIC(ptrs[0] == page, "Pcp hot page not reused.");
+
+    /* Cold frees go to the back of the line. */
+    ret = kalloc_pcp_free(page, 0, KALLOC_COLD_F);
+    ASSERT_PANIC(!ret, "Pcp cold free failed.");
+    ptrs[0] = kalloc_pcp_alloc(0, 0);
+    ASSERT_PANIC(ptrs[0] != page, "Pcp cold page reused.");
+    ret = kalloc_pcp_free(ptrs[0], 0, 0);
+    ASSERT_PANIC(!ret, "Pcp free failed.");
+
+    for (int i = 0; i < PCP_TEST_NUM; i++) {
+        ptrs[i] = kalloc_pcp_alloc(0, 0);
+        ASSERT_PANIC(ptrs[i], "Pcp alloc failed.");
+        *(uint64_t *)ptrs[i] = i;
+    }
+
+    for (int i = 0; i < PCP_TEST_NUM; i++) {
+        ASSERT_PANIC(*(uint64_t *)ptrs[i] == (uint64_t)i, "Pcp page data corrupted.");
+        ret = kalloc_pcp_free(ptrs[i], 0, 0);
+        ASSERT_PANIC(!ret, "Pcp free failed.");
+        ASSERT_PANIC(pcp->count <= pcp->high, "Pcp list grew past high watermark.");
+    }
+
+    ret = kalloc_pcp_drain_all();
+    ASSERT_PANIC(ret, "Pcp drain returned no pages.");
+    ASSERT_PANIC(!pcp->count, "Pcp list not empty after drain.");
+
+    DEBUG("--- Kalloc pcp test end ---");
+}
+
+static unsigned int _mm_free_page_num()
+{
+    unsigned int free_page_num = 0;
+
+    for (unsigned int i = 0; i < mm_global_area()->area_count; i++) {
+        free_page_num += mm_global_area()->global_areas[i].free_page_num;
+    }
+
+    return free_page_num;
+}
+
+void kalloc_page_bulk_test()
+{
+    DEBUG("--- Kalloc page bulk test start ---");
+
+    #define BULK_TEST_NUM 64
+
+    uint64_t * addrs = (uint64_t *)mm_earlypage_alloc(1);
+    unsigned int free_page_num;
+    unsigned int num;
+    int ret;
+
+    kalloc_pcp_drain_all();
+    free_page_num = _mm_free_page_num();
+
+    for (unsigned int memorder = 0; memorder < 4; memorder++) {
+        num = kalloc_page_alloc_bulk(memorder, BULK_TEST_NUM, addrs, 0);
+        ASSERT_PANIC(num == BULK_TEST_NUM, "Bulk alloc returned too few blocks.");
+        ASSERT_PANIC(_mm_free_page_num() == free_page_num - BULK_TEST_NUM * MM_MEMORDER_TO_PAGES(memorder), "Bulk alloc page count wrong.");
+
+        for (unsigned int i = 0; i < num; i++) {
+            ASSERT_PANIC(IS_ALIGNED(addrs[i], MM_MEMORDER_SIZE(memorder)), "Bulk alloc block not aligned.");
+            _validate_and_set_mm_alloc(addrs[i], memorder, i);
+        }
+
+        ret = kalloc_page_free_bulk(addrs, num, 0);
+        ASSERT_PANIC(!ret, "Bulk free failed.");
+        ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Bulk free page count wrong.");
+
+        for (unsigned int i = 0; i < num; i++) {
+            _validate_mm_free(addrs[i], memorder, i);
+        }
+    }
+
+    DEBUG("--- Kalloc page bulk test end ---");
+}
+
+void kalloc_page_range_test()
+{
+    DEBUG("--- Kalloc page range test start ---");
+
+    mm_area_t * area = NULL;
+    mm_global_area_t * global_area = mm_global_area();
+    unsigned int free_page_num;
+    unsigned int page_index;
+    unsigned int page_num;
+    uint64_t start;
+    int ret;
+
+    kalloc_pcp_drain_all();
+    free_page_num = _mm_free_page_num();
+
+    // Find two untouched areas next to each other so the range can cross between them
+    for (unsigned int i = 0; i + 1 < global_area->area_count; i++) {
+        if (global_area->global_areas[i].free_page_num == MM_AREA_PAGE_NUM &&
+            global_area->global_areas[i + 1].free_page_num == MM_AREA_PAGE_NUM) {
+            area = &global_area->global_areas[i];
+            break;
+        }
+    }
+
+    ASSERT_PANIC(area, "No free areas found for range test.");
+
+    // Odd start and end so every memorder gets used on both ends of the range
+    page_index = area->start_page_index + 3;
+    page_num = MM_AREA_PAGE_NUM + 6;
+    start = page_index * PAGE_SIZE;
+
+    ret = kalloc_page_reserve_range(start, page_num * PAGE_SIZE);
+    ASSERT_PANIC(!ret, "Reserve range failed.");
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num - page_num, "Reserve range page count wrong.");
+    ASSERT_PANIC(mm_pages_are_valid(page_index, page_num), "Reserve range pages not valid.");
+    ASSERT_PANIC(mm_pages_are_free(area->start_page_index, 3), "Reserve range took pages before the range.");
+    ASSERT_PANIC(mm_pages_are_free(page_index + page_num, 1), "Reserve range took pages after the range.");
+
+    // Overlapping an already reserved range fails and leaves nothing behind
+    ret = kalloc_page_reserve_range(start - (2 * PAGE_SIZE), 4 * PAGE_SIZE);
+    ASSERT_PANIC(ret, "Reserve range over reserved pages did not fail.");
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num - page_num, "Failed reserve range changed page count.");
+    ASSERT_PANIC(mm_pages_are_free(area->start_page_index, 3), "Failed reserve range kept pages.");
+
+    ret = kalloc_page_free_range(start, page_num * PAGE_SIZE);
+    ASSERT_PANIC(!ret, "Free range failed.");
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Free range page count wrong.");
+    ASSERT_PANIC(mm_pages_are_free(area->start_page_index, 2 * MM_AREA_PAGE_NUM), "Free range left pages valid.");
+
+    // The range should have coalesced back into whole max memorder buddies
+    kalloc_page_reserve_pages(area->phys_addr_start, MM_MAX_ORDER, 0);
+    kalloc_page_reserve_pages(area->phys_addr_start + MM_AREA_SIZE - MM_MEMORDER_SIZE(MM_MAX_ORDER), MM_MAX_ORDER, 0);
+    kalloc_page_free_pages(area->phys_addr_start, 0);
+    kalloc_page_free_pages(area->phys_addr_start + MM_AREA_SIZE - MM_MEMORDER_SIZE(MM_MAX_ORDER), 0);
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Range test page count wrong.");
+
+    DEBUG("--- Kalloc page range test end ---");
+}
+
+void kalloc_pages_exact_test()
+{
+    DEBUG("--- Kalloc pages exact test start ---");
+
+    static const unsigned int page_nums[] = {3, 4, 5, 6, 7, 13, 100, MM_MEMORDER_TO_PAGES(MM_MAX_ORDER) - 1};
+    #define EXACT_TEST_NUM (sizeof(page_nums) / sizeof(page_nums[0]))
+
+    uint64_t * pages[EXACT_TEST_NUM];
+    unsigned int free_page_num;
+    unsigned int page_index;
+    unsigned int page_num;
+    int ret;
+
+    kalloc_pcp_drain_all();
+    free_page_num = _mm_free_page_num();
+
+    // Every alloc takes exactly the pages asked for, powers of two are no longer doubled
+    page_num = 0;
+    for (unsigned int i = 0; i < EXACT_TEST_NUM; i++) {
+        pages[i] = (uint64_t *)kalloc_pages(page_nums[i], 0);
+        ASSERT_PANIC(pages[i], "Exact test alloc failed.");
+        page_num += page_nums[i];
+        ASSERT_PANIC(_mm_free_page_num() == free_page_num - page_num, "Exact test alloc page count wrong.");
+
+        page_index = mmu_get_phys_addr((uint64_t)pages[i]) / PAGE_SIZE;
+        ASSERT_PANIC(mm_pages_are_valid(page_index, page_nums[i]), "Exact test pages not valid.");
+        ASSERT_PANIC(mm_get_page_range_num(page_index) == (math_is_power2_64(page_nums[i]) ? 0 : page_nums[i]),
+                     "Exact test range num wrong.");
+        memset_64(pages[i], 0xDEADBEEF, page_nums[i] * PAGE_SIZE);
+    }
+
+    // Freeing every other alloc first leaves the trimmed tails next to freed neighbours
+    for (unsigned int i = 0; i < EXACT_TEST_NUM; i += 2) {
+        ret = kalloc_free(pages[i], 0);
+        ASSERT_PANIC(!ret, "Exact test free failed.");
+    }
+    for (unsigned int i = 1; i < EXACT_TEST_NUM; i += 2) {
+        ret = kalloc_free_pages(pages[i], 0);
+        ASSERT_PANIC(!ret, "Exact test free failed.");
+    }
+
+    kalloc_pcp_drain_all();
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Exact test free page count wrong.");
+
+    // Large kalloc_alloc sizes round up to whole pages only
+    pages[0] = (uint64_t *)kalloc_alloc(KALLOC_MAX_ENTRY_ALLOC + 2 * PAGE_SIZE, 0);
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num - 3, "Exact test kalloc alloc page count wrong.");
+    kalloc_free(pages[0], 0);
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Exact test kalloc free page count wrong.");
+
+    DEBUG("--- Kalloc pages exact test end ---");
+}
+
+static int _page_is_zero(uint64_t * ptr, unsigned int page_num)
+{
+    for (unsigned int i = 0; i < (page_num * PAGE_SIZE) / sizeof(uint64_t); i++) {
+        if (ptr[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+void kalloc_zero_test()
+{
+    DEBUG("--- Kalloc zero test start ---");
+
+    #define ZERO_TEST_NUM 8
+
+    kalloc_zero_pool_t * pool = kalloc_zero_pool();
+    uint64_t * pages[ZERO_TEST_NUM];
+    uint64_t hit_num;
+    unsigned int num;
+
+    kalloc_zero_drain();
+
+    // Dirty some pages so the pool has to actually zero whatever it gets back
+    for (unsigned int i = 0; i < ZERO_TEST_NUM; i++) {
+        pages[i] = (uint64_t *)kalloc_pages(1, 0);
+        memset_64(pages[i], 0xDEADBEEF, PAGE_SIZE);
+    }
+    for (unsigned int i = 0; i < ZERO_TEST_NUM; i++) {
+        kalloc_free_pages(pages[i], 0);
+    }
+
+    kalloc_pcp_drain_all();
+    num = kalloc_zero_fill(ZERO_TEST_NUM);
+    ASSERT_PANIC(num == ZERO_TEST_NUM && pool->count == ZERO_TEST_NUM, "Zero pool fill count wrong.");
+
+    hit_num = pool->hit_num;
+    for (unsigned int i = 0; i < ZERO_TEST_NUM; i++) {
+        pages[i] = (uint64_t *)kalloc_zero_alloc();
+        ASSERT_PANIC(pages[i], "Zero pool alloc failed.");
+        pages[i] = (uint64_t *)((uint64_t)pages[i] | MMU_UPPER_ADDRESS);
+        ASSERT_PANIC(_page_is_zero(pages[i], 1), "Zero pool page not zeroed.");
+        memset_64(pages[i], 0xDEADBEEF, PAGE_SIZE);
+    }
+    ASSERT_PANIC(pool->hit_num == hit_num + ZERO_TEST_NUM && !pool->count, "Zero pool hit count wrong.");
+
+    for (unsigned int i = 0; i < ZERO_TEST_NUM; i++) {
+        kalloc_free_pages(pages[i], 0);
+    }
+
+    // Single page kalloc_pages allocs are memorder 0 and are served from the pool
+    kalloc_pcp_drain_all();
+    num = kalloc_zero_fill(1);
+    ASSERT_PANIC(num == 1, "Zero pool refill failed.");
+    hit_num = pool->hit_num;
+    pages[0] = (uint64_t *)kalloc_pages(1, KALLOC_ZERO_F);
+    ASSERT_PANIC(pool->hit_num == hit_num + 1 && _page_is_zero(pages[0], 1), "Kalloc pages did not take the zero pool page.");
+    kalloc_free_pages(pages[0], 0);
+
+    // With the pool empty the pages have to be zeroed on the alloc path
+    for (unsigned int i = 0; i < ZERO_TEST_NUM; i++) {
+        pages[i] = (uint64_t *)kalloc_pages(1, KALLOC_ZERO_F);
+        ASSERT_PANIC(_page_is_zero(pages[i], 1), "Kalloc zero page not zeroed.");
+    }
+
+    for (unsigned int i = 0; i < ZERO_TEST_NUM; i++) {
+        memset_64(pages[i], 0xDEADBEEF, PAGE_SIZE);
+        kalloc_free_pages(pages[i], 0);
+    }
+
+    // Blocks past the pcp orders are zeroed by the page allocator
+    pages[0] = (uint64_t *)kalloc_pages(8, 0);
+    memset_64(pages[0], 0xDEADBEEF, 8 * PAGE_SIZE);
+    kalloc_free_pages(pages[0], 0);
+    pages[0] = (uint64_t *)kalloc_pages(8, KALLOC_ZERO_F);
+    ASSERT_PANIC(_page_is_zero(pages[0], 8), "Kalloc zero pages not zeroed.");
+    kalloc_free_pages(pages[0], 0);
+
+    DEBUG("--- Kalloc zero test end ---");
+}
+
+/* Initialized areas nothing is allocated from. */
+static unsigned int _type_test_free_area_num()
+{
+    mm_global_area_t * global_area = mm_global_area();
+    unsigned int num = 0;
+
+    for (unsigned int i = 0; i < global_area->area_count; i++) {
+        if (mm_area_is_initialized(&global_area->global_areas[i]) && global_area->global_areas[i].type == MM_TYPE_NONE)
+            num++;
+    }
+
+    return num;
+}
+
+void mm_type_test()
+{
+    DEBUG("--- MM type test start ---");
+
+    #define TYPE_TEST_NUM 16
+
+    static const flags_t type_flags[MM_TYPE_NUM] = {0, KALLOC_RECLAIMABLE_F};
+    uint64_t addrs[MM_TYPE_NUM][TYPE_TEST_NUM];
+    mm_area_t * areas[MM_TYPE_NUM];
+    unsigned int free_page_num;
+    unsigned int free_area_num;
+    unsigned int num;
+    int ret;
+
+    kalloc_pcp_drain_all();
+    kalloc_zero_drain();
+    free_page_num = _mm_free_page_num();
+    free_area_num = _type_test_free_area_num();
+
+    for (unsigned int type = 0; type < MM_TYPE_NUM; type++) {
+        num = kalloc_page_alloc_bulk(2, TYPE_TEST_NUM, &addrs[type][0], type_flags[type]);
+        ASSERT_PANIC(num == TYPE_TEST_NUM, "Type test alloc failed.");
+
+        areas[type] = mm_area_from_addr(addrs[type][0]);
+        for (unsigned int i = 0; i < num; i++) {
+            ASSERT_PANIC(mm_area_from_addr(addrs[type][i])->type == type, "Type test block in area of another type.");
+            ASSERT_PANIC(mm_get_page_type(addrs[type][i] / PAGE_SIZE) == type, "Type test page type wrong.");
+        }
+    }
+
+    ASSERT_PANIC(areas[MM_TYPE_UNMOVABLE] != areas[MM_TYPE_RECLAIMABLE], "Type test types share an area.");
+
+    ASSERT_PANIC(mm_frag_index(0) == MM_FRAG_INDEX_FREE, "Frag index with free pages not free.");
+    ASSERT_PANIC(mm_unusable_index(0) == 0, "Unusable index of memorder 0 not 0.");
+    mm_dump_frag();
+
+    for (unsigned int type = 0; type < MM_TYPE_NUM; type++) {
+        ret = kalloc_page_free_bulk(&addrs[type][0], TYPE_TEST_NUM, 0);
+        ASSERT_PANIC(!ret, "Type test free failed.");
+    }
+
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Type test page count wrong.");
+    // Any area the test claimed from the untouched ones should be free for any type again
+    ASSERT_PANIC(_type_test_free_area_num() == free_area_num, "Type test area not given back.");
+
+    DEBUG("--- MM type test end ---");
+}
+
+void kalloc_huge_test()
+{
+    DEBUG("--- Kalloc huge test start ---");
+
+    #define HUGE_TEST_NUM 4
+
+    void * ptrs[HUGE_TEST_NUM];
+    void * ptr;
+    uint64_t addr;
+    unsigned int free_page_num;
+    int ret;
+
+    kalloc_pcp_drain_all();
+    kalloc_zero_drain();
+    free_page_num = _mm_free_page_num();
+
+    for (unsigned int i = 0; i < HUGE_TEST_NUM; i++) {
+        ptrs[i] = kalloc_huge_pages(1, 0);
+        ASSERT_PANIC(ptrs[i], "Huge test alloc failed.");
+
+        addr = mmu_get_phys_addr((uint64_t)ptrs[i]);
+        ASSERT_PANIC(IS_ALIGNED(addr, MMU_LEVEL1_BLOCKSIZE), "Huge test block not aligned.");
+        ASSERT_PANIC(kalloc_is_huge_page(ptrs[i]), "Huge test page not marked huge.");
+        ASSERT_PANIC(kalloc_get_buddy_memorder(kalloc_get_buddy_from_addr(addr)) == MM_HUGE_MEMORDER,
+                     "Huge test block memorder wrong.");
+
+        // Touch both ends of the block
+        *(uint64_t *)ptrs[i] = i;
+        *(uint64_t *)((uint64_t)ptrs[i] + MM_HUGE_PAGE_SIZE - sizeof(uint64_t)) = i;
+    }
+
+    // Two huge pages come from one max order block
+    ptr = kalloc_huge_pages(2, KALLOC_ZERO_F);
+    ASSERT_PANIC(ptr, "Huge test double alloc failed.");
+    addr = mmu_get_phys_addr((uint64_t)ptr);
+    ASSERT_PANIC(IS_ALIGNED(addr, MM_HUGE_PAGE_SIZE * 2), "Huge test double block not aligned.");
+    ASSERT_PANIC(((uint64_t *)ptr)[(MM_HUGE_PAGE_SIZE * 2) / sizeof(uint64_t) - 1] == 0, "Huge test block not zeroed.");
+
+    ASSERT_PANIC(!kalloc_huge_pages(4, 0), "Huge test alloc larger than max order succeeded.");
+
+    for (unsigned int i = 0; i < HUGE_TEST_NUM; i++) {
+        ASSERT_PANIC(*(uint64_t *)ptrs[i] == i, "Huge test block overwritten.");
+        ret = kalloc_free_huge_pages(ptrs[i], 0);
+        ASSERT_PANIC(!ret, "Huge test free failed.");
+        ASSERT_PANIC(!kalloc_is_huge_page(ptrs[i]), "Huge test flag not cleared.");
+    }
+
+    ret = kalloc_free_huge_pages(ptr, 0);
+    ASSERT_PANIC(!ret, "Huge test double free failed.");
+
+    // Normal blocks are not huge pages and cannot be freed as one
+    ptr = kalloc_pages(4, 0);
+    ASSERT_PANIC(!kalloc_is_huge_page(ptr), "Huge test normal block marked huge.");
+    ASSERT_PANIC(kalloc_free_huge_pages(ptr, 0), "Huge test freed a normal block.");
+    kalloc_free_pages(ptr, 0);
+
+    kalloc_pcp_drain_all();
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Huge test page count wrong.");
+
+    DEBUG("--- Kalloc huge test end ---");
+}
+
+static unsigned int _compact_test_move_num;
+
+static void * _compact_test_page_allocator(unsigned int page_num, flags_t flags)
+{
+    (void)flags;
+
+    return (void *)kalloc_page_alloc_pages(mm_pages_to_memorder(page_num), KALLOC_RECLAIMABLE_F);
+}
+
+static int _compact_test_page_destructor(void * page_ptr, unsigned int page_num, flags_t flags)
+{
+    (void)page_num;
+    (void)flags;
+
+    return kalloc_page_free_pages(mmu_get_phys_addr((uint64_t)page_ptr), 0);
+}
+
+static void * _compact_test_move_pages(void * page_ptr, unsigned int page_num)
+{
+    (void)page_ptr;
+
+    _compact_test_move_num++;
+
+    return _compact_test_page_allocator(page_num, 0);
+}
+
+static void * _compact_test_keep_pages(void * page_ptr, unsigned int page_num)
+{
+    (void)page_ptr;
+    (void)page_num;
+
+    return NULL;
+}
+
+/* Empty slabs are rebuilt on the new pages with their page links, the slabs in use stay where they are. */
+static void kalloc_compact_move_test()
+{
+    kalloc_cache_t cache;
+    kalloc_slab_t * slab;
+    kalloc_slab_t * old_slab;
+    mm_area_t * area;
+    uint64_t free_page_num;
+    uint64_t addr;
+    void * obj;
+    unsigned int num;
+    int ret;
+
+    kalloc_pcp_drain_all();
+    free_page_num = _mm_free_page_num();
+    _compact_test_move_num = 0;
+
+    ret = kalloc_cache_init(&cache, 64, 1, _compact_test_page_allocator, _compact_test_page_destructor, 0);
+    ASSERT_PANIC(!ret, "Compact move test cache init failed.");
+    num = kalloc_cache_grow(&cache, 2);
+    ASSERT_PANIC(num == 2, "Compact move test grow failed.");
+
+    // The obj goes to the first slab, which leaves the other one empty
+    obj = kalloc_cache_alloc(&cache);
+    ASSERT_PANIC(obj && cache.page_num == 2, "Compact move test alloc failed.");
+    old_slab = STRUCT_P(ll_peek_first(&cache.free_list), kalloc_slab_t, node);
+
+    num = kalloc_cache_move_slabs(&cache, _compact_test_keep_pages);
+    ASSERT_PANIC(!num, "Compact move test moved a slab it was told to keep.");
+
+    num = kalloc_cache_move_slabs(&cache, _compact_test_move_pages);
+    ASSERT_PANIC(num == 1 && _compact_test_move_num == 1, "Compact move test did not move only the empty slab.");
+    ASSERT_PANIC(cache.page_num == 2 && cache.num == 1, "Compact move test cache counts changed.");
+
+    slab = STRUCT_P(ll_peek_first(&cache.free_list), kalloc_slab_t, node);
+    ASSERT_PANIC(slab != old_slab && !slab->num, "Compact move test slab not rebuilt.");
+    ASSERT_PANIC(mmu_get_phys_addr((uint64_t)mm_get_page_obj_ptr(PAGE_INDEX_FROM_PTR(slab))) == (uint64_t)slab,
+                 "Compact move test new page not linked.");
+    ASSERT_PANIC(!mm_page_is_valid(PAGE_INDEX_FROM_PTR(old_slab)), "Compact move test old page not freed.");
+
+    // Only the free blocks below the max memorder of a matching area are taken
+    area = mm_area_from_addr((uint64_t)slab);
+    ASSERT_PANIC(area->type == MM_TYPE_RECLAIMABLE, "Compact move test slab not in a reclaimable area.");
+    addr = kalloc_page_alloc_area_pages(area, 0, MM_MAX_ORDER + 1, 0);
+    ASSERT_PANIC(!addr, "Compact move test area alloc ignored the area type.");
+    addr = kalloc_page_alloc_area_pages(area, 0, MM_MAX_ORDER + 1, KALLOC_RECLAIMABLE_F);
+    ASSERT_PANIC(addr && mm_area_from_addr(addr) == area, "Compact move test area alloc failed.");
+    kalloc_page_free_pages(addr, 0);
+
+    ret = kalloc_cache_free(&cache, obj);
+    ASSERT_PANIC(!ret, "Compact move test free failed.");
+    num = kalloc_cache_shrink(&cache, KALLOC_RECLAIM_ALL);
+    ASSERT_PANIC(num == 2 && !cache.page_num, "Compact move test shrink failed.");
+
+    kalloc_pcp_drain_all();
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Compact move test page count wrong.");
+}
+
+void kalloc_compact_test()
+{
+    DEBUG("--- Kalloc compact test start ---");
+
+    #define COMPACT_TEST_PAGE_NUM 64
+
+    void * pages[COMPACT_TEST_PAGE_NUM];
+    kalloc_compact_stats_t stats = *kalloc_compact_stats();
+    uint64_t block_num;
+    unsigned int free_page_num;
+    unsigned int num;
+    int ret;
+
+    kalloc_pcp_drain_all();
+    kalloc_zero_drain();
+    kalloc_shrink_caches();
+    free_page_num = _mm_free_page_num();
+    block_num = mm_free_block_num(KALLOC_COMPACT_ORDER);
+
+    // Single pages freed through the pcp lists stay cached there and keep their buddies from coalescing
+    for (unsigned int i = 0; i < COMPACT_TEST_PAGE_NUM; i++) {
+        pages[i] = kalloc_pages(1, 0);
+        ASSERT_PANIC(pages[i], "Compact test alloc failed.");
+    }
+    for (unsigned int i = 0; i < COMPACT_TEST_PAGE_NUM; i++) {
+        ret = kalloc_free_pages(pages[i], 0);
+        ASSERT_PANIC(!ret, "Compact test free failed.");
+    }
+    ASSERT_PANIC(_mm_free_page_num() < free_page_num, "Compact test pages not cached in the pcp lists.");
+    ASSERT_PANIC(mm_free_block_num(KALLOC_COMPACT_ORDER) < block_num, "Compact test cached pages did not split a block.");
+
+    num = kalloc_compact(KALLOC_COMPACT_ORDER);
+    ASSERT_PANIC(num, "Compact test gained no blocks.");
+    ASSERT_PANIC(mm_free_block_num(KALLOC_COMPACT_ORDER) == block_num, "Compact test blocks not rebuilt.");
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Compact test page count wrong.");
+    ASSERT_PANIC(kalloc_compact_stats()->run_num == stats.run_num + 1 &&
+                 kalloc_compact_stats()->block_gain_num == stats.block_gain_num + num, "Compact test stats wrong.");
+
+    kalloc_compact_move_test();
+
+    kalloc_compact_dump();
+
+    DEBUG("--- Kalloc compact test end ---");
+}
+
+static unsigned int _reclaim_test_page_num;
+
+static unsigned int _reclaim_test_count(void * data)
+{
+    (void)data;
+
+    return _reclaim_test_page_num;
+}
+
+static unsigned int _reclaim_test_shrink(void * data, unsigned int page_num)
+{
+    unsigned int num = page_num < _reclaim_test_page_num ? page_num : _reclaim_test_page_num;
+
+    _reclaim_test_page_num -= num;
+    *(unsigned int *)data += 1;
+
+    return num;
+}
+
+void kalloc_reclaim_test()
+{
+    DEBUG("--- Kalloc reclaim test start ---");
+
+    #define RECLAIM_TEST_OBJ_NUM 512
+    static void * objs[RECLAIM_TEST_OBJ_NUM];
+    kalloc_shrinker_t shrinker;
+    mm_area_t * area;
+    unsigned int call_num = 0;
+    unsigned int num;
+    uint64_t free_page_num;
+
+    kalloc_pcp_drain_all();
+    kalloc_shrink_caches();
+    free_page_num = _mm_free_page_num();
+
+    area = &mm_global_area()->global_areas[0];
+    ASSERT_PANIC(area->wmark[MM_WMARK_MIN], "Reclaim test min wmark not set.");
+    ASSERT_PANIC(area->wmark[MM_WMARK_MIN] < area->wmark[MM_WMARK_LOW] &&
+                 area->wmark[MM_WMARK_LOW] < area->wmark[MM_WMARK_HIGH], "Reclaim test area wmarks out of order.");
+    ASSERT_PANIC(mm_wmark_page_num(MM_WMARK_MIN) && mm_wmark_page_num(MM_WMARK_HIGH) > mm_wmark_page_num(MM_WMARK_LOW), 
+                 "Reclaim test global wmarks wrong.");
+    ASSERT_PANIC(!mm_below_wmark(MM_WMARK_LOW), "Reclaim test below low wmark at start.");
+
+    // Nothing to do while we are over the low watermark
+    num = kalloc_reclaim_balance();
+    ASSERT_PANIC(!num, "Reclaim test balance reclaimed without pressure.");
+
+    // Only our shrinker has anything to give back after the caches were shrunk
+    _reclaim_test_page_num = 10;
+    shrinker.name = "reclaim test";
+    shrinker.count = _reclaim_test_count;
+    shrinker.shrink = _reclaim_test_shrink;
+    shrinker.data = &call_num;
+    kalloc_shrinker_register(&shrinker);
+
+    num = kalloc_reclaim(4);
+    ASSERT_PANIC(num == 4 && call_num == 1 && _reclaim_test_page_num == 6, "Reclaim test partial shrink wrong.");
+    num = kalloc_reclaim(KALLOC_RECLAIM_ALL);
+    ASSERT_PANIC(num == 6 && call_num == 2 && shrinker.freed_page_num == 10, "Reclaim test full shrink wrong.");
+    // The count says there is nothing left so the shrinker is skipped
+    num = kalloc_reclaim(KALLOC_RECLAIM_ALL);
+    ASSERT_PANIC(!num && call_num == 2, "Reclaim test empty shrinker called.");
+
+    kalloc_shrinker_unregister(&shrinker);
+    _reclaim_test_page_num = 10;
+    num = kalloc_reclaim(KALLOC_RECLAIM_ALL);
+    ASSERT_PANIC(!num && call_num == 2, "Reclaim test unregistered shrinker called.");
+
+    // Grow the caches and leave their slabs empty, the cache shrinker hands the pages back
+    for (unsigned int i = 0; i < RECLAIM_TEST_OBJ_NUM; i++) {
+        objs[i] = kalloc_alloc(16 << (i % 8), 0);
+        ASSERT_PANIC(objs[i], "Reclaim test alloc failed.");
+    }
+    for (unsigned int i = 0; i < RECLAIM_TEST_OBJ_NUM; i++) {
+        kalloc_free(objs[i], 0);
+    }
+
+    num = kalloc_reclaim(KALLOC_RECLAIM_ALL);
+    ASSERT_PANIC(num, "Reclaim test cache shrinker freed nothing.");
+
+    kalloc_pcp_drain_all();
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Reclaim test page count wrong.");
+
+    kalloc_reclaim_dump();
+
+    DEBUG("--- Kalloc reclaim test end ---");
+}
+
+void kalloc_mag_test()
+{
+    DEBUG("--- Kalloc mag test start ---");
+
+    /* Everything one cpu can hold, its two magazines and every magazine of the depot. */
+    #define MAG_TEST_CPU_NUM ((2 + KALLOC_MAG_DEPOT_NUM) * KALLOC_MAG_SIZE)
+    #define MAG_TEST_OBJ_NUM (MAG_TEST_CPU_NUM + 1)
+    #define MAG_TEST_PAGE_NUM 2
+    static kalloc_mag_cache_t mag_cache;
+    static void * objs[MAG_TEST_OBJ_NUM];
+    kalloc_cache_t cache;
+    kalloc_slab_t * slab;
+    kalloc_mag_cpu_t * cpu;
+    void * page_mem;
+    void * obj;
+    unsigned int num;
+    int ret;
+
+    page_mem = kalloc_pages(MAG_TEST_PAGE_NUM, 0);
+    ASSERT_PANIC(page_mem, "Mag test page alloc failed.");
+
+    ret = kalloc_cache_init(&cache, sizeof(uint64_t), MAG_TEST_PAGE_NUM, NULL, NULL,
+                            KALLOC_CACHE_NO_EXPAND_F | KALLOC_CACHE_NO_SHRINK_F);
+    ASSERT_PANIC(!ret, "Mag test cache init failed.");
+    // Slab pages are linked to their cache by page index, so the slab is given the phys addr like the kalloc caches
+    slab = kalloc_cache_add_slab_pages(&cache, (void *)mmu_get_phys_addr((uint64_t)page_mem), MAG_TEST_PAGE_NUM);
+    ASSERT_PANIC(slab, "Mag test add slab failed.");
+    ASSERT_PANIC(cache.max_num >= MAG_TEST_OBJ_NUM, "Mag test cache too small.");
+
+    kalloc_mag_cache_init(&mag_cache, &cache);
+    cpu = &mag_cache.cpus[cpu_get_id()];
+    ASSERT_PANIC(mag_cache.empty_num == KALLOC_MAG_DEPOT_NUM && !mag_cache.full_num, "Mag test depot init wrong.");
+
+    // Nothing has been freed to the magazines yet
+    obj = kalloc_mag_alloc(&mag_cache);
+    ASSERT_PANIC(!obj && cpu->alloc_miss_num == 1, "Mag test empty alloc did not miss.");
+
+    for (unsigned int i = 0; i < MAG_TEST_OBJ_NUM; i++) {
+        objs[i] = kalloc_cache_alloc(&cache);
+        ASSERT_PANIC(objs[i], "Mag test cache alloc failed.");
+    }
+
+    // Fill the cpu magazines and then every empty magazine of the depot
+    for (unsigned int i = 0; i < MAG_TEST_CPU_NUM; i++) {
+        ret = kalloc_mag_free(&mag_cache, objs[i]);
+        ASSERT_PANIC(!ret, "Mag test free not taken by a magazine.");
+    }
+    ASSERT_PANIC(mag_cache.full_num == KALLOC_MAG_DEPOT_NUM && !mag_cache.empty_num, "Mag test depot not full.");
+    ASSERT_PANIC(mag_cache.exchange_num == KALLOC_MAG_DEPOT_NUM, "Mag test exchange num wrong.");
+
+    ret = kalloc_mag_free(&mag_cache, objs[MAG_TEST_CPU_NUM]);
+    ASSERT_PANIC(ret && cpu->free_miss_num == 1, "Mag test free into full depot did not miss.");
+    ret = kalloc_cache_free(&cache, objs[MAG_TEST_CPU_NUM]);
+    ASSERT_PANIC(!ret, "Mag test cache free failed.");
+
+    // Objects come back out last in first out, the most recently freed are the cache hot ones
+    for (unsigned int i = MAG_TEST_CPU_NUM; i > 0; i--) {
+        obj = kalloc_mag_alloc(&mag_cache);
+        ASSERT_PANIC(obj == objs[i - 1], "Mag test alloc not lifo.");
+    }
+    obj = kalloc_mag_alloc(&mag_cache);
+    ASSERT_PANIC(!obj && cpu->alloc_miss_num == 2, "Mag test drained alloc did not miss.");
+    ASSERT_PANIC(cpu->alloc_num == MAG_TEST_CPU_NUM && cpu->free_num == MAG_TEST_CPU_NUM, "Mag test cpu stats wrong.");
+
+    for (unsigned int i = 0; i < MAG_TEST_CPU_NUM; i++) {
+        ret = kalloc_mag_free(&mag_cache, objs[i]);
+        ASSERT_PANIC(!ret, "Mag test refree not taken by a magazine.");
+    }
+
+    // Drain in small batches so a depot magazine is left partly taken between calls
+    num = 0;
+    while ((ret = kalloc_mag_drain(&mag_cache, &objs[0], KALLOC_MAG_SIZE - 1))) {
+        num += ret;
+        while (ret) {
+            ret--;
+            ASSERT_PANIC(objs[ret], "Mag test drained a NULL obj.");
+            kalloc_cache_free(&cache, objs[ret]);
+        }
+    }
+    ASSERT_PANIC(num == MAG_TEST_CPU_NUM, "Mag test drain num wrong.");
+    ASSERT_PANIC(!cache.num, "Mag test cache not empty after drain.");
+    ASSERT_PANIC(mag_cache.empty_num == KALLOC_MAG_DEPOT_NUM && !mag_cache.full_num, "Mag test depot not emptied.");
+
+    ret = kalloc_cache_remove_slab(&cache, slab);
+    ASSERT_PANIC(!ret, "Mag test remove slab failed.");
+    ret = kalloc_free_pages(page_mem, 0);
+    ASSERT_PANIC(!ret, "Mag test page free failed.");
+
+    DEBUG("--- Kalloc mag test end ---");
+}
+
+void kalloc_mag_remote_test()
+{
+    DEBUG("--- Kalloc mag remote test start ---");
+
+    #define REMOTE_TEST_OBJ_NUM (KALLOC_MAG_REMOTE_MAX + 1)
+    #define REMOTE_TEST_PAGE_NUM 2
+    static kalloc_mag_cache_t mag_cache;
+    static void * objs[REMOTE_TEST_OBJ_NUM];
+    kalloc_mag_remote_t remote;
+    kalloc_cache_t cache;
+    kalloc_slab_t * slab;
+    kalloc_mag_cpu_t * cpu;
+    unsigned int cpu_id = cpu_get_id();
+    unsigned int other_cpu = (cpu_id + 1) % CORE_NUM;
+    void * page_mem;
+    void * obj;
+    unsigned int num;
+    int ret;
+
+    page_mem = kalloc_pages(REMOTE_TEST_PAGE_NUM, 0);
+    ASSERT_PANIC(page_mem, "Remote test page alloc failed.");
+
+    ret = kalloc_cache_init(&cache, sizeof(uint64_t), REMOTE_TEST_PAGE_NUM, NULL, NULL,
+                            KALLOC_CACHE_NO_EXPAND_F | KALLOC_CACHE_NO_SHRINK_F);
+    ASSERT_PANIC(!ret, "Remote test cache init failed.");
+    slab = kalloc_cache_add_slab_pages(&cache, (void *)mmu_get_phys_addr((uint64_t)page_mem), REMOTE_TEST_PAGE_NUM);
+    ASSERT_PANIC(slab && cache.max_num >= REMOTE_TEST_OBJ_NUM, "Remote test add slab failed.");
+
+    kalloc_mag_cache_init(&mag_cache, &cache);
+    cpu = &mag_cache.cpus[cpu_id];
+
+    for (unsigned int i = 0; i < REMOTE_TEST_OBJ_NUM; i++) {
+        objs[i] = kalloc_cache_alloc(&cache);
+        ASSERT_PANIC(objs[i], "Remote test cache alloc failed.");
+    }
+
+    ASSERT_PANIC(kalloc_mag_remote_free(&mag_cache, objs[0], cpu_id), "Remote test pushed an obj we own.");
+
+    // Frees of the objs another cpu owns go on its list until the list is full
+    for (unsigned int i = 0; i < REMOTE_TEST_OBJ_NUM - 1; i++) {
+        ret = kalloc_mag_remote_free(&mag_cache, objs[i], other_cpu);
+        ASSERT_PANIC(!ret, "Remote test remote free failed.");
+    }
+    ASSERT_PANIC(mag_cache.remotes[other_cpu].num == KALLOC_MAG_REMOTE_MAX && cpu->remote_free_num == KALLOC_MAG_REMOTE_MAX,
+                 "Remote test remote num wrong.");
+    ret = kalloc_mag_remote_free(&mag_cache, objs[REMOTE_TEST_OBJ_NUM - 1], other_cpu);
+    ASSERT_PANIC(ret && mag_cache.remotes[other_cpu].num == KALLOC_MAG_REMOTE_MAX, "Remote test full list took a free.");
+    ret = kalloc_cache_free(&cache, objs[REMOTE_TEST_OBJ_NUM - 1]);
+    ASSERT_PANIC(!ret, "Remote test cache free failed.");
+
+    ASSERT_PANIC(!kalloc_mag_alloc(&mag_cache), "Remote test took the list of another cpu.");
+
+    // We can not run on the other cpu here, so hand its list over to ours to see the owner take it back
+    remote = mag_cache.remotes[cpu_id];
+    mag_cache.remotes[cpu_id] = mag_cache.remotes[other_cpu];
+    mag_cache.remotes[other_cpu] = remote;
+
+    // The whole list is taken as one batch on the next alloc and handed out before the magazines, last free first
+    for (unsigned int i = 0; i < KALLOC_MAG_SIZE; i++) {
+        obj = kalloc_mag_alloc(&mag_cache);
+        ASSERT_PANIC(obj == objs[REMOTE_TEST_OBJ_NUM - 2 - i], "Remote test batch obj wrong.");
+        kalloc_cache_free(&cache, obj);
+    }
+    ASSERT_PANIC(cpu->remote_reclaim_num == 1 && !mag_cache.remotes[cpu_id].list, "Remote test list not taken whole.");
+    ASSERT_PANIC(mag_cache.remotes[cpu_id].num == KALLOC_MAG_REMOTE_MAX, "Remote test num dropped before the batch was used up.");
+
+    // Drain takes the rest of the batch
+    num = 0;
+    while ((ret = kalloc_mag_drain(&mag_cache, &objs[0], KALLOC_MAG_SIZE - 1))) {
+        num += ret;
+        while (ret) {
+            ret--;
+            kalloc_cache_free(&cache, objs[ret]);
+        }
+    }
+    ASSERT_PANIC(num == KALLOC_MAG_REMOTE_MAX - KALLOC_MAG_SIZE && !mag_cache.remotes[cpu_id].num && !cpu->remote_batch,
+                 "Remote test drain num wrong.");
+    ASSERT_PANIC(!cache.num, "Remote test cache not empty after drain.");
+
+    ret = kalloc_cache_remove_slab(&cache, slab);
+    ASSERT_PANIC(!ret, "Remote test remove slab failed.");
+    ret = kalloc_free_pages(page_mem, 0);
+    ASSERT_PANIC(!ret, "Remote test page free failed.");
+
+    DEBUG("--- Kalloc mag remote test end ---");
+}
+
+void kalloc_cache_lookup_test()
+{
+    DEBUG("--- Kalloc cache lookup test start ---");
+
+    #define LOOKUP_TEST_SLAB_NUM 8
+    #define LOOKUP_TEST_OBJ_SIZE 64
+    #define LOOKUP_TEST_BIG_OBJ_SIZE 8
+    #define LOOKUP_TEST_BIG_PAGE_NUM 8
+    // Sized for the big slab, which holds more objs than all of the single page ones
+    static void * objs[LOOKUP_TEST_BIG_PAGE_NUM * (PAGE_SIZE / LOOKUP_TEST_BIG_OBJ_SIZE)];
+    void * pages[LOOKUP_TEST_SLAB_NUM];
+    kalloc_slab_t * slabs[LOOKUP_TEST_SLAB_NUM];
+    kalloc_slab_t * slab;
+    kalloc_cache_t cache;
+    unsigned int num;
+    int ret;
+
+    for (unsigned int link = 0; link < 2; link++) {
+        ret = kalloc_cache_init(&cache, LOOKUP_TEST_OBJ_SIZE, 1, NULL, NULL, KALLOC_CACHE_NO_EXPAND_F | KALLOC_CACHE_NO_SHRINK_F |
+                                (link ? 0 : KALLOC_CACHE_NO_LINK_F));
+        ASSERT_PANIC(!ret, "Lookup test cache init failed.");
+
+        for (unsigned int i = 0; i < LOOKUP_TEST_SLAB_NUM; i++) {
+            pages[i] = kalloc_pages(1, 0);
+            ASSERT_PANIC(pages[i], "Lookup test page alloc failed.");
+            slabs[i] = kalloc_cache_add_slab_pages(&cache, (void *)mmu_get_phys_addr((uint64_t)pages[i]), 1);
+            ASSERT_PANIC(slabs[i] && slabs[i]->cache == &cache, "Lookup test slab not linked to cache.");
+        }
+
+        num = cache.max_num;
+        ASSERT_PANIC(num <= LOOKUP_TEST_SLAB_NUM * (PAGE_SIZE / LOOKUP_TEST_OBJ_SIZE), "Lookup test too many objs.");
+        for (unsigned int i = 0; i < num; i++) {
+            objs[i] = kalloc_cache_alloc(&cache);
+            ASSERT_PANIC(objs[i], "Lookup test alloc failed.");
+
+            if (!link)
+                continue;
+
+            // The page obj of any page in the slab is the slab itself
+            slab = mm_get_page_obj_ptr(PAGE_INDEX_FROM_PTR(objs[i]));
+            ASSERT_PANIC(slab && slab->cache == &cache, "Lookup test page obj not the slab.");
+            ASSERT_PANIC(PTR_IN_RANGE(objs[i], slab->mem_ptr, slab->obj_size * slab->max_num), "Lookup test obj not in its page slab.");
+        }
+
+        // Free every other obj first so the slabs move through the partial list
+        for (unsigned int i = 0; i < num; i += 2) {
+            ret = kalloc_cache_free(&cache, objs[i]);
+            ASSERT_PANIC(!ret, "Lookup test free failed.");
+        }
+        for (unsigned int i = 1; i < num; i += 2) {
+            ret = kalloc_cache_free(&cache, objs[i]);
+            ASSERT_PANIC(!ret, "Lookup test free failed.");
+        }
+        ASSERT_PANIC(!cache.num && ll_list_size(&cache.free_list) == LOOKUP_TEST_SLAB_NUM, "Lookup test cache not empty.");
+
+        for (unsigned int i = 0; i < LOOKUP_TEST_SLAB_NUM; i++) {
+            ret = kalloc_cache_remove_slab(&cache, slabs[i]);
+            ASSERT_PANIC(!ret && !slabs[i]->cache, "Lookup test remove slab failed.");
+            ASSERT_PANIC(!mm_get_page_obj_ptr(PAGE_INDEX_FROM_PTR(mmu_get_phys_addr((uint64_t)pages[i]))), "Lookup test page still linked.");
+            ret = kalloc_free_pages(pages[i], 0);
+            ASSERT_PANIC(!ret, "Lookup test page free failed.");
+        }
+    }
+
+    // Enough small objs that their free indexs push the objs off the first page, every page from the slab struct on is linked
+    ret = kalloc_cache_init(&cache, LOOKUP_TEST_BIG_OBJ_SIZE, LOOKUP_TEST_BIG_PAGE_NUM, NULL, NULL,
+                            KALLOC_CACHE_NO_EXPAND_F | KALLOC_CACHE_NO_SHRINK_F);
+    ASSERT_PANIC(!ret, "Lookup test big cache init failed.");
+
+    pages[0] = kalloc_pages(LOOKUP_TEST_BIG_PAGE_NUM, 0);
+    ASSERT_PANIC(pages[0], "Lookup test big page alloc failed.");
+    slab = kalloc_cache_add_slab_pages(&cache, (void *)mmu_get_phys_addr((uint64_t)pages[0]), LOOKUP_TEST_BIG_PAGE_NUM);
+    ASSERT_PANIC(slab, "Lookup test big add slab failed.");
+    ASSERT_PANIC(PAGE_INDEX_FROM_PTR(slab->mem_ptr) != PAGE_INDEX_FROM_PTR(slab), "Lookup test big objs start on the slab page.");
+    ASSERT_PANIC(slab->max_num <= sizeof(objs) / sizeof(objs[0]), "Lookup test big too many objs.");
+
+    for (unsigned int i = 0; i < LOOKUP_TEST_BIG_PAGE_NUM; i++) {
+        ASSERT_PANIC(mm_get_page_obj_ptr(PAGE_INDEX_FROM_PTR(slab) + i) == slab, "Lookup test big page not linked.");
+    }
+    ASSERT_PANIC(mm_get_page_obj_ptr(PAGE_INDEX_FROM_PTR(slab) + LOOKUP_TEST_BIG_PAGE_NUM) != slab, "Lookup test big page past the slab linked.");
+
+    num = slab->max_num;
+    for (unsigned int i = 0; i < num; i++) {
+        objs[i] = kalloc_cache_alloc(&cache);
+        ASSERT_PANIC(objs[i], "Lookup test big alloc failed.");
+    }
+    for (unsigned int i = 0; i < num; i++) {
+        ret = kalloc_cache_free(&cache, objs[i]);
+        ASSERT_PANIC(!ret, "Lookup test big free failed.");
+    }
+
+    ret = kalloc_cache_remove_slab(&cache, slab);
+    ASSERT_PANIC(!ret, "Lookup test big remove slab failed.");
+    for (unsigned int i = 0; i < LOOKUP_TEST_BIG_PAGE_NUM; i++) {
+        ASSERT_PANIC(!mm_get_page_obj_ptr(PAGE_INDEX_FROM_PTR(slab) + i), "Lookup test big page still linked.");
+    }
+    ret = kalloc_free_pages(pages[0], 0);
+    ASSERT_PANIC(!ret, "Lookup test big page free failed.");
+
+    DEBUG("--- Kalloc cache lookup test end ---");
+}
+
+void kalloc_entry_test()
+{
+    DEBUG("--- Kalloc entry test start ---");
+
+    kalloc_entry_stats_t stats;
+    kalloc_entry_stats_t prev_stats;
+    kalloc_entry_stats_t start_stats;
+    unsigned int entry_num;
+    void * obj;
+    int ret;
+
+    // Every size goes to the smallest class it fits in
+    for (size_t size = 1; size <= KALLOC_MAX_ENTRY_ALLOC; size++) {
+        entry_num = kalloc_entry_num(size);
+        kalloc_entry_stats(entry_num, &stats);
+        ASSERT_PANIC(stats.size >= size, "Entry test class too small.");
+
+        if (!entry_num)
+            continue;
+
+        kalloc_entry_stats(entry_num - 1, &prev_stats);
+        ASSERT_PANIC(prev_stats.size < size, "Entry test class not the smallest fit.");
+    }
+
+    entry_num = kalloc_entry_num(24);
+    kalloc_entry_stats(entry_num, &stats);
+    ASSERT_PANIC(stats.size == 24, "Entry test 24 byte class missing.");
+
+    // A 130 byte obj lands in the 192 byte class and the rounding shows up as waste
+    entry_num = kalloc_entry_num(130);
+    kalloc_entry_stats(entry_num, &start_stats);
+    ASSERT_PANIC(start_stats.size == 192, "Entry test 130 bytes not in the 192 class.");
+
+    obj = kalloc_alloc(130, 0);
+    ASSERT_PANIC(obj, "Entry test alloc failed.");
+    memset(obj, 0xab, 130);
+
+    kalloc_entry_stats(entry_num, &stats);
+#ifdef KALLOC_PROFILE
+    ASSERT_PANIC(stats.alloc_num == start_stats.alloc_num + 1, "Entry test alloc not counted.");
+    ASSERT_PANIC(stats.req_size == start_stats.req_size + 130, "Entry test requested size wrong.");
+    ASSERT_PANIC(stats.waste_size == start_stats.waste_size + 192 - 130, "Entry test waste size wrong.");
+#else
+    ASSERT_PANIC(stats.alloc_num == start_stats.alloc_num, "Entry test alloc counted outside of a profile build.");
+#endif
+
+    ret = kalloc_free(obj, 0);
+    ASSERT_PANIC(!ret, "Entry test free failed.");
+
+    // The largest class is still served by a cache and not whole pages
+    obj = kalloc_alloc(KALLOC_MAX_ENTRY_ALLOC, 0);
+    ASSERT_PANIC(obj && !IS_ALIGNED((uint64_t)obj, PAGE_SIZE), "Entry test max entry alloc not from a cache.");
+    ret = kalloc_free(obj, 0);
+    ASSERT_PANIC(!ret, "Entry test max entry free failed.");
+
+    kalloc_entry_dump();
+
+    DEBUG("--- Kalloc entry test end ---");
+}
+
+static unsigned int _grow_test_alloc_num;
+static unsigned int _grow_test_free_num;
+static unsigned int _grow_test_fail;
+static unsigned int _grow_test_fail_num;
+
+static void * _grow_test_page_allocator(unsigned int page_num, flags_t flags)
+{
+    void * page_ptr;
+
+    (void)flags;
+
+    if (_grow_test_fail) {
+        _grow_test_fail_num++;
+        return NULL;
+    }
+
+    page_ptr = kalloc_pages(page_num, 0);
+
+    if (!page_ptr)
+        return NULL;
+
+    _grow_test_alloc_num++;
+    // Slab pages are linked by page index, give the cache the phys addr
+    return (void *)mmu_get_phys_addr((uint64_t)page_ptr);
+}
+
+static int _grow_test_page_destructor(void * page_ptr, unsigned int page_num, flags_t flags)
+{
+    (void)page_num;
+    (void)flags;
+
+    _grow_test_free_num++;
+    return kalloc_free_pages(page_ptr, 0);
+}
+
+void kalloc_cache_grow_test()
+{
+    DEBUG("--- Kalloc cache grow test start ---");
+
+    #define GROW_TEST_OBJ_NUM 512
+    static void * objs[GROW_TEST_OBJ_NUM];
+    static void * fail_objs[GROW_TEST_OBJ_NUM];
+    kalloc_cache_t cache;
+    kalloc_slab_t * slab;
+    uint64_t free_page_num;
+    unsigned int num;
+    unsigned int fail_num = 0;
+    int ret;
+
+    kalloc_pcp_drain_all();
+    free_page_num = _mm_free_page_num();
+    _grow_test_alloc_num = 0;
+    _grow_test_free_num = 0;
+    _grow_test_fail = 0;
+    _grow_test_fail_num = 0;
+
+    ret = kalloc_cache_init(&cache, 64, 1, _grow_test_page_allocator, _grow_test_page_destructor, 0);
+    ASSERT_PANIC(!ret, "Grow test cache init failed.");
+
+    // The cache grows before it fills up, so an alloc never finds it full
+    for (unsigned int i = 0; i < GROW_TEST_OBJ_NUM; i++) {
+        objs[i] = kalloc_cache_alloc(&cache);
+        ASSERT_PANIC(objs[i], "Grow test alloc failed.");
+        ASSERT_PANIC(cache.num < cache.max_num, "Grow test cache not grown ahead of demand.");
+    }
+    ASSERT_PANIC(_grow_test_alloc_num == cache.page_num, "Grow test page allocator count wrong.");
+
+    // A failed grow ahead is not retried on every alloc, only the alloc that finds the cache full tries again
+    _grow_test_fail = 1;
+    while ((fail_objs[fail_num] = kalloc_cache_alloc(&cache))) {
+        fail_num++;
+        ASSERT_PANIC(fail_num < GROW_TEST_OBJ_NUM, "Grow test cache grew with a failing page allocator.");
+    }
+    ASSERT_PANIC(cache.num == cache.max_num && _grow_test_fail_num == 2, "Grow test grow ahead retried after failing.");
+
+    // A free clears the failure, so the next alloc over the threshold grows ahead again
+    fail_num--;
+    ret = kalloc_cache_free(&cache, fail_objs[fail_num]);
+    ASSERT_PANIC(!ret && !cache.grow_failed, "Grow test free did not clear the grow failure.");
+    fail_objs[fail_num] = kalloc_cache_alloc(&cache);
+    ASSERT_PANIC(fail_objs[fail_num] && _grow_test_fail_num == 3, "Grow test did not grow ahead after a free.");
+    fail_num++;
+    _grow_test_fail = 0;
+
+    for (unsigned int i = 0; i < fail_num; i++) {
+        ret = kalloc_cache_free(&cache, fail_objs[i]);
+        ASSERT_PANIC(!ret, "Grow test free failed.");
+    }
+
+    for (unsigned int i = 0; i < GROW_TEST_OBJ_NUM; i++) {
+        ret = kalloc_cache_free(&cache, objs[i]);
+        ASSERT_PANIC(!ret, "Grow test free failed.");
+    }
+    ASSERT_PANIC(kalloc_cache_free_page_num(&cache) == cache.page_num, "Grow test slabs not empty.");
+
+    // Empty slabs are kept for a few reap passes in case the objects are needed again
+    for (unsigned int i = 1; i < cache.reap_delay; i++) {
+        num = kalloc_cache_reap(&cache);
+        ASSERT_PANIC(!num, "Grow test reaped before the delay.");
+    }
+    num = kalloc_cache_reap(&cache);
+    ASSERT_PANIC(num == _grow_test_alloc_num && !cache.page_num && !cache.max_num, "Grow test reap did not free the slabs.");
+    ASSERT_PANIC(_grow_test_free_num == _grow_test_alloc_num, "Grow test page destructor count wrong.");
+
+    // Removing a slab gives its pages back through the destructor
+    num = kalloc_cache_grow(&cache, 1);
+    ASSERT_PANIC(num == 1, "Grow test grow failed.");
+    slab = STRUCT_P(ll_peek_first(&cache.free_list), kalloc_slab_t, node);
+    ret = kalloc_cache_remove_slab(&cache, slab);
+    ASSERT_PANIC(!ret && _grow_test_free_num == _grow_test_alloc_num, "Grow test remove slab did not free pages.");
+
+    kalloc_pcp_drain_all();
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Grow test page count wrong.");
+
+    DEBUG("--- Kalloc cache grow test end ---");
+}
+
+void kalloc_slab_format_test()
+{
+    DEBUG("--- Kalloc slab format test start ---");
+
+    #define SLAB_FORMAT_TEST_PAGE_NUM 8
+    static const size_t sizes[] = {16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072};
+    kalloc_slab_t * slab;
+    void * page_mem;
+    void * page_obj;
+    void * obj;
+    size_t mem_size;
+    unsigned int num;
+
+    // The closed form count is the most objs that fit next to the header
+    for (unsigned int page_num = 1; page_num <= SLAB_FORMAT_TEST_PAGE_NUM; page_num *= 2) {
+        mem_size = page_num * PAGE_SIZE;
+        for (unsigned int i = 0; i < sizeof(sizes) / sizeof(size_t); i++) {
+            num = kalloc_slab_inline_obj_num_pages(sizes[i], page_num);
+            if (!num)
+                continue;
+
+            ASSERT_PANIC(kalloc_slab_total_size(num, sizes[i]) <= mem_size, "Slab format test too many objs.");
+            ASSERT_PANIC(kalloc_slab_total_size(num + 1, sizes[i]) > mem_size, "Slab format test objs left out.");
+        }
+    }
+
+    // The header no longer rounds up to a whole large obj
+    num = kalloc_slab_inline_obj_num_pages(2048, SLAB_FORMAT_TEST_PAGE_NUM);
+    ASSERT_PANIC(num == (SLAB_FORMAT_TEST_PAGE_NUM * PAGE_SIZE) / 2048 - 1, "Slab format test 2048 obj num wrong.");
+
+    page_mem = kalloc_pages(1, 0);
+    ASSERT_PANIC(page_mem, "Slab format test page alloc failed.");
+
+    slab = kalloc_slab_init(NULL, page_mem, 1, 64, 0);
+    ASSERT_PANIC(slab && slab->max_num == kalloc_slab_inline_obj_num_pages(64, 1), "Slab format test init failed.");
+
+    // Every obj can be handed out, none is kept back for the free index overflow
+    for (unsigned int i = 0; i < slab->max_num; i++) {
+        obj = kalloc_slab_alloc(slab);
+        ASSERT_PANIC(IS_ALIGNED((uint64_t)obj, 64), "Slab format test obj not aligned.");
+        ASSERT_PANIC((uint64_t)obj + 64 <= (uint64_t)page_mem + PAGE_SIZE, "Slab format test obj out of the page.");
+    }
+    ASSERT_PANIC(slab->num == slab->max_num && slab->free_index == KALLOC_SLAB_FREE_END, "Slab format test full slab wrong.");
+
+    obj = slab->mem_ptr + 64 * (slab->max_num - 1);
+    kalloc_slab_free(slab, obj);
+    page_obj = kalloc_slab_alloc(slab);
+    ASSERT_PANIC(page_obj == obj, "Slab format test last obj not reused.");
+
+    kalloc_free_pages(page_mem, 0);
+
+    DEBUG("--- Kalloc slab format test end ---");
+}
+
+void kalloc_cache_color_test()
+{
+    DEBUG("--- Kalloc cache color test start ---");
+
+    #define COLOR_TEST_OBJ_SIZE 512
+    #define COLOR_TEST_SLAB_NUM 16
+    kalloc_slab_t * slabs[COLOR_TEST_SLAB_NUM];
+    void * pages[COLOR_TEST_SLAB_NUM];
+    kalloc_cache_t cache;
+    uint64_t first_offset;
+    uint64_t offset;
+    void * obj;
+    int ret;
+
+    for (unsigned int color = 0; color < 2; color++) {
+        ret = kalloc_cache_init(&cache, COLOR_TEST_OBJ_SIZE, 1, NULL, NULL, KALLOC_CACHE_NO_EXPAND_F | KALLOC_CACHE_NO_SHRINK_F |
+                                (color ? 0 : KALLOC_CACHE_NO_COLOR_F));
+        ASSERT_PANIC(!ret, "Color test cache init failed.");
+        ASSERT_PANIC(color ? cache.color_num > 1 : !cache.color_num, "Color test color num wrong.");
+
+        for (unsigned int i = 0; i < COLOR_TEST_SLAB_NUM; i++) {
+            pages[i] = kalloc_pages(1, 0);
+            ASSERT_PANIC(pages[i], "Color test page alloc failed.");
+            slabs[i] = kalloc_cache_add_slab_pages(&cache, (void *)mmu_get_phys_addr((uint64_t)pages[i]), 1);
+            ASSERT_PANIC(slabs[i], "Color test add slab failed.");
+
+            // Colored slabs cycle through the offsets a cache line at a time, the others all start at the first one
+            offset = (uint64_t)slabs[i]->mem_ptr - (uint64_t)slabs[i];
+            if (!i)
+                first_offset = offset;
+
+            if (color) {
+                ASSERT_PANIC(offset == first_offset + (i % cache.color_num) * KALLOC_CACHE_LINE_SIZE, "Color test slab offset wrong.");
+            } else {
+                ASSERT_PANIC(offset == first_offset, "Color test uncolored slab offset moved.");
+            }
+            ASSERT_PANIC((uint64_t)slabs[i]->mem_ptr + slabs[i]->max_num * COLOR_TEST_OBJ_SIZE <= (uint64_t)slabs[i] + PAGE_SIZE,
+                         "Color test objs past the slab.");
+        }
+
+        for (unsigned int i = 0; i < COLOR_TEST_SLAB_NUM; i++) {
+            ret = kalloc_cache_remove_slab(&cache, slabs[i]);
+            ASSERT_PANIC(!ret, "Color test remove slab failed.");
+            kalloc_free_pages(pages[i], 0);
+        }
+    }
+
+    // Cache line aligned caches round small objs up to a whole line, unlinked as the slab pages are freed full
+    ret = kalloc_cache_init(&cache, 24, 1, NULL, NULL, KALLOC_CACHE_NO_EXPAND_F | KALLOC_CACHE_NO_SHRINK_F | 
+                            KALLOC_CACHE_NO_LINK_F | KALLOC_CACHE_HWCACHE_ALIGN_F);
+    ASSERT_PANIC(!ret && cache.obj_size == KALLOC_CACHE_LINE_SIZE, "Color test hwcache align size wrong.");
+
+    pages[0] = kalloc_pages(1, 0);
+    ASSERT_PANIC(pages[0], "Color test page alloc failed.");
+    slabs[0] = kalloc_cache_add_slab_pages(&cache, (void *)mmu_get_phys_addr((uint64_t)pages[0]), 1);
+    ASSERT_PANIC(slabs[0], "Color test add slab failed.");
+
+    for (unsigned int i = 0; i < slabs[0]->max_num; i++) {
+        obj = kalloc_cache_alloc(&cache);
+        ASSERT_PANIC(obj && IS_ALIGNED((uint64_t)obj, KALLOC_CACHE_LINE_SIZE), "Color test obj not line aligned.");
+    }
+
+    kalloc_free_pages(pages[0], 0);
+
+    DEBUG("--- Kalloc cache color test end ---");
+}
+
+#define NAMED_TEST_OBJ_SIZE 40
+#define NAMED_TEST_ALIGN 16
+#define NAMED_TEST_MAGIC 0xc0ffee
+#define NAMED_TEST_OBJ_NUM 64
+
+typedef struct _named_test_obj {
+    uint64_t magic;
+    uint64_t ctor_index;
+    char data[NAMED_TEST_OBJ_SIZE - 2 * sizeof(uint64_t)];
+} _named_test_obj_t;
+
+static unsigned int _named_test_ctor_num;
+static unsigned int _named_test_dtor_num;
+
+static void _named_test_ctor(void * obj)
+{
+    _named_test_obj_t * test_obj = (_named_test_obj_t *)obj;
+
+    test_obj->magic = NAMED_TEST_MAGIC;
+    test_obj->ctor_index = _named_test_ctor_num++;
+}
+
+static void _named_test_dtor(void * obj)
+{
+    ASSERT_PANIC(((_named_test_obj_t *)obj)->magic == NAMED_TEST_MAGIC, "Named test dtor on an unconstructed obj.");
+    _named_test_dtor_num++;
+}
+
+void kalloc_named_cache_test()
+{
+    DEBUG("--- Kalloc named cache test start ---");
+
+    kalloc_cache_t * cache;
+    _named_test_obj_t * objs[NAMED_TEST_OBJ_NUM];
+    unsigned int free_page_num;
+    unsigned int ctor_num;
+    task_t * task;
+    int ret;
+
+    kalloc_pcp_drain_all();
+    free_page_num = _mm_free_page_num();
+
+    ASSERT_PANIC(!kalloc_cache_create("named test", NAMED_TEST_OBJ_SIZE, 3, NULL, NULL), "Named test took a non power of two align.");
+
+    _named_test_ctor_num = 0;
+    _named_test_dtor_num = 0;
+    cache = kalloc_cache_create("named test", NAMED_TEST_OBJ_SIZE, NAMED_TEST_ALIGN, _named_test_ctor, _named_test_dtor);
+    ASSERT_PANIC(cache && cache->obj_size == ALIGN_UP(NAMED_TEST_OBJ_SIZE, NAMED_TEST_ALIGN), "Named test cache create failed.");
+    ASSERT_PANIC(!_named_test_ctor_num, "Named test ctor ran before any slab.");
+
+    for (unsigned int i = 0; i < NAMED_TEST_OBJ_NUM; i++) {
+        objs[i] = (_named_test_obj_t *)kalloc_obj_alloc(cache);
+        ASSERT_PANIC(objs[i] && IS_ALIGNED((uint64_t)objs[i], NAMED_TEST_ALIGN), "Named test obj alloc failed.");
+        ASSERT_PANIC(objs[i]->magic == NAMED_TEST_MAGIC, "Named test obj not constructed.");
+    }
+
+    // Every obj of a slab is constructed as the slab is added, not as they are handed out
+    ASSERT_PANIC(_named_test_ctor_num == cache->max_num, "Named test ctor count is not the populated obj count.");
+
+    // Freed objs come back out as they went in without running the ctor again
+    ctor_num = _named_test_ctor_num;
+    for (unsigned int i = 0; i < NAMED_TEST_OBJ_NUM; i++) {
+        ret = i % 2 ? kalloc_obj_free(cache, objs[i]) : kalloc_free(objs[i], 0);
+        ASSERT_PANIC(!ret, "Named test obj free failed.");
+    }
+    for (unsigned int i = 0; i < NAMED_TEST_OBJ_NUM; i++) {
+        objs[i] = (_named_test_obj_t *)kalloc_obj_alloc(cache);
+        ASSERT_PANIC(objs[i] && objs[i]->magic == NAMED_TEST_MAGIC, "Named test reused obj not constructed.");
+    }
+    ASSERT_PANIC(_named_test_ctor_num == ctor_num, "Named test ctor ran again on reused objs.");
+
+    ASSERT_PANIC(kalloc_cache_destroy(cache), "Named test destroyed a cache with objs in use.");
+
+    for (unsigned int i = 0; i < NAMED_TEST_OBJ_NUM; i++) {
+        ret = kalloc_obj_free(cache, objs[i]);
+        ASSERT_PANIC(!ret, "Named test obj free failed.");
+    }
+
+    ret = kalloc_cache_destroy(cache);
+    ASSERT_PANIC(!ret, "Named test cache destroy failed.");
+    ASSERT_PANIC(_named_test_dtor_num == _named_test_ctor_num, "Named test dtor count wrong.");
+
+    kalloc_pcp_drain_all();
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Named test page count wrong.");
+
+    // Tasks come out of the task cache ready for task_init
+    task = task_alloc();
+    ASSERT_PANIC(TASK_VALID(task) && !queue_valid(&task->sched_chain) && task->quanta, "Named test task not constructed.");
+    task_free(task);
+
+    DEBUG("--- Kalloc named cache test end ---");
+}
+
+void kalloc_arena_test()
+{
+    DEBUG("--- Kalloc arena test start ---");
+
+    #define ARENA_TEST_NUM 256
+    #define ARENA_TEST_SIZE 40
+
+    kalloc_arena_t arena;
+    kalloc_arena_mark_t mark;
+    kalloc_arena_chunk_t * chunk;
+    uint64_t * objs[ARENA_TEST_NUM];
+    unsigned int free_page_num;
+    unsigned int chunk_num;
+    void * obj;
+
+    kalloc_pcp_drain_all();
+    free_page_num = _mm_free_page_num();
+
+    kalloc_arena_init(&arena, 1, 0);
+
+    // Enough small objs to spill over several one page chunks, each one written to catch overlaps
+    for (unsigned int i = 0; i < ARENA_TEST_NUM; i++) {
+        objs[i] = (uint64_t *)kalloc_arena_alloc(&arena, ARENA_TEST_SIZE, 0);
+        ASSERT_PANIC(objs[i] && IS_ALIGNED((uint64_t)objs[i], KALLOC_ARENA_MIN_ALIGN), "Arena test alloc failed.");
+        memset(objs[i], i, ARENA_TEST_SIZE);
+    }
+    for (unsigned int i = 0; i < ARENA_TEST_NUM; i++) {
+        ASSERT_PANIC(*(uint8_t *)objs[i] == (uint8_t)i && ((uint8_t *)objs[i])[ARENA_TEST_SIZE - 1] == (uint8_t)i,
+                     "Arena test objs overlap.");
+    }
+    ASSERT_PANIC(arena.stats.chunk_num > 1 && arena.stats.page_num == arena.stats.chunk_num, "Arena test chunk num wrong.");
+    ASSERT_PANIC(arena.stats.alloc_num == ARENA_TEST_NUM && arena.stats.alloc_size == ARENA_TEST_NUM * ARENA_TEST_SIZE,
+                 "Arena test stats wrong.");
+    ASSERT_PANIC(_mm_free_page_num() <= free_page_num - arena.stats.page_num, "Arena test pages not taken.");
+
+    // Aligned allocs pay for their padding in the waste count
+    kalloc_arena_mark(&arena, &mark);
+    chunk_num = arena.stats.chunk_num;
+    kalloc_arena_alloc(&arena, 1, 0);
+    obj = kalloc_arena_alloc(&arena, 64, 64);
+    ASSERT_PANIC(obj && IS_ALIGNED((uint64_t)obj, 64), "Arena test aligned alloc not aligned.");
+
+    // An alloc larger than a chunk gets a chunk of its own
+    obj = kalloc_arena_alloc(&arena, 3 * PAGE_SIZE, PAGE_SIZE);
+    ASSERT_PANIC(obj && IS_ALIGNED((uint64_t)obj, PAGE_SIZE), "Arena test large alloc failed.");
+    chunk = arena.chunk;
+    ASSERT_PANIC(chunk->page_num == 4, "Arena test large chunk size wrong.");
+    memset(obj, 0xAB, 3 * PAGE_SIZE);
+
+    // Rewinding frees the chunks taken since the mark and hands out the same memory again
+    kalloc_arena_rewind(&arena, &mark);
+    ASSERT_PANIC(arena.stats.chunk_num == chunk_num && arena.chunk == mark.chunk && arena.chunk->used == mark.used,
+                 "Arena test rewind wrong.");
+    obj = kalloc_arena_alloc(&arena, 1, 0);
+    ASSERT_PANIC((uint64_t)obj == ALIGN_UP((uint64_t)mark.chunk + mark.used, KALLOC_ARENA_MIN_ALIGN), "Arena test rewind not reused.");
+    ASSERT_PANIC(arena.stats.max_page_num >= arena.stats.page_num + 4, "Arena test max page num wrong.");
+
+    kalloc_arena_destroy(&arena);
+    ASSERT_PANIC(!arena.chunk && !arena.stats.page_num && !arena.stats.chunk_num, "Arena test destroy left chunks.");
+
+    kalloc_pcp_drain_all();
+    ASSERT_PANIC(_mm_free_page_num() == free_page_num, "Arena test page count wrong.");
+
+    DEBUG("--- Kalloc arena test end ---");
+}
+
+#ifdef KALLOC_PROFILE
+/* Out of line so every alloc of the test has the same return address. */
+static void * __attribute__((noinline)) prof_test_alloc(size_t size)
+{
+    return kalloc_alloc(size, 0);
+}
+
+void kalloc_prof_test()
+{
+    kalloc_prof_site_t sites[4];
+    void * objs[3];
+    void * page;
+    unsigned int num;
+
+    DEBUG("--- Kalloc prof test start ---");
+
+    kalloc_prof_reset();
+
+    for (int i = 0; i < 3; i++) {
+        objs[i] = prof_test_alloc(40);
+        ASSERT_PANIC(objs[i], "Prof test alloc failed.");
+    }
+    page = prof_test_alloc(PAGE_SIZE + 1);
+    ASSERT_PANIC(page, "Prof test page alloc failed.");
+    kalloc_free(objs[0], 0);
+
+    // Counted by size class, the page alloc has the most live bytes
+    num = kalloc_prof_top(sites, 4, KALLOC_PROF_SORT_LIVE);
+    ASSERT_PANIC(num == 2, "Prof test site num wrong.");
+    ASSERT_PANIC(sites[0].site == sites[1].site, "Prof test allocs not counted to the same site.");
+    ASSERT_PANIC(sites[0].size == 2 * PAGE_SIZE && sites[0].alloc_num == 1 && !sites[0].free_num, 
+                 "Prof test page site wrong.");
+    ASSERT_PANIC(sites[1].size == 48 && sites[1].alloc_num == 3 && sites[1].free_num == 1, 
+                 "Prof test obj site wrong.");
+    ASSERT_PANIC(sites[1].alloc_size - sites[1].free_size == 2 * 48, "Prof test live bytes wrong.");
+
+    num = kalloc_prof_top(sites, 4, KALLOC_PROF_SORT_ALLOC);
+    ASSERT_PANIC(num == 2 && sites[0].size == 48, "Prof test alloc order wrong.");
+
+    // Objs alloced before a reset are not counted when they are freed
+    kalloc_prof_reset();
+    kalloc_free(objs[1], 0);
+    kalloc_free(objs[2], 0);
+    kalloc_free(page, 0);
+    num = kalloc_prof_top(sites, 4, KALLOC_PROF_SORT_LIVE);
+    ASSERT_PANIC(!num, "Prof test counted frees of objs from before the reset.");
+    ASSERT_PANIC(!kalloc_prof_dropped_num(), "Prof test dropped counts.");
+
+    kalloc_prof_dump(KALLOC_PROF_DUMP_NUM, KALLOC_PROF_SORT_LIVE);
+
+    DEBUG("--- Kalloc prof test end ---");
+}
+#endif
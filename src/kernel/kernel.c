@@ -22,6 +22,7 @@
 #include <kernel/kalloc.h>
 #include <kernel/kalloc_page.h>
 #include <kernel/kern_tests.h>
+#include <kernel/kern_bench.h>
 #include <kernel/timer.h>
 #include <kernel/kalloc_page.h>
 #include <kernel/sched.h>
@@ -29,6 +30,7 @@
 #include <kernel/cpu.h>
 #include <kernel/early_mm.h>
 #include <kernel/klog.h>
+#include <kernel/kalloc_prof.h>
 #include <emb-stdio/emb-stdio.h>
 #include <emb-stdio/windows.h>
 
@@ -41,6 +43,36 @@ DEFINE_SPINLOCK(uart_lock);
 
 #define LOCALTIMER_PERIOD 10000
 
+#define BOOT_PHASE_MAX 16
+
+typedef struct boot_phase {
+	const char * name;
+	uint64_t time;
+} boot_phase_t;
+
+/* Time each boot phase ended at, printed once we are about to start scheduling. */
+static boot_phase_t boot_phases[BOOT_PHASE_MAX];
+static unsigned int boot_phase_num = 0;
+
+static void boot_timestamp(const char * name)
+{
+	if (boot_phase_num == BOOT_PHASE_MAX)
+		return;
+
+	boot_phases[boot_phase_num].name = name;
+	boot_phases[boot_phase_num].time = systemtimer_gettime_64();
+	boot_phase_num++;
+}
+
+static void print_boot_timestamps()
+{
+	DEBUG("Boot phase usecs:");
+	for (unsigned int i = 1; i < boot_phase_num; i++) {
+		DEBUG_DATA_DIGIT(boot_phases[i].name, boot_phases[i].time - boot_phases[i - 1].time);
+	}
+	DEBUG_DATA_DIGIT("total=", boot_phases[boot_phase_num - 1].time - boot_phases[0].time);
+}
+
 static void _print_processor_features()
 {
 	uint64_t r = 0;
@@ -90,6 +122,13 @@ void kernel_child_main(uint64_t mpidr_el1)
 	}
 	
 	DEBUG_DATA_DIGIT("Core num start=", corenum);
+
+	/* Init the page structs mm_init left for us while core 0 moves on to scheduling. */
+	mm_deferred_init();
+
+#ifdef BENCH_KERNEL
+	kern_bench_child(corenum);
+#endif
 	
 	sched_start();
 
@@ -129,6 +168,7 @@ void kernel_main(uint64_t dtb_ptr32, uint64_t core_start_addr, uint64_t x2, uint
 	uint32_t buff[5];
 
 	uart_init();
+	boot_timestamp("start");
 
 	phys_mem_map = mm_early_get_memmap();
 	dtb = (uint32_t *)dtb_ptr32;
@@ -156,16 +196,50 @@ void kernel_main(uint64_t dtb_ptr32, uint64_t core_start_addr, uint64_t x2, uint
 	DEBUG_DATA("VC Membase addr=", buff[3]);
 	DEBUG_DATA("VC Memsize= ", buff[4]);
 
+	boot_timestamp("mbox=");
+
 	mm_init();
+	boot_timestamp("mm_init=");
 	kalloc_init();
+	boot_timestamp("kalloc_init=");
+	task_cache_init();
+#ifdef KALLOC_PROFILE
+	kalloc_prof_init();
+#endif
 
 #ifdef TEST_KERNEL
+	/* The tests check per area page counts, so have all the areas initialized before they start. */
+	mm_deferred_init();
+	boot_timestamp("mm_deferred_init=");
+
 	ll_test();
 	kalloc_slab_test();
 	kalloc_cache_test();
 	mm_test();
 	kalloc_test();
+	kalloc_pcp_test();
+	kalloc_page_bulk_test();
+	kalloc_page_range_test();
+	kalloc_pages_exact_test();
+	kalloc_zero_test();
+	mm_type_test();
+	kalloc_huge_test();
+	kalloc_compact_test();
+	kalloc_reclaim_test();
+	kalloc_mag_test();
+	kalloc_mag_remote_test();
+	kalloc_cache_lookup_test();
+	kalloc_entry_test();
+	kalloc_cache_grow_test();
+	kalloc_slab_format_test();
+	kalloc_cache_color_test();
+	kalloc_named_cache_test();
+	kalloc_arena_test();
+#ifdef KALLOC_PROFILE
+	kalloc_prof_test();
+#endif
 	queue_test();
+	boot_timestamp("tests=");
 #endif
 
 	irq_init();
@@ -185,14 +259,27 @@ void kernel_main(uint64_t dtb_ptr32, uint64_t core_start_addr, uint64_t x2, uint
 	GotoXY(0, 0);
 	WriteText("HELLO From Kernel\n");
 
+	boot_timestamp("console=");
+
 	sched_init();
+	boot_timestamp("sched_init=");
 	klog_init(uart_puts);
+#ifdef KALLOC_PROFILE
+	kalloc_prof_task_init();
+#endif
 	localtimer_irqinit(LOCALTIMER_PERIOD, 0);
 	start_cores(core_start_addr);
 
 	while (atomic_ld_64(&core_ready) != CORE_NUM - 1) {
 		CYCLE_WAIT(10);
 	}
+	boot_timestamp("start_cores=");
+
+	print_boot_timestamps();
+
+#ifdef BENCH_KERNEL
+	kern_bench_main();
+#endif
 	
 	sched_start();
 
@@ -10,15 +10,18 @@
 #include <kernel/irq.h>
 #include <kernel/sched.h>
 #include <kernel/timer.h>
+#include <kernel/kalloc_reclaim.h>
 
 /* TIMESTAMP: PROCESSOR_ID: TASK_ID: MSG*/
 #define MSG_PROLOGUE "%u:%u:%u: %s"
 
-#define WRITE_FULL(r_i, w_i) (r_i == (w_i + 1 % KLOG_BUF_SIZE))
+#define WRITE_FULL(r_i, w_i) (r_i == (w_i + 1 % log->msg_num))
 #define READ_FULL(r_i, w_i) (r_i == w_i)
-#define END_INDEX(i) (i == KLOG_BUF_SIZE - 1)
+#define END_INDEX(i) (i == log->msg_num - 1)
+#define MSG(i) (&log->msg_pages[(i) / KLOG_MSGS_PER_PAGE][(i) % KLOG_MSGS_PER_PAGE])
 
 static klog_t * log;
+static kalloc_shrinker_t klog_shrinker;
 
 
 /*
@@ -70,7 +73,7 @@ static int flush()
     r_i = atomic_ld_64(&log->read_index);
     
     while (!READ_FULL(r_i, w_i)) {
-        log->handler(&log->msgs[r_i].msg);
+        log->handler(&MSG(r_i)->msg);
 
         if (END_INDEX(r_i)) {
             r_i = 0;
@@ -119,7 +122,7 @@ static int klog_write(char *s, size_t strlen)
         return 1;
     }
 
-    memcpy(&log->msgs[index].msg[0], s, strlen);
+    memcpy(&MSG(index)->msg[0], s, strlen);
 
     rwlock_read_unlock(&log->rw_lock);
     aarch64_dmb();
@@ -150,9 +153,45 @@ int klog_printf(const char* fmt, ...)
     return ret;
 }
 
+static unsigned int klog_shrinker_count(void * data)
+{
+    (void)data;
+
+    return log->page_num - KLOG_MIN_PAGE_NUM;
+}
+
+/* Flush what is left in the ring so the indices can start over in the pages we keep, the msgs are
+ * dropped if there is no handler yet. The ring does not grow back. */
+static unsigned int klog_shrinker_shrink(void * data, unsigned int page_num)
+{
+    unsigned int freed_num = 0;
+
+    (void)data;
+
+    rwlock_write_lock(&log->rw_lock);
+
+    flush();
+
+    while (freed_num < page_num && log->page_num > KLOG_MIN_PAGE_NUM) {
+        log->page_num--;
+        kalloc_free_pages(log->msg_pages[log->page_num], 0);
+        log->msg_pages[log->page_num] = NULL;
+        freed_num++;
+    }
+
+    log->msg_num = log->page_num * KLOG_MSGS_PER_PAGE;
+    atomic_str_64(&log->read_index, 0);
+    atomic_str_64(&log->write_index, 0);
+
+    rwlock_write_unlock(&log->rw_lock);
+
+    return freed_num;
+}
+
 void klog_init(void(*handler) (char*))
 { 
     task_t * task;
+    unsigned int page_num;
 
     log = kalloc_alloc(sizeof(klog_t), 0);
     if (!log) {
@@ -160,6 +199,13 @@ void klog_init(void(*handler) (char*))
     }
     memset(log, 0, sizeof(klog_t));
 
+    page_num = kalloc_pages_bulk(1, KLOG_PAGE_NUM, (void **)&log->msg_pages[0], 0);
+    if (page_num < KLOG_MIN_PAGE_NUM) {
+        DEBUG_PANIC("Klog init msg pages failed");
+    }
+    log->page_num = page_num;
+    log->msg_num = page_num * KLOG_MSGS_PER_PAGE;
+
     rwlock_init(&log->rw_lock, KLOG_BUF_SIZE);
     log->read_index = 0;
     log->write_index = 0;
@@ -167,9 +213,15 @@ void klog_init(void(*handler) (char*))
 
     klog_init_handler(handler);
 
-    task = (task_t *)kalloc_alloc(sizeof(task_t), 0);
+    task = task_alloc();
     task_create(task, klog_flush_task);
     sched_task_add(task, TASK_UNINT, 0);
 
     log->flush_task = task;
+
+    klog_shrinker.name = "klog";
+    klog_shrinker.count = klog_shrinker_count;
+    klog_shrinker.shrink = klog_shrinker_shrink;
+    klog_shrinker.data = NULL;
+    kalloc_shrinker_register(&klog_shrinker);
 }
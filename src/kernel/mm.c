@@ -11,13 +11,40 @@
 #include <common/math.h>
 #include <kernel/mmu.h>
 #include <common/linkedlist.h>
+#include <kernel/cpu.h>
+#include <common/atomic.h>
+#include <kernel/timer.h>
+#include <common/aarch64_common.h>
+#include <kernel/printf.h>
 
 DEFINE_SPINLOCK(mm_lock);
 
 static mm_global_area_t global_area;
+/* The area each core last allocated each type from. Cores start out in different areas so they
+ * are not all contending on the same area lock. */
+static mm_area_t * home_areas[CORE_NUM][MM_TYPE_NUM];
+
+/* Order of area types to try for each alloc type. Areas of the same type first, then untouched areas,
+ * and only then do we steal from the other type. */
+static const unsigned int type_fallbacks[MM_TYPE_NUM][MM_AREA_TYPE_NUM] = {
+    [MM_TYPE_UNMOVABLE] = {MM_TYPE_UNMOVABLE, MM_TYPE_NONE, MM_TYPE_RECLAIMABLE},
+    [MM_TYPE_RECLAIMABLE] = {MM_TYPE_RECLAIMABLE, MM_TYPE_NONE, MM_TYPE_UNMOVABLE},
+};
 
 static int mm_initialized = 0;
 
+/* Areas past the boot areas are initialized by the secondary cores once they are started,
+ * or on demand when the initialized areas run out. */
+static unsigned int boot_area_num;
+/* Page range [free_page_start, free_page_end) that is not early memory or device memory. */
+static unsigned int free_page_start;
+static unsigned int free_page_end;
+ATOMIC_UINT64(deferred_area_next);
+ATOMIC_UINT64(deferred_area_done);
+
+static int deferred_area_init();
+static int deferred_area_wait();
+
 /* Early heap wrappers. For now since we are 1-1 mapping memory we can just
  * add the virtual offset to indicate we are in kernel memory. */
 static void align_mem(size_t size)
@@ -47,57 +74,41 @@ mm_global_area_t * mm_global_area()
 
 int mm_page_is_valid(unsigned int page_index)
 {
-    return mm_global_area()->global_pages[page_index].page_flags & MM_PAGE_VALID;
+    return bitmap_get(mm_global_area()->page_valid_bitmap, page_index);
 }
 
 int mm_pages_are_valid(unsigned int start_page_index, unsigned int page_num)
 {
-    for (int i = 0; i < page_num; i++) {
-        if (!mm_page_is_valid(start_page_index))
-            return 0;
-        start_page_index++;
-    }
-
-    return 1;
+    return bitmap_range_is_set(mm_global_area()->page_valid_bitmap, start_page_index, page_num);
 }
 
 void mm_mark_page_valid(unsigned int page_index)
 {
-    ASSERT_PANIC(!mm_page_is_valid(page_index), "MM double marking page valid.");
-    mm_global_area()->global_pages[page_index].page_flags |= MM_PAGE_VALID;
+    CHECK_CHEAP(!mm_page_is_valid(page_index), "MM double marking page valid.");
+    bitmap_set(mm_global_area()->page_valid_bitmap, page_index);
 }
 
 void mm_mark_pages_valid(unsigned int start_page_index, unsigned int page_num)
 {
-    for (int i = 0; i < page_num; i++) {
-        mm_mark_page_valid(start_page_index);
-        start_page_index++;
-    }
+    CHECK_CHEAP(mm_pages_are_free(start_page_index, page_num), "MM double marking page valid.");
+    bitmap_set_range(mm_global_area()->page_valid_bitmap, start_page_index, page_num);
 }
 
 void mm_mark_page_free(unsigned int page_index)
 {
-    ASSERT_PANIC(mm_page_is_valid(page_index), "MM double marking page free.");
-    mm_global_area()->global_pages[page_index].page_flags &= ~MM_PAGE_VALID;
+    CHECK_CHEAP(mm_page_is_valid(page_index), "MM double marking page free.");
+    bitmap_free(mm_global_area()->page_valid_bitmap, page_index);
 }
 
 void mm_mark_pages_free(unsigned int start_page_index, unsigned int page_num)
 {
-    for (int i = 0; i < page_num; i++) {
-        mm_mark_page_free(start_page_index);
-        start_page_index++;
-    }
+    CHECK_CHEAP(mm_pages_are_valid(start_page_index, page_num), "MM double marking page free.");
+    bitmap_free_range(mm_global_area()->page_valid_bitmap, start_page_index, page_num);
 }
 
 int mm_pages_are_free(unsigned int start_page_index, unsigned int page_num)
 {
-    for (int i = 0; i < page_num; i++) {
-        if (mm_page_is_valid(start_page_index))
-            return 0;
-        start_page_index++;
-    }
-
-    return 1;
+    return bitmap_range_is_free(mm_global_area()->page_valid_bitmap, start_page_index, page_num);
 }
 
 unsigned int mm_pages_to_memorder(unsigned int page_num)
@@ -113,12 +124,22 @@ unsigned int mm_memorder_to_pages(unsigned int memorder)
 
 void * mm_get_page_obj_ptr(unsigned int page_index)
 {
-    return mm_global_area()->global_pages[page_index].obj;
+    uint64_t obj = mm_global_area()->global_pages[page_index].obj;
+
+    if (!obj)
+        return NULL;
+
+    return (void *)((obj << MM_PAGE_OBJ_SHIFT) | MMU_UPPER_ADDRESS);
 }
 
 void mm_link_page_obj_ptr(unsigned int page_index, void * ptr)
 {
-    mm_global_area()->global_pages[page_index].obj = ptr;
+    uint64_t phys_addr = mmu_get_phys_addr((uint64_t)ptr);
+
+    CHECK_CHEAP(IS_ALIGNED(phys_addr, 1 << MM_PAGE_OBJ_SHIFT) && !(phys_addr >> (32 + MM_PAGE_OBJ_SHIFT)),
+                "Page obj ptr can not be compressed.");
+
+    mm_global_area()->global_pages[page_index].obj = (uint32_t)(phys_addr >> MM_PAGE_OBJ_SHIFT);
 }
 
 mm_area_t * mm_area_from_addr(uint64_t addr)
@@ -136,19 +157,194 @@ mm_area_t * mm_area_from_addr(uint64_t addr)
     return &global_area->global_areas[area_index];
 }
 
-mm_area_t * mm_find_free_area(unsigned int memorder)
+int mm_area_has_free_buddy(mm_area_t * area, unsigned int memorder)
 {
-    sll_node_t * node;
+    for (unsigned int free_memorder = memorder; free_memorder < MM_MAX_ORDER + 1; free_memorder++) {
+        if (MM_AREA_FREE_BUDDY(area, free_memorder))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Try to lock any area of the given type with a free buddy of at least memorder. If every such area
+ * is contended we return NULL and hand back the first one we saw in contended_area. */
+static mm_area_t * trylock_free_area(unsigned int memorder, unsigned int type, mm_area_t ** contended_area)
+{
+    uint64_t bits;
+    mm_area_t * area;
     mm_global_area_t * global_area = mm_global_area();
+
     for (unsigned int free_memorder = memorder; free_memorder < MM_MAX_ORDER + 1; free_memorder++) {
-        node = MM_GLOBAL_AREA_FREE_AREA(free_memorder);
-        if (node)
-            return (mm_area_t*)node->data;
+        for (unsigned int i = 0; i < global_area->free_areas_bitmap_size; i++) {
+            bits = global_area->free_areas_bitmap[free_memorder][i] & global_area->type_areas_bitmap[type][i];
+
+            while (bits) {
+                area = &global_area->global_areas[(i * BITMAP_BITS_PER_BITMAP_ENTRY) + bits_ctz_64(bits)];
+                bits &= bits - 1;
+
+                if (lock_trylock(&area->lock)) {
+                    if (!*contended_area)
+                        *contended_area = area;
+                    continue;
+                }
+
+                // The bits could have been cleared after we read them, check again with the lock held
+                if (area->type == type && mm_area_has_free_buddy(area, memorder))
+                    return area;
+
+                unlock_spinlock(&area->lock);
+            }
+        }
     }
 
     return NULL;
 }
 
+/* Hand a locked area we found over to the alloc type. MUST HOLD AREA LOCK. */
+static void claim_area(mm_area_t * area, unsigned int type)
+{
+    if (area->type == type)
+        return;
+
+    if (area->type == MM_TYPE_NONE) {
+        mm_set_area_type(area, type);
+        return;
+    }
+
+    // Stealing from another type. If most of the area is still free take the whole area over,
+    // so the rest of it fills up with our type instead of staying mixed.
+    atomic_fetch_add_64(&mm_global_area()->type_steal_num[type], 1);
+    if (area->free_page_num >= area->max_free_page_num / 2)
+        mm_set_area_type(area, type);
+}
+
+mm_area_t * mm_find_free_area(unsigned int memorder, unsigned int type)
+{
+    mm_area_t * area;
+    mm_area_t * contended_area;
+    unsigned int cpu_id = cpu_get_id();
+
+    CHECK_CHEAP(type < MM_TYPE_NUM, "Find free area type out of range.");
+
+    // Prefer our home area as long as nobody else is using it
+    area = home_areas[cpu_id][type];
+    if (area && !lock_trylock(&area->lock)) {
+        if ((area->type == type || area->type == MM_TYPE_NONE) && mm_area_has_free_buddy(area, memorder))
+            goto found_area;
+
+        unlock_spinlock(&area->lock);
+    }
+
+    while (1) {
+        contended_area = NULL;
+        for (unsigned int i = 0; i < MM_AREA_TYPE_NUM; i++) {
+            area = trylock_free_area(memorder, type_fallbacks[type][i], &contended_area);
+            if (area)
+                goto found_area;
+        }
+
+        if (!contended_area) {
+            // Out of initialized areas, init one ourselves instead of waiting on the secondary cores
+            if (deferred_area_init())
+                continue;
+
+            // Every area is claimed but other cores can still be setting up the last ones
+            if (deferred_area_wait())
+                continue;
+
+            return NULL;
+        }
+
+        // Every free area is in use, wait on one
+        lock_spinlock(&contended_area->lock);
+
+        // The area could have been emptied before we got the lock
+        if (mm_area_has_free_buddy(contended_area, memorder)) {
+            area = contended_area;
+            goto found_area;
+        }
+
+        unlock_spinlock(&contended_area->lock);
+    }
+
+found_area:
+    claim_area(area, type);
+    home_areas[cpu_id][type] = area;
+
+    return area;
+}
+
+void mm_set_area_type(mm_area_t * area, unsigned int type)
+{
+    unsigned int area_index = MM_AREA_STRUCT_INDEX(area);
+    mm_global_area_t * global_area = mm_global_area();
+    uint64_t bit = (uint64_t)1 << (area_index % BITMAP_BITS_PER_BITMAP_ENTRY);
+
+    CHECK_CHEAP(type < MM_AREA_TYPE_NUM, "Area type out of range.");
+
+    atomic_fetch_and_64(&global_area->type_areas_bitmap[area->type][area_index / BITMAP_BITS_PER_BITMAP_ENTRY], ~bit);
+    area->type = type;
+    atomic_fetch_or_64(&global_area->type_areas_bitmap[type][area_index / BITMAP_BITS_PER_BITMAP_ENTRY], bit);
+}
+
+unsigned int mm_get_page_type(unsigned int page_index)
+{
+    return mm_global_area()->global_pages[page_index].page_flags & MM_PAGE_TYPE_MASK;
+}
+
+void mm_set_page_type(unsigned int page_index, unsigned int type)
+{
+    mm_page_t * page = &mm_global_area()->global_pages[page_index];
+
+    page->page_flags = (page->page_flags & ~MM_PAGE_TYPE_MASK) | type;
+}
+
+unsigned int mm_test_page_flag(unsigned int page_index, unsigned int flag)
+{
+    return (mm_global_area()->global_pages[page_index].page_flags & flag) != 0;
+}
+
+void mm_set_page_flag(unsigned int page_index, unsigned int flag)
+{
+    mm_global_area()->global_pages[page_index].page_flags |= flag;
+}
+
+void mm_clear_page_flag(unsigned int page_index, unsigned int flag)
+{
+    mm_global_area()->global_pages[page_index].page_flags &= ~flag;
+}
+
+unsigned int mm_get_page_range_num(unsigned int page_index)
+{
+    return mm_global_area()->global_pages[page_index].range_page_num;
+}
+
+void mm_set_page_range_num(unsigned int page_index, unsigned int page_num)
+{
+    CHECK_CHEAP(page_num <= MM_MEMORDER_TO_PAGES(MM_MAX_ORDER), "Page range num larger than a max order block.");
+
+    mm_global_area()->global_pages[page_index].range_page_num = page_num;
+}
+
+/* Mark the area as having a free buddy of memorder. MUST HOLD AREA LOCK. */
+void mm_add_free_area(mm_area_t * area, unsigned int memorder)
+{
+    unsigned int area_index = MM_AREA_STRUCT_INDEX(area);
+
+    atomic_fetch_or_64(&mm_global_area()->free_areas_bitmap[memorder][area_index / BITMAP_BITS_PER_BITMAP_ENTRY],
+                       (uint64_t)1 << (area_index % BITMAP_BITS_PER_BITMAP_ENTRY));
+}
+
+/* Mark the area as having no free buddies of memorder. MUST HOLD AREA LOCK. */
+void mm_remove_free_area(mm_area_t * area, unsigned int memorder)
+{
+    unsigned int area_index = MM_AREA_STRUCT_INDEX(area);
+
+    atomic_fetch_and_64(&mm_global_area()->free_areas_bitmap[memorder][area_index / BITMAP_BITS_PER_BITMAP_ENTRY],
+                        ~((uint64_t)1 << (area_index % BITMAP_BITS_PER_BITMAP_ENTRY)));
+}
+
 unsigned int mm_get_page_index(mm_page_t * page)
 {
     return ((uint64_t)page) - (((uint64_t)mm_global_area()->global_pages) / sizeof(mm_page_t));
@@ -159,73 +355,305 @@ int mm_reserve_area(unsigned int area_index)
     mm_area_t * area = mm_area_from_addr(area_index * MM_AREA_SIZE);
 }
 
+/* Largest memorder of a block that starts at page_index, is aligned to its size and fits in page_num pages. */
+unsigned int mm_range_max_memorder(unsigned int page_index, unsigned int page_num)
+{
+    unsigned int memorder = MM_MAX_ORDER;
+
+    while (memorder && (!IS_ALIGNED(page_index, MM_MEMORDER_TO_PAGES(memorder)) ||
+                        (unsigned int)MM_MEMORDER_TO_PAGES(memorder) > page_num)) {
+        memorder--;
+    }
+
+    return memorder;
+}
+
+/* Add the free pages [start_page_index, end_page_index) of the area as the largest aligned buddies that fit. */
+static void area_add_free_range(mm_area_t * area, unsigned int start_page_index, unsigned int end_page_index)
+{
+    unsigned int memorder;
+    unsigned int page_index = start_page_index;
+
+    while (page_index < end_page_index) {
+        memorder = mm_range_max_memorder(page_index, end_page_index - page_index);
+
+        /* A single page at the edge of the range is freed as the memorder 0 buddy of its
+         * page pair, with the other page of the pair staying reserved. */
+        kalloc_init_buddy(area, kalloc_get_buddy_from_page_index(page_index), memorder, 1);
+        page_index += MM_MEMORDER_TO_PAGES(memorder);
+    }
+}
+
 int mm_area_init(mm_global_area_t * global_area, mm_area_t * area, unsigned int start_page_index)
 {
-    kalloc_buddy_t * sibling;
-    unsigned int buddy_num;
+    unsigned int end_page_index = start_page_index + MM_AREA_PAGE_NUM;
+    unsigned int free_start = start_page_index;
+    unsigned int free_end = end_page_index;
 
     ASSERT_PANIC(global_area && area, "MM area init nulls found");
     memset(area, 0, sizeof(mm_area_t));
 
-    area->free_page_num = MM_AREA_SIZE / PAGE_SIZE;
+    spinlock_init(&area->lock);
     area->start_page_index = start_page_index;
     area->phys_addr_start = start_page_index * PAGE_SIZE;
     area->buddies = &global_area->global_buddies[start_page_index / 2];
-    buddy_num = area->free_page_num / 2;
 
-    DEBUG_DATA_DIGIT("Area init i=", MM_AREA_STRUCT_INDEX(area));
-    DEBUG_DATA_DIGIT("buddy num=", buddy_num);
+    /* The page structs of an area are only touched once the area is initialized,
+     * so they are cleared here instead of all at once in mm_init. */
+    memset(&global_area->global_pages[start_page_index], 0, MM_AREA_PAGE_NUM * sizeof(mm_page_t));
+    memset(area->buddies, 0, MM_AREA_BUDDY_NUM * sizeof(kalloc_buddy_t));
+    bitmap_free_range(global_area->page_valid_bitmap, start_page_index, MM_AREA_PAGE_NUM);
 
     for (unsigned int i = 0; i < MM_MAX_ORDER + 1; i++) {
         /* Init the list to keep track of free buddys in this area. */
-        ll_head_init(&area->free_buddy_list[i], LIST_NODE_T);
-        ll_node_init((ll_node_t *)&area->global_area_nodes[i], (void*)area, SLL_NODE_T);
+        queue_init(&area->free_buddy_list[i]);
     }
 
-    // Init the first two buddies that make up the 8MB area size range
-    kalloc_init_buddy(area, &area->buddies[0], MM_MAX_ORDER, 1);
-    sibling = kalloc_get_buddy_sibling(&area->buddies[0]);
-    kalloc_init_buddy(area, sibling, MM_MAX_ORDER, 1);
+    /* Pages below the early heap top or past the start of device memory are reserved as
+     * one range here, so the area only ever hands out the pages in between. */
+    if (free_start < free_page_start)
+        free_start = free_page_start;
+    if (free_end > free_page_end)
+        free_end = free_page_end;
+    if (free_start > free_end)
+        free_start = free_end = end_page_index;
+
+    bitmap_set_range(global_area->page_valid_bitmap, start_page_index, free_start - start_page_index);
+    bitmap_set_range(global_area->page_valid_bitmap, free_end, end_page_index - free_end);
+
+    area->free_page_num = free_end - free_start;
+    area->max_free_page_num = area->free_page_num;
+
+    area->wmark[MM_WMARK_MIN] = area->max_free_page_num >> MM_WMARK_MIN_SHIFT;
+    area->wmark[MM_WMARK_LOW] = area->wmark[MM_WMARK_MIN] + area->wmark[MM_WMARK_MIN] / 4;
+    area->wmark[MM_WMARK_HIGH] = area->wmark[MM_WMARK_MIN] + area->wmark[MM_WMARK_MIN] / 2;
+    // Deferred areas are initialized on several cores at once
+    for (unsigned int i = 0; i < MM_WMARK_NUM; i++) {
+        atomic_fetch_add_64(&global_area->wmark_page_num[i], area->wmark[i]);
+    }
+    area_add_free_range(area, free_start, free_end);
+
+    // Reserved early and device memory is never freed, so those areas start out and stay unmovable
+    mm_set_area_type(area, area->free_page_num == MM_AREA_PAGE_NUM ? MM_TYPE_NONE : MM_TYPE_UNMOVABLE);
+
+    // Make sure the area is fully set up before anyone sees it as initialized
+    aarch64_dmb();
+    area->initialized = 1;
 
     return 0;
 }
 
-/* Reserve the early memory up to the early heap top, which should be the
- * top of the early memory space, with all code and data being placed below it. */
-static void mm_reserve_early_mem(mmu_mem_map_t * phys_mem_map, uint64_t early_heap_top)
+int mm_area_is_initialized(mm_area_t * area)
 {
-    int ret;
-    uint64_t device_mem_start;
-    mm_area_t * last_area;
-    unsigned int area_end;
-    unsigned int reserve_page_num = ALIGN_UP(early_heap_top, PAGE_SIZE) / PAGE_SIZE;
+    return atomic_ld_32(&area->initialized);
+}
 
-    for (int i = 0; i < reserve_page_num; i++) {
-        ret = kalloc_page_reserve_pages(i * PAGE_SIZE, 0, 0);
-        if (ret) {
-            DEBUG_PANIC("Reserve pages failed on initial mem reserve");
-            return;
-        }
+void mm_area_wait_initialized(mm_area_t * area)
+{
+    while (!mm_area_is_initialized(area)) {
+        // Help out with the deferred init, once every area is claimed the last ones are still being set up
+        if (!deferred_area_init())
+            CYCLE_WAIT(10);
     }
+}
 
-    device_mem_start = phys_mem_map[EARLY_MEM_MAP_DEVICE_MEM_START].start_addr;
-    last_area = &mm_global_area()->global_areas[mm_global_area()->area_count - 1];
+/* Claim and init the next area that was left uninitialized at boot.
+ * Returns 0 once there are no areas left to init. */
+static int deferred_area_init()
+{
+    uint64_t area_index;
+    mm_global_area_t * global_area = mm_global_area();
 
-    /* If our last area happens to overlap with innacessible device memory,
-     * we need to reserve those pages so we don't use them in our allocators. */
-    if (!VAL_IN_RANGE(device_mem_start, last_area->phys_addr_start, MM_AREA_SIZE))
-        return;
+    // fetch_add returns the incremented value
+    area_index = atomic_fetch_add_64(&deferred_area_next, 1) - 1;
+    if (area_index >= global_area->area_count)
+        return 0;
 
-    area_end = (last_area->phys_addr_start + MM_AREA_SIZE) / PAGE_SIZE;
-    for (unsigned int i = (device_mem_start / PAGE_SIZE); i < area_end; i++) {
-        ret = kalloc_page_reserve_pages(i * PAGE_SIZE, 0, 0);
-        if (ret) {
-            DEBUG_PANIC("Reserve pages failed on initial mem reserve");
-            return;
+    if (mm_area_init(global_area, &global_area->global_areas[area_index], area_index * MM_AREA_PAGE_NUM)) {
+        DEBUG_PANIC("MM deferred area init failed");
+        return 0;
+    }
+
+    atomic_fetch_add_64(&deferred_area_done, 1);
+
+    return 1;
+}
+
+/* Wait for the first claimed area that is still being initialized.
+ * Returns 0 once every area is initialized. */
+static int deferred_area_wait()
+{
+    mm_global_area_t * global_area = mm_global_area();
+    mm_area_t * area;
+
+    for (unsigned int i = boot_area_num; i < global_area->area_count; i++) {
+        area = &global_area->global_areas[i];
+        if (mm_area_is_initialized(area))
+            continue;
+
+        mm_area_wait_initialized(area);
+        return 1;
+    }
+
+    return 0;
+}
+
+unsigned int mm_deferred_init()
+{
+    unsigned int area_num = 0;
+    uint64_t start = systemtimer_gettime_64();
+
+    while (deferred_area_init()) {
+        area_num++;
+    }
+
+    if (area_num) {
+        DEBUG_DATA_DIGIT("MM deferred areas init=", area_num);
+        DEBUG_DATA_DIGIT("MM deferred init usecs=", systemtimer_gettime_64() - start);
+    }
+
+    return area_num;
+}
+
+int mm_deferred_init_done()
+{
+    return atomic_ld_64(&deferred_area_done) == mm_global_area()->area_count - boot_area_num;
+}
+
+/* Free blocks and free pages over all the areas, plus how many blocks of memorder the free blocks could make. */
+static void count_free_blocks(unsigned int memorder, uint64_t * free_blocks, uint64_t * free_pages, uint64_t * suitable_blocks)
+{
+    mm_global_area_t * global_area = mm_global_area();
+    mm_area_t * area;
+    unsigned int num;
+
+    *free_blocks = 0;
+    *free_pages = 0;
+    *suitable_blocks = 0;
+
+    // The counts are only read for stats so we do not bother taking the area locks
+    for (unsigned int i = 0; i < global_area->area_count; i++) {
+        area = &global_area->global_areas[i];
+        if (!mm_area_is_initialized(area))
+            continue;
+
+        for (unsigned int order = 0; order < MM_MAX_ORDER + 1; order++) {
+            num = area->free_buddy_num[order];
+            // A memorder 0 buddy on the free list always has exactly one free page
+            *free_blocks += num;
+            *free_pages += (uint64_t)num << order;
+            if (order >= memorder)
+                *suitable_blocks += (uint64_t)num << (order - memorder);
         }
     }
 }
 
+int mm_frag_index(unsigned int memorder)
+{
+    uint64_t free_blocks;
+    uint64_t free_pages;
+    uint64_t suitable_blocks;
+
+    count_free_blocks(memorder, &free_blocks, &free_pages, &suitable_blocks);
+
+    if (suitable_blocks)
+        return MM_FRAG_INDEX_FREE;
+
+    if (!free_blocks)
+        return 0;
+
+    // Same as the linux fragmentation index, 1 - (1 + free_pages / requested_pages) / free_blocks
+    return 1000 - (int)((1000 + ((free_pages * 1000) / MM_MEMORDER_TO_PAGES(memorder))) / free_blocks);
+}
+
+unsigned int mm_unusable_index(unsigned int memorder)
+{
+    uint64_t free_blocks;
+    uint64_t free_pages;
+    uint64_t suitable_blocks;
+
+    count_free_blocks(memorder, &free_blocks, &free_pages, &suitable_blocks);
+
+    if (!free_pages)
+        return 1000;
+
+    return ((free_pages - (suitable_blocks << memorder)) * 1000) / free_pages;
+}
+
+uint64_t mm_free_page_num()
+{
+    mm_global_area_t * global_area = mm_global_area();
+    uint64_t free_page_num = 0;
+
+    // Only read for the watermark checks and stats so we do not bother taking the area locks
+    for (unsigned int i = 0; i < global_area->area_count; i++) {
+        if (mm_area_is_initialized(&global_area->global_areas[i]))
+            free_page_num += global_area->global_areas[i].free_page_num;
+    }
+
+    return free_page_num;
+}
+
+uint64_t mm_wmark_page_num(unsigned int wmark)
+{
+    ASSERT_PANIC(wmark < MM_WMARK_NUM, "Watermark out of range.");
+
+    return atomic_ld_64(&mm_global_area()->wmark_page_num[wmark]);
+}
+
+int mm_below_wmark(unsigned int wmark)
+{
+    return mm_free_page_num() < mm_wmark_page_num(wmark);
+}
+
+uint64_t mm_free_block_num(unsigned int memorder)
+{
+    uint64_t free_blocks;
+    uint64_t free_pages;
+    uint64_t suitable_blocks;
+
+    count_free_blocks(memorder, &free_blocks, &free_pages, &suitable_blocks);
+
+    return suitable_blocks;
+}
+
+void mm_dump_frag()
+{
+    mm_global_area_t * global_area = mm_global_area();
+    unsigned int type_area_num[MM_AREA_TYPE_NUM] = {0};
+    uint64_t free_blocks;
+    uint64_t free_pages;
+    uint64_t suitable_blocks;
+    int frag_index;
+
+    for (unsigned int i = 0; i < global_area->area_count; i++) {
+        if (mm_area_is_initialized(&global_area->global_areas[i]))
+            type_area_num[global_area->global_areas[i].type]++;
+    }
+
+    lock_printlock();
+    printf("MM frag dump\n");
+    printfdigit("unmovable areas=", type_area_num[MM_TYPE_UNMOVABLE]);
+    printfdigit("reclaimable areas=", type_area_num[MM_TYPE_RECLAIMABLE]);
+    printfdigit("free areas=", type_area_num[MM_TYPE_NONE]);
+    printfdigit("unmovable steals=", global_area->type_steal_num[MM_TYPE_UNMOVABLE]);
+    printfdigit("reclaimable steals=", global_area->type_steal_num[MM_TYPE_RECLAIMABLE]);
+
+    for (unsigned int order = 0; order < MM_MAX_ORDER + 1; order++) {
+        count_free_blocks(order, &free_blocks, &free_pages, &suitable_blocks);
+        frag_index = mm_frag_index(order);
+
+        printfdigit("order=", order);
+        printfdigit(" free blocks=", free_blocks);
+        printfdigit(" unusable index=", mm_unusable_index(order));
+        if (frag_index == MM_FRAG_INDEX_FREE)
+            printf(" frag index=free\n");
+        else
+            printfdigit(" frag index=", frag_index);
+    }
+    unlock_printlock();
+}
+
 void mm_init()
 {
     DEBUG("---MM INIT START--");
@@ -235,6 +663,7 @@ void mm_init()
     size_t global_pages_size_pages_num;
     unsigned int area_num;
     mmu_mem_map_t * phys_mem_map;
+    uint64_t early_heap_top;
     int ret;
 
     ASSERT_PANIC(mm_early_is_intialized(), "Early mm is not initialized");
@@ -263,25 +692,49 @@ void mm_init()
     memset(&global_area, 0, sizeof(mm_global_area_t));
     spinlock_init(&global_area.lock);
 
-    for (int i = 0; i < MM_MAX_ORDER + 1; i++) {
-        ll_head_init(&global_area.free_areas_list[i], SLL_NODE_T);
-    }
-
-    /* Init all the global pages over the mem space. */
+    /* The global pages, page bitmap and buddies are cleared per area in mm_area_init. */
     global_area.global_pages = (mm_page_t *)page_data_alloc(global_pages_size_pages_num);
     global_area.page_count = num_pages;
-    memset(global_area.global_pages, 0, global_pages_size_pages_num * sizeof(mm_page_t));
+
+    global_area.page_valid_bitmap = (bitmap_t *)data_alloc(num_pages / BITS_PER_BYTE);
 
     /* Init the areas over the memory space. */
     align_mem(PAGE_SIZE);
     global_area.global_areas = (mm_area_t *)data_alloc(sizeof(mm_area_t) * area_num);
     memset(global_area.global_areas, 0, sizeof(mm_area_t) * area_num);
 
+    global_area.free_areas_bitmap_size = ALIGN_UP(area_num, BITMAP_BITS_PER_BITMAP_ENTRY) / BITMAP_BITS_PER_BITMAP_ENTRY;
+    for (unsigned int i = 0; i < MM_MAX_ORDER + 1; i++) {
+        global_area.free_areas_bitmap[i] = (bitmap_t *)data_alloc(global_area.free_areas_bitmap_size * sizeof(bitmap_t));
+        memset(global_area.free_areas_bitmap[i], 0, global_area.free_areas_bitmap_size * sizeof(bitmap_t));
+    }
+
+    for (unsigned int i = 0; i < MM_AREA_TYPE_NUM; i++) {
+        global_area.type_areas_bitmap[i] = (bitmap_t *)data_alloc(global_area.free_areas_bitmap_size * sizeof(bitmap_t));
+        memset(global_area.type_areas_bitmap[i], 0, global_area.free_areas_bitmap_size * sizeof(bitmap_t));
+    }
+
     align_mem(PAGE_SIZE);
     global_area.global_buddies = (kalloc_buddy_t *)data_alloc((num_pages / 2) * sizeof(kalloc_buddy_t));
-    memset(global_area.global_buddies, 0, (num_pages / 2) * sizeof(kalloc_buddy_t));
 
-    for (unsigned int i = 0; i < area_num; i++) {
+    global_area.area_count = area_num;
+
+    /* Everything below the early heap top is code and data that was placed there at boot,
+     * and everything past the start of device memory is innaccesible. Both are reserved as
+     * the areas are initialized. */
+    early_heap_top = (uint64_t)mm_early_get_heap_top();
+    free_page_start = ALIGN_UP(early_heap_top, PAGE_SIZE) / PAGE_SIZE;
+    free_page_end = phys_mem_map[EARLY_MEM_MAP_DEVICE_MEM_START].start_addr / PAGE_SIZE;
+    if (free_page_end > num_pages)
+        free_page_end = num_pages;
+
+    /* Only init the areas holding early memory plus a few free ones, the rest of the page structs
+     * get initialized by the secondary cores in mm_deferred_init. */
+    boot_area_num = MM_AREA_INDEX(ALIGN_UP(early_heap_top, MM_AREA_SIZE)) + MM_BOOT_FREE_AREA_NUM;
+    if (boot_area_num > area_num)
+        boot_area_num = area_num;
+
+    for (unsigned int i = 0; i < boot_area_num; i++) {
         ret = mm_area_init(&global_area, &global_area.global_areas[i], (i * MM_AREA_SIZE)/PAGE_SIZE);
         if (ret) {
             DEBUG_PANIC("MM area init failed");
@@ -289,11 +742,19 @@ void mm_init()
         }
     }
 
-    global_area.area_count = area_num;
+    deferred_area_next = boot_area_num;
+    deferred_area_done = 0;
 
-    mm_initialized = 1;
+    /* Spread the cores over the initialized areas. */
+    for (unsigned int i = 0; i < CORE_NUM; i++) {
+        for (unsigned int type = 0; type < MM_TYPE_NUM; type++) {
+            home_areas[i][type] = &global_area.global_areas[(i * boot_area_num) / CORE_NUM];
+        }
+    }
+
+    DEBUG_FUNC_DIGIT("-Boot area num=", boot_area_num);
 
-    mm_reserve_early_mem(phys_mem_map, (uint64_t)mm_early_get_heap_top());
+    mm_initialized = 1;
 
     DEBUG("---MM INIT DONE---");
 }
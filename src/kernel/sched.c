@@ -4,6 +4,9 @@
 #include <kernel/sched.h>
 #include <kernel/task.h>
 #include <kernel/kalloc.h>
+#include <kernel/kalloc_zero.h>
+#include <kernel/kalloc_compact.h>
+#include <kernel/kalloc_reclaim.h>
 #include <kernel/printf.h>
 #include <kernel/cpu.h>
 #include <common/aarch64_common.h>
@@ -52,6 +55,9 @@ void idle_loop()
 {
     while (1) {
         //systemtimer_wait(1000);
+
+        // Use the idle time to zero pages ahead of KALLOC_ZERO_F allocs
+        kalloc_zero_fill(KALLOC_ZERO_IDLE_BATCH);
         
         sched_yield();
     }
@@ -123,7 +129,7 @@ static task_t * get_idle_task()
 
 static void sched_add_readyqueue(task_t * task, unsigned int ready_queue_num)
 {   
-    if (!TASK_VALID(task) && queue_valid(&task->sched_chain) && ready_queue_num < READY_QUEUE_NUM) {
+    if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !TASK_VALID(task) && queue_valid(&task->sched_chain) && ready_queue_num < READY_QUEUE_NUM) {
         DEBUG_PANIC("TASK IS NOT VALID");
     }
 
@@ -217,7 +223,7 @@ static void _event_signal(event_id_t ev, bool signal_all)
     wake_task = NULL;
     queue_iter_safe(q, qe, prev_qe) {
         task = qe_chain_access(qe, task_t, wait_chain);
-        if (!TASK_VALID(task)) {
+        if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !TASK_VALID(task)) {
             DEBUG_PANIC("TASK IS NOT VALID");
         }
 
@@ -270,7 +276,7 @@ void sched_async_timeout()
     if (curr_task->state & TASK_PAUSED && !(curr_task->state & TASK_IDLE)) {
         curr_task->state &= ~TASK_PAUSED;
         curr_task->state |= TASK_READY;
-        if (!TASK_VALID(curr_task)) {
+        if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !TASK_VALID(curr_task)) {
             DEBUG_PANIC_ALL("TASK NOT VALID");
         }
 
@@ -299,7 +305,7 @@ static void sched_ready_queue_tick()
         queue_iter_safe(&ready_queue[i], qe, qe_prev) {
             task = qe_chain_access(qe, task_t, sched_chain);
 
-            if (!TASK_VALID(task)) {
+            if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !TASK_VALID(task)) {
                 DEBUG_PANIC("RQ CHAIN NOT VALID");
             }
 
@@ -365,7 +371,7 @@ void sched_timer_isr()
 
     for (int i = 0; i < CORE_NUM; i++) {
         task = cpu_get_percpu_info(i)->curr_task;
-        if (!TASK_VALID(task)) {
+        if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !TASK_VALID(task)) {
             DEBUG_PANIC_ALL("TASK IS NOT VALID");
         }
         /* Task is on the ready list or an idle task, ignore it. */
@@ -417,10 +423,12 @@ task_t * sched_task_select()
         next_task = IDLE_TASK;
     }
 
-    if (!TASK_VALID(next_task)) {
-        DEBUG_DATA("TASK ADDR=", next_task);
-        DEBUG_DATA("Failed task id=", next_task->task_id);
-        DEBUG_DATA("Failed task state=", next_task->state);
+    if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !TASK_VALID(next_task)) {
+        if (CHECK_ENABLED(CHECK_LEVEL_FULL)) {
+            DEBUG_DATA("TASK ADDR=", next_task);
+            DEBUG_DATA("Failed task id=", next_task->task_id);
+            DEBUG_DATA("Failed task state=", next_task->state);
+        }
         DEBUG_PANIC_ALL("Task is not valid");
     }
     
@@ -434,7 +442,7 @@ task_t * sched_task_select()
 void sched_task_wakeup(task_t * task)
 {
 
-    if (!TASK_VALID(task)) {
+    if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !TASK_VALID(task)) {
         DEBUG_PANIC("TASK NOT VALID");
     }
 
@@ -523,7 +531,7 @@ void sched_task_sleep()
 void sched_task_switch(task_t * task)
 {
     cpu_get_currcpu_info()->curr_task = task;
-    if (!TASK_VALID(task)) {
+    if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !TASK_VALID(task)) {
         DEBUG_PANIC("TASK NOT VALID");
     }
     task->state &= ~TASK_BLOCK_STATES;
@@ -550,7 +558,7 @@ void sched_yield()
 
     curr_task = cpu_get_currcpu_info()->curr_task;
 
-    if (!TASK_VALID(curr_task)) {
+    if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !TASK_VALID(curr_task)) {
         DEBUG_PANIC_ALL("TASK INVALID");
     }
 
@@ -572,7 +580,7 @@ void sched_task_add(task_t * task, task_state_t start_state, unsigned int starti
 {
     sched_enter();
 
-    if (!TASK_VALID(task)) {
+    if (CHECK_ENABLED(CHECK_LEVEL_CHEAP) && !TASK_VALID(task)) {
         DEBUG_PANIC("TASK IS MALFORMED");
     }
 
@@ -587,12 +595,16 @@ void sched_task_add(task_t * task, task_state_t start_state, unsigned int starti
 
 static void sched_test(void * code_addr)
 {
-    task_t * task;
+    task_t * tasks[CORE_NUM];
+
+    for (int i = 0; i < CORE_NUM; i++) {
+        tasks[i] = task_alloc();
+    }
+
+    task_create_bulk(&tasks[0], CORE_NUM, code_addr);
 
     for (int i = 0; i < CORE_NUM; i++) {
-        task = (task_t *)kalloc_alloc(sizeof(task_t), 0);
-        task_create(task, code_addr);
-        sched_task_add(task, 0, READY_QUEUE_NUM - 1);
+        sched_task_add(tasks[i], 0, READY_QUEUE_NUM - 1);
     }
 }
 
@@ -600,6 +612,9 @@ void sched_init()
 {
     cpu_info_t * cpu;
     task_t * task;
+    task_t * tasks[CORE_NUM];
+    task_t * compact_task;
+    task_t * reclaim_task;
     cpu_init_info();
 
     for (int i = 0; i < READY_QUEUE_NUM; i++) {
@@ -615,9 +630,14 @@ void sched_init()
     }
 
     for (int i = 0; i < CORE_NUM; i++) {
-        DEBUG("IDLE TASK");
-        task_create(&idle_tasks[i], idle_loop);
+        task_ctor(&idle_tasks[i]);
+        tasks[i] = &idle_tasks[i];
+    }
+
+    DEBUG("IDLE TASKS");
+    task_create_bulk(&tasks[0], CORE_NUM, idle_loop);
 
+    for (int i = 0; i < CORE_NUM; i++) {
         idle_tasks[i].state = TASK_IDLE;     
         cpu = cpu_get_percpu_info(i);
         
@@ -629,6 +649,15 @@ void sched_init()
     lock_init(&sched_lock);
     last_sched_timestamp = localtimer_gettime();
 
+    /* Kernel daemons at the lowest priority, they mostly run when the cores have nothing else to do. */
+    compact_task = task_alloc();
+    task_create(compact_task, kalloc_compact_task);
+    sched_task_add(compact_task, 0, READY_QUEUE_LAST);
+
+    reclaim_task = task_alloc();
+    task_create(reclaim_task, kalloc_reclaim_task);
+    sched_task_add(reclaim_task, 0, READY_QUEUE_LAST);
+
     /* TEST INIT */
 
     #define TEST_NUM 2
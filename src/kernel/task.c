@@ -12,6 +12,9 @@
 
 uint32_t top_task_id = 0;
 
+/* Tasks come out of their cache already constructed, task_init only sets up what differs per task. */
+static kalloc_cache_t * task_cache;
+
 #define TASK_QUANTA_MS 1000
 #define TASK_QUANTA_US (TIME_MS_TO_US(TASK_QUANTA_MS)) // 10MS, 10000 us
 
@@ -41,25 +44,53 @@ void task_reload(task_t * task)
     task->sched_wait_ticks = SCHED_WAIT_TICKS;
 }
 
+void task_ctor(void * obj)
+{
+    task_t * task = (task_t *)obj;
+
+    memset(task, 0, sizeof(task_t));
+
+    task->quanta = TASK_QUANTA_US;
+    task->magic = TASK_MAGIC_VAL;
+    queue_zero(&task->sched_chain);
+    queue_zero(&task->wait_chain);
+    task->wait_event.id = 0;
+
+    spinlock_init(&task->lock);
+}
+
+void task_cache_init()
+{
+    task_cache = kalloc_cache_create("task", sizeof(task_t), sizeof(uint64_t), task_ctor, NULL);
+    ASSERT_PANIC(task_cache, "Could not create the task cache");
+}
+
+task_t * task_alloc()
+{
+    return (task_t *)kalloc_obj_alloc(task_cache);
+}
+
+void task_free(task_t * task)
+{
+    ASSERT_PANIC(!queue_valid(&task->wait_chain), "Task freed while still queued");
+
+    // Objs go back constructed, the rest of the fields are set again by task_init
+    task->state = 0;
+    task->wait_event.id = 0;
+    kalloc_obj_free(task_cache, task);
+}
+
 void task_init(task_t * task, uint64_t * stack_top, uint64_t * start_addr)
 {   
     uint64_t * top;
 
-    memset(task, 0, sizeof(size_t));
+    ASSERT_PANIC(TASK_VALID(task), "Task is not constructed");
 
     top = task_init_stack(stack_top, start_addr, NULL);
 
     task->el1_stack_ptr = top;
     task->task_id = task_generate_id();
-    task->quanta = TASK_QUANTA_US;
     task_reload(task);
-
-    task->magic = TASK_MAGIC_VAL;
-    queue_zero(&task->sched_chain);
-    queue_zero(&task->wait_chain);
-    task->wait_event.id = 0;
-
-    spinlock_init(&task->lock);
     
     DEBUG_DATA("Task INIT id = ", task->task_id);
     DEBUG_DATA("TASK INIT Task =", task);
@@ -68,14 +99,41 @@ void task_init(task_t * task, uint64_t * stack_top, uint64_t * start_addr)
 
 }
 
-void task_create(task_t * task, void * code_addr)
+/* Max number of stacks we grab from the page allocator at a time. */
+#define TASK_CREATE_BULK_NUM 8
+/* Stacks are never moved once a task is running on them, they stay with the unmovable pages. */
+#define TASK_STACK_FLAGS 0
+
+static void task_init_stack_mem(task_t * task, void * task_stack, void * code_addr)
 {
-    uint64_t task_stack;
-    
-    task_stack = (uint64_t)kalloc_alloc(PAGE_SIZE, 0);
+    ASSERT_PANIC(task_stack, "Could not alloc task stack");
     memset_64((uint64_t *)task_stack, STACK_DEAD_VAL, PAGE_SIZE);
-    ASSERT_PANIC(task_stack, "Could not alloc idle task stack");
     task_stack = (char *)task_stack + (PAGE_SIZE);
 
-    task_init(task, task_stack, code_addr);
-}
\ No newline at end of file
+    task_init(task, (uint64_t *)task_stack, (uint64_t *)code_addr);
+}
+
+void task_create(task_t * task, void * code_addr)
+{
+    task_init_stack_mem(task, kalloc_alloc(PAGE_SIZE, TASK_STACK_FLAGS), code_addr);
+}
+
+void task_create_bulk(task_t ** tasks, unsigned int task_num, void * code_addr)
+{
+    void * stacks[TASK_CREATE_BULK_NUM];
+    unsigned int num;
+    unsigned int ret;
+
+    for (unsigned int i = 0; i < task_num; i += num) {
+        num = task_num - i;
+        if (num > TASK_CREATE_BULK_NUM)
+            num = TASK_CREATE_BULK_NUM;
+
+        ret = kalloc_pages_bulk(1, num, &stacks[0], TASK_STACK_FLAGS);
+        ASSERT_PANIC(ret == num, "Could not alloc task stacks");
+
+        for (unsigned int j = 0; j < num; j++) {
+            task_init_stack_mem(tasks[i + j], stacks[j], code_addr);
+        }
+    }
+}
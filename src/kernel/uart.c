@@ -71,6 +71,18 @@ char uart_getc() {
     return reg;
 }
 
+/* Returns -1 right away when nothing has been received. */
+int uart_trygetc() {
+    char reg;
+
+    if (!(*AUX_MU_LSR & 0x01))
+        return -1;
+
+    reg = (char)(*AUX_MU_IO);
+    reg = (reg == '\r') ? '\n' : reg;
+    return reg;
+}
+
 void uart_hex(uint64_t d) {
     uint32_t n;
     uart_puts("0x");